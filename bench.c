@@ -0,0 +1,650 @@
+/*
+ * Benchmarks for the gadget scanner.
+ *
+ * Runs the gadget search over synthetic arm64 Mach-O images (or a real one given with --image)
+ * with each search engine, sweeping over the image size, the number of gadgets, and the number
+ * of threads. The results are printed to stdout as CSV, one row per configuration, so that runs
+ * can be compared for regression tracking. Every engine must find the same addresses; if one
+ * doesn't, the benchmark fails.
+ */
+#include "gadget_index.h"
+#include "macho.h"
+#include "matcher.h"
+#include "range_list.h"
+#include "scan.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void _Noreturn verror(const char *fmt, va_list ap) {
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	exit(2);
+}
+
+static void _Noreturn error(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	verror(fmt, ap);
+}
+
+void macho_error(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	verror(fmt, ap);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A xorshift64* generator, so that runs with the same seed build the same images.
+static uint64_t rng_state;
+
+static uint64_t rng(void) {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1d;
+}
+
+static uint32_t rng_bits(unsigned bits) {
+	return rng() >> (64 - bits);
+}
+
+// Generate an instruction word with the rough opcode mix of compiled arm64 code.
+static uint32_t random_instruction(void) {
+	uint32_t rd = rng_bits(5), rn = rng_bits(5), rm = rng_bits(5);
+	switch (rng_bits(4)) {
+		case 0:  return 0x91000000 | rng_bits(12) << 10 | rn << 5 | rd;      // add
+		case 1:  return 0xd1000000 | rng_bits(12) << 10 | rn << 5 | rd;      // sub
+		case 2:
+		case 3:  return 0xf9400000 | rng_bits(12) << 10 | rn << 5 | rd;      // ldr
+		case 4:  return 0xf9000000 | rng_bits(12) << 10 | rn << 5 | rd;      // str
+		case 5:  return 0xaa0003e0 | rm << 16 | rd;                          // mov
+		case 6:
+		case 7:  return 0x94000000 | rng_bits(26);                           // bl
+		case 8:  return 0x54000000 | rng_bits(19) << 5 | rng_bits(4);        // b.cond
+		case 9:  return 0xb4000000 | rng_bits(19) << 5 | rd;                 // cbz
+		case 10: return 0xa9000000 | rng_bits(7) << 15 | rm << 10 | rn << 5 | rd; // stp
+		case 11: return 0xa9400000 | rng_bits(7) << 15 | rm << 10 | rn << 5 | rd; // ldp
+		case 12: return 0x90000000 | rng_bits(2) << 29 | rng_bits(19) << 5 | rd; // adrp
+		case 13: return 0xeb00001f | rm << 16 | rn << 5;                     // cmp
+		case 14: return 0x2a0003e0 | rm << 16 | rd;                          // mov w
+		default: return (rng_bits(3) == 0 ? 0xd65f03c0 : 0xd503201f);        // ret, nop
+	}
+}
+
+// Build a 64-bit arm64 Mach-O with a __TEXT_EXEC segment of the given size filled with random
+// instructions.
+static void build_image(size_t text_size, uint8_t **file, size_t *file_size) {
+	const size_t text_offset = 0x4000;
+	text_size = (text_size + 0x3fff) & ~(size_t)0x3fff;
+	*file_size = text_offset + text_size;
+	*file = calloc(1, *file_size);
+	if (*file == NULL) {
+		error("Could not allocate a %zu-byte image", *file_size);
+	}
+	struct mach_header_64 *mh = (struct mach_header_64 *)*file;
+	mh->magic = MH_MAGIC_64;
+	mh->cputype = CPU_TYPE_ARM64;
+	mh->filetype = MH_EXECUTE;
+	uint8_t *lc = (uint8_t *)(mh + 1);
+	struct segment_command_64 *text = (struct segment_command_64 *)lc;
+	text->cmd = LC_SEGMENT_64;
+	text->cmdsize = sizeof(*text);
+	strcpy(text->segname, "__TEXT");
+	text->vmaddr = 0xfffffff007004000;
+	text->vmsize = text_offset;
+	text->filesize = text_offset;
+	text->maxprot = text->initprot = VM_PROT_READ;
+	lc += text->cmdsize;
+	struct segment_command_64 *exec = (struct segment_command_64 *)lc;
+	struct section_64 *sect = (struct section_64 *)(exec + 1);
+	exec->cmd = LC_SEGMENT_64;
+	exec->cmdsize = sizeof(*exec) + sizeof(*sect);
+	strcpy(exec->segname, "__TEXT_EXEC");
+	exec->vmaddr = text->vmaddr + text_offset;
+	exec->vmsize = text_size;
+	exec->fileoff = text_offset;
+	exec->filesize = text_size;
+	exec->maxprot = exec->initprot = VM_PROT_READ | VM_PROT_EXECUTE;
+	exec->nsects = 1;
+	strcpy(sect->sectname, "__text");
+	strcpy(sect->segname, "__TEXT_EXEC");
+	sect->addr = exec->vmaddr;
+	sect->size = text_size;
+	sect->offset = text_offset;
+	sect->flags = S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS;
+	lc += exec->cmdsize;
+	struct uuid_command *uc = (struct uuid_command *)lc;
+	uc->cmd = LC_UUID;
+	uc->cmdsize = sizeof(*uc);
+	for (int i = 0; i < 16; i++) {
+		uc->uuid[i] = rng_bits(8);
+	}
+	lc += uc->cmdsize;
+	mh->ncmds = 3;
+	mh->sizeofcmds = lc - (uint8_t *)(mh + 1);
+	uint32_t *words = (uint32_t *)(*file + text_offset);
+	for (size_t i = 0; i < text_size / 4; i++) {
+		words[i] = random_instruction();
+	}
+}
+
+static void map_image(const char *path, uint8_t **file, size_t *file_size) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		error("Could not open '%s'", path);
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		error("Could not stat '%s'", path);
+	}
+	*file_size = st.st_size;
+	*file = mmap(NULL, *file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (*file == MAP_FAILED) {
+		error("Could not mmap '%s'", path);
+	}
+	close(fd);
+}
+
+// Collect the ranges of the image that the filter selects, including those of every fileset
+// entry.
+static void image_ranges(const struct macho *macho, const struct range_filter *filter,
+		struct range_list *list) {
+	range_list_init(list);
+	list->filter = filter;
+	bool success = (macho_is_fileset(macho)
+			? range_list_add_fileset(list, macho, NULL, 0)
+			: range_list_add_macho(list, macho));
+	if (!success) {
+		error("%s", list->error);
+	}
+}
+
+static size_t range_bytes(const struct range_list *list) {
+	size_t bytes = 0;
+	for (size_t i = 0; i < list->count; i++) {
+		bytes += list->ranges[i].size;
+	}
+	return bytes;
+}
+
+// Generate count gadgets of 1 to 4 words into data. Gadgets at even indices are taken from
+// the image so that they are found, either planted at a random position (if plant is true) or
+// copied from one; those at odd indices are random words that are almost surely absent, so
+// that the scan doesn't stop early.
+static void make_gadgets(struct gadget *gadgets, uint32_t *data, char *names, size_t count,
+		const struct range_list *list, bool plant) {
+	for (size_t i = 0; i < count; i++) {
+		size_t nwords = 1 + rng_bits(2);
+		uint32_t *words = &data[4 * i];
+		const struct scan_range *r = &list->ranges[rng() % list->count];
+		size_t nslots = r->size / 4;
+		if (i % 2 == 0 && nslots > nwords) {
+			uint32_t *text = (uint32_t *)r->data;
+			size_t slot = rng() % (nslots - nwords);
+			if (plant) {
+				nwords = 4;
+				for (size_t j = 0; j < nwords; j++) {
+					text[slot + j] = words[j] = random_instruction();
+				}
+			} else {
+				memcpy(words, &text[slot], nwords * 4);
+			}
+		} else {
+			for (size_t j = 0; j < nwords; j++) {
+				words[j] = rng();
+			}
+		}
+		char *name = &names[24 * i];
+		snprintf(name, 24, "G%zu", i);
+		gadgets[i].name = name;
+		gadgets[i].data = words;
+		gadgets[i].mask = NULL;
+		gadgets[i].size = 4 * nwords;
+		gadgets[i].address = 0;
+	}
+}
+
+// The plain search that macho_search_data does: a memmem per gadget, keeping aligned matches.
+static void naive_scan(const struct gadget *gadgets, size_t count, const struct range_list *list,
+		uint64_t *addresses) {
+	for (size_t i = 0; i < count; i++) {
+		addresses[i] = 0;
+		for (size_t k = 0; k < list->count && addresses[i] == 0; k++) {
+			const struct scan_range *r = &list->ranges[k];
+			const uint8_t *p = r->data;
+			const uint8_t *end = p + r->size;
+			while (p < end) {
+				p = memmem(p, end - p, gadgets[i].data, gadgets[i].size);
+				if (p == NULL) {
+					break;
+				}
+				uint64_t address = r->address + (p - (const uint8_t *)r->data);
+				if (address % 4 == 0) {
+					addresses[i] = address;
+					break;
+				}
+				p++;
+			}
+		}
+	}
+}
+
+// The unaligned engine also reports matches at unaligned addresses, so it comes last and is
+// only checked against the others' matches.
+enum engine {
+	ENGINE_NAIVE,
+	ENGINE_SCALAR,
+	ENGINE_SIMD,
+	ENGINE_INDEX,
+	ENGINE_UNALIGNED,
+	ENGINE_COUNT,
+};
+
+static const char *engine_names[ENGINE_COUNT] = {
+	"naive", "scalar", "simd", "index", "unaligned",
+};
+
+struct config {
+	const char *image;
+	size_t sizes[16];
+	size_t nsizes;
+	size_t gadgets[16];
+	size_t ngadgets;
+	size_t threads[16];
+	size_t nthreads;
+	bool engines[ENGINE_COUNT];
+	unsigned repeat;
+	size_t naive_max;
+	const char *write;
+	const char *index_path;
+};
+
+static void parse_list(const char *str, size_t *values, size_t *count, size_t max,
+		const char *what) {
+	*count = 0;
+	for (const char *p = str; *p != 0;) {
+		char *end;
+		unsigned long long value = strtoull(p, &end, 10);
+		if (end == p || (*end != ',' && *end != 0) || *count == max) {
+			error("Invalid %s list '%s'", what, str);
+		}
+		values[(*count)++] = value;
+		p = (*end == ',' ? end + 1 : end);
+	}
+	if (*count == 0) {
+		error("Empty %s list", what);
+	}
+}
+
+static size_t parse_count(const char *str, const char *what) {
+	char *end;
+	unsigned long long value = strtoull(str, &end, 10);
+	if (*str == 0 || *end != 0) {
+		error("Invalid %s '%s'", what, str);
+	}
+	return value;
+}
+
+static void parse_engines(const char *str, bool *engines) {
+	memset(engines, 0, ENGINE_COUNT * sizeof(*engines));
+	char *copy = strdup(str);
+	for (char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		int e = 0;
+		while (e < ENGINE_COUNT && strcmp(tok, engine_names[e]) != 0) {
+			e++;
+		}
+		if (e == ENGINE_COUNT) {
+			error("Unknown engine '%s'", tok);
+		}
+		engines[e] = true;
+	}
+	free(copy);
+}
+
+// State shared by the runs over one image.
+struct bench {
+	const struct config *config;
+	const char *image_name;
+	const struct range_list *list;
+	size_t bytes;
+	const uint8_t *uuid;
+	struct gadget_index index;
+	bool have_index;
+};
+
+static void report(const struct bench *b, enum engine engine, const char *kernel,
+		size_t ngadgets, size_t threads, double seconds, size_t found) {
+	double bytes = b->bytes;
+	printf("%s,%zu,%s,%s,%zu,%zu,%.6f,%.1f,%.3f,%zu\n", b->image_name, b->bytes,
+			engine_names[engine], kernel, ngadgets, threads, seconds,
+			bytes / seconds / 1e6, seconds * 1e9 / bytes, found);
+	fflush(stdout);
+}
+
+// Run one engine, returning the best time over the repetitions and the addresses found.
+static double run_engine(struct bench *b, enum engine engine, const struct gadget *gadgets,
+		size_t count, size_t threads, uint64_t *addresses, const char **kernel) {
+	struct matcher matcher;
+	bool have_matcher = false;
+	*kernel = "-";
+	if (engine != ENGINE_NAIVE) {
+		if (!matcher_init(&matcher, gadgets, count, (engine == ENGINE_UNALIGNED ? 1 : 4))) {
+			error("Could not allocate gadget matcher");
+		}
+		if (engine == ENGINE_SCALAR) {
+			matcher.kernel = MATCHER_KERNEL_SCALAR;
+		}
+		if (engine != ENGINE_UNALIGNED) {
+			*kernel = matcher_kernel_name(matcher.kernel);
+		}
+		have_matcher = true;
+	}
+	double best = 0;
+	for (unsigned rep = 0; rep < b->config->repeat; rep++) {
+		double start = now();
+		if (engine == ENGINE_NAIVE) {
+			naive_scan(gadgets, count, b->list, addresses);
+		} else {
+			struct matcher_state state;
+			if (!matcher_state_init(&state, &matcher)) {
+				error("Could not allocate scan state");
+			}
+			bool ok;
+			if (engine == ENGINE_INDEX) {
+				ok = gadget_index_scan(&b->index, &matcher, &state, NULL, 0);
+			} else {
+				ok = scan_ranges(&matcher, &state, b->list->ranges, b->list->count,
+						threads, NULL, NULL, NULL);
+			}
+			if (!ok) {
+				error("Could not allocate scan state");
+			}
+			memcpy(addresses, state.addresses, count * sizeof(*addresses));
+			matcher_state_deinit(&state);
+		}
+		double elapsed = now() - start;
+		if (rep == 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+	if (have_matcher) {
+		matcher_deinit(&matcher);
+	}
+	return best;
+}
+
+static void bench_image(const struct config *config, const char *image_name,
+		const struct range_list *list, const uint8_t *uuid, struct gadget *gadgets,
+		size_t max_gadgets) {
+	struct bench b = { config, image_name, list, range_bytes(list), uuid };
+	if (config->engines[ENGINE_INDEX]) {
+		double start = now();
+		if (!gadget_index_build(list->ranges, list->count, uuid, config->index_path)
+				|| !gadget_index_open(&b.index, config->index_path, uuid)) {
+			error("Could not build gadget index '%s'", config->index_path);
+		}
+		report(&b, ENGINE_INDEX, "build", 0, 1, now() - start, 0);
+		b.have_index = true;
+	}
+	uint64_t *expected = malloc(max_gadgets * sizeof(*expected));
+	uint64_t *addresses = malloc(max_gadgets * sizeof(*addresses));
+	if (expected == NULL || addresses == NULL) {
+		error("Could not allocate addresses");
+	}
+	for (size_t g = 0; g < config->ngadgets; g++) {
+		size_t count = config->gadgets[g];
+		bool have_expected = false;
+		for (size_t t = 0; t < config->nthreads; t++) {
+			size_t threads = config->threads[t];
+			for (int e = 0; e < ENGINE_COUNT; e++) {
+				if (!config->engines[e]
+						|| (e == ENGINE_NAIVE && count > config->naive_max)
+						|| ((e == ENGINE_NAIVE || e == ENGINE_INDEX) && t > 0)) {
+					continue;
+				}
+				const char *kernel;
+				double seconds = run_engine(&b, e, gadgets, count, threads,
+						addresses, &kernel);
+				size_t found = 0;
+				for (size_t i = 0; i < count; i++) {
+					found += (addresses[i] != 0);
+				}
+				report(&b, e, kernel, count, (e == ENGINE_NAIVE || e == ENGINE_INDEX ?
+							1 : threads), seconds, found);
+				if (e == ENGINE_UNALIGNED) {
+					for (size_t i = 0; have_expected && i < count; i++) {
+						if (expected[i] != 0 && (addresses[i] == 0
+									|| addresses[i] > expected[i])) {
+							error("Engine %s missed gadget %zu", engine_names[e], i);
+						}
+					}
+				} else if (!have_expected) {
+					memcpy(expected, addresses, count * sizeof(*expected));
+					have_expected = true;
+				} else if (memcmp(expected, addresses, count * sizeof(*expected)) != 0) {
+					error("Engine %s found different addresses with %zu gadgets",
+							engine_names[e], count);
+				}
+			}
+		}
+	}
+	if (b.have_index) {
+		gadget_index_close(&b.index);
+		unlink(config->index_path);
+	}
+	free(expected);
+	free(addresses);
+}
+
+static void _Noreturn usage(const char *argv0) {
+	error("Usage: %s [options]\n"
+	      "\n"
+	      "  --image=PATH          Benchmark a real Mach-O file instead of synthetic images.\n"
+	      "  --sizes=MB,...        Sizes of the synthetic images' text. Default 16,64.\n"
+	      "  --gadgets=N,...       Numbers of gadgets. Default 1,16,256,4096.\n"
+	      "  --threads=N,...       Thread counts. Default 1 and the number of CPUs.\n"
+	      "  --engines=E,...       Engines to run: naive, scalar, simd, index, and unaligned.\n"
+	      "                        Default all.\n"
+	      "  --naive-max=N         Skip the naive engine above N gadgets. Default 64.\n"
+	      "  --repeat=N            Report the best of N runs. Default 3.\n"
+	      "  --seed=N              Seed for the synthetic images and gadgets. Default 1.\n"
+	      "  --write=PATH          Write the last synthetic image to PATH.\n"
+	      "  --section=NAME        Only scan the sections named NAME, as SEGMENT or\n"
+	      "                        SEGMENT,SECTION. May be given more than once.\n"
+	      "  --exclude-section=NAME\n"
+	      "                        Don't scan the sections named NAME.\n"
+	      "  --any-section         Scan every section of the executable segments.\n"
+	      "  --whole-segments      Scan the whole executable segments. By default only their\n"
+	      "                        sections marked as holding instructions are scanned.\n"
+	      "  --address=START-END   Only scan the addresses from START up to END.\n"
+	      "\n"
+	      "Results are printed as CSV with the columns image, bytes, engine, kernel, gadgets,\n"
+	      "threads, seconds, mb_per_s, ns_per_byte, and found.",
+	      argv0);
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option longopts[] = {
+		{ "image",          required_argument, NULL, 'i' },
+		{ "sizes",          required_argument, NULL, 's' },
+		{ "gadgets",        required_argument, NULL, 'g' },
+		{ "threads",        required_argument, NULL, 'j' },
+		{ "engines",        required_argument, NULL, 'e' },
+		{ "naive-max",      required_argument, NULL, 'n' },
+		{ "repeat",         required_argument, NULL, 'r' },
+		{ "seed",           required_argument, NULL, 'S' },
+		{ "write",          required_argument, NULL, 'w' },
+		{ "section",        required_argument, NULL, 'N' },
+		{ "exclude-section", required_argument, NULL, 'x' },
+		{ "any-section",    no_argument,       NULL, 'E' },
+		{ "whole-segments", no_argument,       NULL, 'W' },
+		{ "address",        required_argument, NULL, 'a' },
+		{ NULL,             0,                 NULL, 0   },
+	};
+	struct config config = {
+		.sizes = { 16, 64 }, .nsizes = 2,
+		.gadgets = { 1, 16, 256, 4096 }, .ngadgets = 4,
+		.threads = { 1 }, .nthreads = 1,
+		.repeat = 3, .naive_max = 64,
+	};
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus > 1) {
+		config.threads[config.nthreads++] = ncpus;
+	}
+	for (int e = 0; e < ENGINE_COUNT; e++) {
+		config.engines[e] = true;
+	}
+	// Like macho_gadgets, scan only the code sections by default.
+	struct range_filter filter = { .sections = true };
+	const char *include[16], *exclude[16];
+	struct address_range address = {};
+	char *end;
+	rng_state = 1;
+	for (;;) {
+		int opt = getopt_long(argc, argv, "", longopts, NULL);
+		if (opt == -1) {
+			break;
+		}
+		switch (opt) {
+			case 'i':
+				config.image = optarg;
+				break;
+			case 's':
+				parse_list(optarg, config.sizes, &config.nsizes, 16, "size");
+				break;
+			case 'g':
+				parse_list(optarg, config.gadgets, &config.ngadgets, 16, "gadget");
+				break;
+			case 'j':
+				parse_list(optarg, config.threads, &config.nthreads, 16, "thread");
+				break;
+			case 'e':
+				parse_engines(optarg, config.engines);
+				break;
+			case 'n':
+				config.naive_max = parse_count(optarg, "naive gadget limit");
+				break;
+			case 'r':
+				config.repeat = parse_count(optarg, "repeat count");
+				break;
+			case 'S':
+				rng_state = parse_count(optarg, "seed") | 1;
+				break;
+			case 'w':
+				config.write = optarg;
+				break;
+			case 'N':
+			case 'x':
+				if ((opt == 'N' ? filter.ninclude : filter.nexclude) == 16) {
+					error("Too many section names");
+				}
+				if (opt == 'N') {
+					include[filter.ninclude++] = optarg;
+				} else {
+					exclude[filter.nexclude++] = optarg;
+				}
+				break;
+			case 'E':
+				filter.any_section = true;
+				break;
+			case 'W':
+				filter.sections = false;
+				break;
+			case 'a':
+				address.start = strtoull(optarg, &end, 0);
+				if (*end == '-') {
+					address.end = strtoull(end + 1, &end, 0);
+				}
+				if (end == optarg || *end != 0 || address.end <= address.start) {
+					error("Invalid address range '%s'", optarg);
+				}
+				filter.addresses = &address;
+				filter.naddresses = 1;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc || config.repeat == 0) {
+		usage(argv[0]);
+	}
+	filter.include = include;
+	filter.exclude = exclude;
+	char index_path[64];
+	snprintf(index_path, sizeof(index_path), "/tmp/macho_gadgets_bench.%ld.gidx",
+			(long)getpid());
+	config.index_path = index_path;
+	size_t max_gadgets = 1;
+	for (size_t g = 0; g < config.ngadgets; g++) {
+		if (config.gadgets[g] > max_gadgets) {
+			max_gadgets = config.gadgets[g];
+		}
+	}
+	struct gadget *gadgets = malloc(max_gadgets * sizeof(*gadgets));
+	uint32_t *data = malloc(max_gadgets * 4 * sizeof(*data));
+	char *names = malloc(max_gadgets * 24);
+	if (gadgets == NULL || data == NULL || names == NULL) {
+		error("Could not allocate gadgets");
+	}
+	printf("image,bytes,engine,kernel,gadgets,threads,seconds,mb_per_s,ns_per_byte,found\n");
+	size_t nimages = (config.image != NULL ? 1 : config.nsizes);
+	for (size_t k = 0; k < nimages; k++) {
+		uint8_t *file;
+		size_t file_size;
+		char image_name[32];
+		const char *name = image_name;
+		if (config.image != NULL) {
+			map_image(config.image, &file, &file_size);
+			name = config.image;
+		} else {
+			build_image(config.sizes[k] << 20, &file, &file_size);
+			snprintf(image_name, sizeof(image_name), "synthetic-%zuMB", config.sizes[k]);
+		}
+		if (macho_validate(file, file_size) != MACHO_SUCCESS) {
+			error("'%s' is not a Mach-O file", name);
+		}
+		struct macho macho = { .mh = file, .size = file_size };
+		struct range_list list;
+		image_ranges(&macho, &filter, &list);
+		if (list.count == 0) {
+			error("'%s' has nothing to scan", name);
+		}
+		const struct uuid_command *uc = (const struct uuid_command *)
+			macho_find_load_command(&macho, NULL, LC_UUID);
+		static const uint8_t no_uuid[16];
+		make_gadgets(gadgets, data, names, max_gadgets, &list, config.image == NULL);
+		bench_image(&config, name, &list, (uc != NULL ? uc->uuid : no_uuid), gadgets,
+				max_gadgets);
+		if (config.image != NULL) {
+			munmap(file, file_size);
+		} else {
+			if (config.write != NULL && k + 1 == nimages) {
+				FILE *out = fopen(config.write, "wb");
+				if (out == NULL || fwrite(file, 1, file_size, out) != file_size
+						|| fclose(out) != 0) {
+					error("Could not write '%s'", config.write);
+				}
+			}
+			free(file);
+		}
+		range_list_free(&list);
+	}
+	free(gadgets);
+	free(data);
+	free(names);
+	return 0;
+}
@@ -0,0 +1,441 @@
+#include "gadget_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The number of words in each sort key.
+#define KEY_WORDS 4
+
+static int compare_ranges(const void *a, const void *b) {
+	uint64_t addr_a = ((const struct scan_range *)a)->address;
+	uint64_t addr_b = ((const struct scan_range *)b)->address;
+	return (addr_a > addr_b) - (addr_a < addr_b);
+}
+
+// Sort the positions by the KEY_WORDS words starting at each one with a stable LSD radix sort
+// on 16-bit digits. The positions start out in increasing order, so equal keys stay in
+// position order. counts holds 1 << 16 entries. Returns the sorted array, which is either
+// positions or scratch.
+static uint32_t *sort_positions(const uint32_t *words, uint32_t *positions, uint32_t *scratch,
+		uint32_t *counts, size_t count) {
+	for (int pass = 0; pass < 2 * KEY_WORDS; pass++) {
+		unsigned word = KEY_WORDS - 1 - pass / 2;
+		unsigned shift = 16 * (pass % 2);
+		memset(counts, 0, (1 << 16) * sizeof(*counts));
+		for (size_t i = 0; i < count; i++) {
+			counts[(words[positions[i] + word] >> shift) & 0xffff]++;
+		}
+		// If every position has the same digit, this pass wouldn't change anything.
+		if (count == 0 || counts[(words[positions[0] + word] >> shift) & 0xffff] == count) {
+			continue;
+		}
+		uint32_t start = 0;
+		for (size_t d = 0; d < (1 << 16); d++) {
+			uint32_t n = counts[d];
+			counts[d] = start;
+			start += n;
+		}
+		for (size_t i = 0; i < count; i++) {
+			uint32_t p = positions[i];
+			scratch[counts[(words[p + word] >> shift) & 0xffff]++] = p;
+		}
+		uint32_t *swap = positions;
+		positions = scratch;
+		scratch = swap;
+	}
+	return positions;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+	const uint8_t *p = data;
+	while (size > 0) {
+		ssize_t n = write(fd, p, size);
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+static uint64_t round8(uint64_t offset) {
+	return (offset + 7) & ~(uint64_t)7;
+}
+
+bool gadget_index_create(struct gadget_index *index, const struct scan_range *ranges,
+		size_t count, const uint8_t uuid[16]) {
+	struct scan_range *sorted = malloc(count * sizeof(*sorted) + 1);
+	struct gadget_index_segment *segments = calloc(count + 1, sizeof(*segments));
+	if (sorted == NULL || segments == NULL) {
+		free(sorted);
+		free(segments);
+		return false;
+	}
+	memcpy(sorted, ranges, count * sizeof(*sorted));
+	qsort(sorted, count, sizeof(*sorted), compare_ranges);
+	// Lay out each segment's aligned words followed by KEY_WORDS - 1 words of padding.
+	uint64_t nwords = 0;
+	uint64_t npositions = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t skip = (4 - sorted[i].address % 4) % 4;
+		uint64_t n = (sorted[i].size > skip ? (sorted[i].size - skip) / 4 : 0);
+		segments[i].address = sorted[i].address + skip;
+		segments[i].first_position = nwords;
+		segments[i].npositions = n;
+		nwords += n + KEY_WORDS - 1;
+		npositions += n;
+	}
+	bool success = false;
+	uint32_t *scratch = NULL;
+	uint32_t *counts = NULL;
+	// Positions are stored as 32-bit word indices.
+	if (nwords > UINT32_MAX) {
+		goto fail;
+	}
+	struct gadget_index_header header = {
+		.magic      = GADGET_INDEX_MAGIC,
+		.version    = GADGET_INDEX_VERSION,
+		.nsegments  = count,
+		.nwords     = nwords,
+		.npositions = npositions,
+	};
+	memcpy(header.uuid, uuid, sizeof(header.uuid));
+	header.segments_offset  = round8(sizeof(header));
+	header.words_offset     = header.segments_offset + count * sizeof(*segments);
+	header.positions_offset = round8(header.words_offset + nwords * sizeof(uint32_t));
+	// The index is laid out in anonymous memory exactly as in a file, so that it can be
+	// written out as is and closed like a mapped file. The padding is already zero.
+	index->size = header.positions_offset + npositions * sizeof(uint32_t);
+	index->map = mmap(NULL, index->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+	if (index->map == MAP_FAILED) {
+		goto fail;
+	}
+	uint8_t *base = index->map;
+	uint32_t *words = (uint32_t *)(base + header.words_offset);
+	uint32_t *positions = (uint32_t *)(base + header.positions_offset);
+	scratch = malloc(npositions * sizeof(*scratch) + 1);
+	counts = malloc((1 << 16) * sizeof(*counts));
+	if (scratch == NULL || counts == NULL) {
+		munmap(index->map, index->size);
+		goto fail;
+	}
+	memcpy(base, &header, sizeof(header));
+	memcpy(base + header.segments_offset, segments, count * sizeof(*segments));
+	size_t np = 0;
+	for (size_t i = 0; i < count; i++) {
+		const struct gadget_index_segment *seg = &segments[i];
+		const uint8_t *data = (const uint8_t *)sorted[i].data
+			+ (seg->address - sorted[i].address);
+		memcpy(&words[seg->first_position], data, seg->npositions * sizeof(*words));
+		for (uint64_t j = 0; j < seg->npositions; j++) {
+			positions[np++] = seg->first_position + j;
+		}
+	}
+	const uint32_t *order = sort_positions(words, positions, scratch, counts, npositions);
+	if (order != positions) {
+		memcpy(positions, order, npositions * sizeof(*positions));
+	}
+	index->header = index->map;
+	index->segments = (const struct gadget_index_segment *)(base + header.segments_offset);
+	index->words = words;
+	index->positions = positions;
+	success = true;
+fail:
+	free(counts);
+	free(scratch);
+	free(segments);
+	free(sorted);
+	return success;
+}
+
+bool gadget_index_build(const struct scan_range *ranges, size_t count, const uint8_t uuid[16],
+		const char *path) {
+	struct gadget_index index;
+	if (!gadget_index_create(&index, ranges, count, uuid)) {
+		return false;
+	}
+	// Write under a unique temporary name first so that a partial index is never visible, even
+	// while another thread or process builds the same index.
+	bool success = false;
+	size_t tmp_size = strlen(path) + sizeof(".XXXXXX");
+	char *tmp = malloc(tmp_size);
+	if (tmp != NULL) {
+		snprintf(tmp, tmp_size, "%s.XXXXXX", path);
+		int fd = mkstemp(tmp);
+		if (fd >= 0) {
+			// mkstemp creates the file readable only by its owner, but the index may be
+			// shared.
+			success = fchmod(fd, 0644) == 0 && write_all(fd, index.map, index.size);
+			success = (close(fd) == 0) && success && rename(tmp, path) == 0;
+			if (!success) {
+				unlink(tmp);
+			}
+		}
+		free(tmp);
+	}
+	gadget_index_close(&index);
+	return success;
+}
+
+// Check that the mapped file is a well-formed index, so that lookups never read out of
+// bounds.
+static bool validate_index(const struct gadget_index *index, const uint8_t uuid[16]) {
+	const struct gadget_index_header *h = index->header;
+	if (index->size < sizeof(*h)
+			|| h->magic != GADGET_INDEX_MAGIC
+			|| h->version != GADGET_INDEX_VERSION
+			|| (uuid != NULL && memcmp(h->uuid, uuid, sizeof(h->uuid)) != 0)
+			|| h->nwords > UINT32_MAX
+			|| h->npositions > h->nwords
+			|| h->segments_offset % 8 != 0
+			|| h->words_offset % 4 != 0
+			|| h->positions_offset % 4 != 0
+			|| h->segments_offset > index->size
+			|| (index->size - h->segments_offset) / sizeof(*index->segments) < h->nsegments
+			|| h->words_offset > index->size
+			|| (index->size - h->words_offset) / sizeof(*index->words) < h->nwords
+			|| h->positions_offset > index->size
+			|| (index->size - h->positions_offset) / sizeof(*index->positions)
+				< h->npositions) {
+		return false;
+	}
+	const uint8_t *base = index->map;
+	const struct gadget_index_segment *segments =
+		(const struct gadget_index_segment *)(base + h->segments_offset);
+	uint64_t next = 0;
+	for (uint32_t i = 0; i < h->nsegments; i++) {
+		if (segments[i].first_position != next
+				|| segments[i].npositions > h->nwords - next
+				|| h->nwords - next - segments[i].npositions < KEY_WORDS - 1) {
+			return false;
+		}
+		next += segments[i].npositions + KEY_WORDS - 1;
+	}
+	const uint32_t *positions = (const uint32_t *)(base + h->positions_offset);
+	for (uint64_t i = 0; i < h->npositions; i++) {
+		if (positions[i] > h->nwords - KEY_WORDS) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool gadget_index_path(char *path, size_t size, const char *dir, const uint8_t uuid[16]) {
+	const uint8_t *u = uuid;
+	int len = snprintf(path, size, "%s/%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-"
+			"%02X%02X%02X%02X%02X%02X.gidx", dir, u[0], u[1], u[2], u[3], u[4], u[5],
+			u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+	return (len >= 0 && (size_t)len < size);
+}
+
+bool gadget_index_open(struct gadget_index *index, const char *path, const uint8_t uuid[16]) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	index->size = st.st_size;
+	index->map = mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (index->map == MAP_FAILED) {
+		return false;
+	}
+	index->header = index->map;
+	if (!validate_index(index, uuid)) {
+		gadget_index_close(index);
+		return false;
+	}
+	const uint8_t *base = index->map;
+	index->segments = (const struct gadget_index_segment *)(base
+			+ index->header->segments_offset);
+	index->words = (const uint32_t *)(base + index->header->words_offset);
+	index->positions = (const uint32_t *)(base + index->header->positions_offset);
+	return true;
+}
+
+void gadget_index_close(struct gadget_index *index) {
+	munmap(index->map, index->size);
+	index->map = NULL;
+	index->header = NULL;
+}
+
+// Compare the first k words of the key at position p with the gadget's words.
+static int compare_key(const uint32_t *words, uint32_t p, const uint32_t *gadget, size_t k) {
+	for (size_t j = 0; j < k; j++) {
+		if (words[p + j] != gadget[j]) {
+			return (words[p + j] < gadget[j] ? -1 : 1);
+		}
+	}
+	return 0;
+}
+
+// Find the first entry in the sorted positions whose key is not less than the gadget's words,
+// or, if upper is true, the first one whose key is greater.
+static size_t search_positions(const struct gadget_index *index, const uint32_t *gadget,
+		size_t k, bool upper) {
+	size_t lo = 0;
+	size_t hi = index->header->npositions;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = compare_key(index->words, index->positions[mid], gadget, k);
+		if (cmp < 0 || (upper && cmp == 0)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Find the segment containing position p.
+static const struct gadget_index_segment *find_segment(const struct gadget_index *index,
+		uint32_t p) {
+	size_t lo = 0;
+	size_t hi = index->header->nsegments;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (index->segments[mid].first_position <= p) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return &index->segments[lo];
+}
+
+// Check whether the gadget matches at position p, returning its address if so or 0 if not.
+// The first k words are already known to match. If mask is not NULL, the words are compared
+// under it.
+static uint64_t check_match(const struct gadget_index *index, uint32_t p, const uint32_t *gadget,
+		const uint32_t *mask, size_t nwords, size_t k) {
+	const struct gadget_index_segment *seg = find_segment(index, p);
+	uint64_t offset = p - seg->first_position;
+	if (offset >= seg->npositions || nwords > seg->npositions - offset) {
+		return 0;
+	}
+	for (size_t j = k; j < nwords; j++) {
+		uint32_t word = index->words[p + j];
+		if (mask != NULL) {
+			word &= mask[j];
+		}
+		if (word != gadget[j]) {
+			return 0;
+		}
+	}
+	return seg->address + 4 * offset;
+}
+
+static int compare_addresses(const void *a, const void *b) {
+	uint64_t addr_a = *(const uint64_t *)a;
+	uint64_t addr_b = *(const uint64_t *)b;
+	return (addr_a > addr_b) - (addr_a < addr_b);
+}
+
+// Check whether the size bytes at address lie within one of the ranges, which are sorted by
+// address and don't overlap.
+static bool in_ranges(const struct scan_range *ranges, size_t count, uint64_t address,
+		size_t size) {
+	size_t lo = 0;
+	size_t hi = count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (ranges[mid].address <= address) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) {
+		return false;
+	}
+	const struct scan_range *r = &ranges[lo - 1];
+	return (address - r->address <= r->size && size <= r->size - (address - r->address));
+}
+
+bool gadget_index_scan(const struct gadget_index *index, const struct matcher *matcher,
+		struct matcher_state *state, const struct scan_range *ranges, size_t nranges) {
+	struct scan_range *sorted = NULL;
+	if (ranges != NULL) {
+		sorted = malloc(nranges * sizeof(*sorted) + 1);
+		if (sorted == NULL) {
+			return false;
+		}
+		memcpy(sorted, ranges, nranges * sizeof(*sorted));
+		qsort(sorted, nranges, sizeof(*sorted), compare_ranges);
+	}
+	uint64_t *matches = NULL;
+	size_t capacity = 0;
+	for (size_t i = 0; i < matcher->count && state->remaining != 0; i++) {
+		if (state->resolved[i]) {
+			continue;
+		}
+		const uint32_t *gadget = &matcher->words[matcher->word_start[i]];
+		const uint32_t *mask = NULL;
+		size_t nwords = matcher->gadgets[i].size / 4;
+		size_t k = (nwords < KEY_WORDS ? nwords : KEY_WORDS);
+		// Only the leading exact words can be binary-searched. A gadget whose first word is
+		// masked is checked at every position.
+		if (matcher->word_masks != NULL) {
+			mask = &matcher->word_masks[matcher->word_start[i]];
+			for (size_t j = 0; j < k; j++) {
+				if (mask[j] != 0xffffffff) {
+					k = j;
+					break;
+				}
+			}
+		}
+		size_t first = 0;
+		size_t last = index->header->npositions;
+		if (k > 0) {
+			first = search_positions(index, gadget, k, false);
+			last = search_positions(index, gadget, k, true);
+		}
+		// Entries with equal keys are in address order, so if the whole key was compared the
+		// matches are already sorted.
+		size_t nmatches = 0;
+		for (size_t j = first; j < last; j++) {
+			uint64_t address = check_match(index, index->positions[j], gadget, mask,
+					nwords, k);
+			if (address == 0 || (sorted != NULL && !in_ranges(sorted, nranges, address,
+							4 * nwords))) {
+				continue;
+			}
+			if (state->hit == NULL && k == KEY_WORDS) {
+				matcher_state_record(matcher, state, i, address);
+				break;
+			}
+			if (nmatches == capacity) {
+				capacity = (capacity == 0 ? 256 : 2 * capacity);
+				uint64_t *new_matches = realloc(matches, capacity * sizeof(*matches));
+				if (new_matches == NULL) {
+					free(matches);
+					free(sorted);
+					return false;
+				}
+				matches = new_matches;
+			}
+			matches[nmatches++] = address;
+		}
+		if (k < KEY_WORDS) {
+			qsort(matches, nmatches, sizeof(*matches), compare_addresses);
+		}
+		for (size_t j = 0; j < nmatches && !state->resolved[i]; j++) {
+			matcher_state_report(matcher, state, i, matches[j]);
+		}
+	}
+	free(matches);
+	free(sorted);
+	return true;
+}
@@ -0,0 +1,170 @@
+#ifndef MACHO_GADGETS__GADGET_INDEX_H_
+#define MACHO_GADGETS__GADGET_INDEX_H_
+
+#include "matcher.h"
+#include "scan.h"
+
+/*
+ * struct gadget_index_header
+ *
+ * Description:
+ * 	The header of a gadget index file.
+ *
+ * 	An index holds a copy of every aligned word of an image's executable segments, followed
+ * 	by the positions of all those words sorted by the 4-word sequence starting at each one
+ * 	(ties broken by position). Each segment's words are followed by 3 zero words of padding
+ * 	so that every position has a full 4-word key. Any gadget can then be found with a binary
+ * 	search on its first 4 words, without reading the image itself.
+ *
+ * 	The file is native-endian and meant to be mapped directly. It is keyed on the image's
+ * 	LC_UUID.
+ */
+struct gadget_index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint8_t uuid[16];
+	uint32_t nsegments;
+	uint32_t reserved;
+	uint64_t nwords;
+	uint64_t npositions;
+	uint64_t segments_offset;
+	uint64_t words_offset;
+	uint64_t positions_offset;
+};
+
+#define GADGET_INDEX_MAGIC	0x78646967	// 'gidx'
+#define GADGET_INDEX_VERSION	1
+
+/*
+ * struct gadget_index_segment
+ *
+ * Description:
+ * 	An executable segment in a gadget index. Positions first_position through
+ * 	first_position + npositions - 1 in the word array belong to this segment, and the word at
+ * 	first_position is at address.
+ */
+struct gadget_index_segment {
+	uint64_t address;
+	uint64_t first_position;
+	uint64_t npositions;
+};
+
+/*
+ * struct gadget_index
+ *
+ * Description:
+ * 	A gadget index, mapped from a file or built in memory.
+ */
+struct gadget_index {
+	void *map;
+	size_t size;
+	const struct gadget_index_header *header;
+	const struct gadget_index_segment *segments;
+	const uint32_t *words;
+	const uint32_t *positions;
+};
+
+/*
+ * gadget_index_create
+ *
+ * Description:
+ * 	Build an index of the aligned words in the given ranges in memory. The index takes about
+ * 	twice as many bytes as the ranges and is freed with gadget_index_close.
+ *
+ * Parameters:
+ * 	out	index			The index.
+ * 		ranges			The executable ranges of the image.
+ * 		count			The number of ranges.
+ * 		uuid			The image's UUID.
+ *
+ * Returns:
+ * 	True on success, false if memory could not be allocated.
+ */
+bool gadget_index_create(struct gadget_index *index, const struct scan_range *ranges,
+		size_t count, const uint8_t uuid[16]);
+
+/*
+ * gadget_index_build
+ *
+ * Description:
+ * 	Build an index of the aligned words in the given ranges and write it to a file. The file
+ * 	is written under a unique temporary name and renamed into place, so concurrent readers
+ * 	never see a partial index. Several indexes, or the same one, may be built at once from
+ * 	different threads.
+ *
+ * Parameters:
+ * 		ranges			The executable ranges of the image.
+ * 		count			The number of ranges.
+ * 		uuid			The image's UUID.
+ * 		path			The path of the index file.
+ *
+ * Returns:
+ * 	True on success, false if memory could not be allocated or the file could not be written.
+ */
+bool gadget_index_build(const struct scan_range *ranges, size_t count, const uint8_t uuid[16],
+		const char *path);
+
+/*
+ * gadget_index_path
+ *
+ * Description:
+ * 	Format the path of the index of the image with the given UUID in an index directory, as
+ * 	<UUID>.gidx.
+ *
+ * Returns:
+ * 	True on success, false if the path doesn't fit in size bytes.
+ */
+bool gadget_index_path(char *path, size_t size, const char *dir, const uint8_t uuid[16]);
+
+/*
+ * gadget_index_open
+ *
+ * Description:
+ * 	Map an index file and check that it is well formed and belongs to the given image.
+ *
+ * Parameters:
+ * 	out	index			The index.
+ * 		path			The path of the index file.
+ * 		uuid			The image's UUID, or NULL to accept an index of any
+ * 					image.
+ *
+ * Returns:
+ * 	True on success, false if the file does not exist or is not a valid index for the image.
+ */
+bool gadget_index_open(struct gadget_index *index, const char *path, const uint8_t uuid[16]);
+
+/*
+ * gadget_index_close
+ *
+ * Description:
+ * 	Unmap an index, or free one made by gadget_index_create.
+ */
+void gadget_index_close(struct gadget_index *index);
+
+/*
+ * gadget_index_scan
+ *
+ * Description:
+ * 	Look up the state's unresolved gadgets in the index, reporting matches to the state just as
+ * 	matcher_scan would. The matcher must be aligned. In all-matches mode, the matches of each
+ * 	gadget are reported in address order, one gadget at a time.
+ *
+ * 	If ranges is not NULL, only the matches that lie entirely within one of the ranges are
+ * 	reported, so that the results are the same as scanning just those ranges. The ranges
+ * 	must not overlap.
+ *
+ * Parameters:
+ * 		index			The index.
+ * 		matcher			The aligned matcher.
+ * 		state			The scan state.
+ * 		ranges			The ranges to report matches in, or NULL for the whole
+ * 					index.
+ * 		nranges			The number of ranges.
+ *
+ * Returns:
+ * 	True on success, false if memory could not be allocated.
+ */
+bool gadget_index_scan(const struct gadget_index *index, const struct matcher *matcher,
+		struct matcher_state *state, const struct scan_range *ranges, size_t nranges);
+
+#endif
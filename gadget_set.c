@@ -0,0 +1,420 @@
+#include "gadget_set.h"
+
+#include "range_list.h"
+#include "scan.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void set_error(struct gadget_set *set, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void set_error(struct gadget_set *set, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(set->error, sizeof(set->error), fmt, ap);
+	va_end(ap);
+}
+
+static void results_error(struct gadget_results *results, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void results_error(struct gadget_results *results, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(results->error, sizeof(results->error), fmt, ap);
+	va_end(ap);
+}
+
+// Make room for at least size elements in a growable buffer.
+static bool reserve(void **buffer, size_t *capacity, size_t size, size_t element_size) {
+	if (size <= *capacity) {
+		return true;
+	}
+	size_t new_capacity = (*capacity == 0 ? 64 : *capacity);
+	while (new_capacity < size) {
+		new_capacity *= 2;
+	}
+	void *new_buffer = realloc(*buffer, new_capacity * element_size);
+	if (new_buffer == NULL) {
+		return false;
+	}
+	*buffer = new_buffer;
+	*capacity = new_capacity;
+	return true;
+}
+
+static int hexdigit(int ch) {
+	if ('0' <= ch && ch <= '9') {
+		return ch - '0';
+	} else if ('A' <= ch && ch <= 'F') {
+		return ch - 'A' + 0xa;
+	} else if ('a' <= ch && ch <= 'f') {
+		return ch - 'a' + 0xa;
+	} else {
+		return -1;
+	}
+}
+
+/* Gadget string format:
+ *
+ * 	<GADGET_STRING> = <GADGET_NAME>:<GADGET_DATA>
+ * 	<GADGET_DATA> = <GADGET_COMPONENT>{,<GADGET_COMPONENT>}*
+ * 	<GADGET_COMPONENT> = <GADGET_BYTES>[/<GADGET_BYTES>]
+ * 	<GADGET_BYTES> = <BIG_ENDIAN_HEX>|0x<LITTLE_ENDIAN_HEX>
+ * 	<GADGET_NAME> = [identifier]
+ * 	<BIG_ENDIAN_HEX> = [hexadecimal;big endian]
+ * 	<LITTLE_ENDIAN_HEX> = [hexadecimal;little endian]
+ *
+ * The optional second <GADGET_BYTES> of a component is a mask of the same length: only the bits
+ * set in the mask need to match.
+ */
+
+// Decode a run of hex bytes into out, stopping at the end of the string, a ',', or a '/'.
+// Returns the number of bytes, or 0 on error.
+static size_t decode_bytes(struct gadget_set *set, uint8_t *out, const char **chr,
+		const char *string, const char *name, int name_length) {
+	bool little_endian = (strncmp(*chr, "0x", 2) == 0);
+	if (little_endian) {
+		*chr += 2;
+	}
+	uint8_t *data = out;
+	for (;;) {
+		if (**chr == 0 || **chr == ',' || **chr == '/') {
+			break;
+		}
+		int b_hi = hexdigit(*(*chr)++);
+		if (**chr == 0 || **chr == ',' || **chr == '/') {
+			set_error(set, "Odd-length hex in gadget data '%s' for gadget '%.*s'",
+					string, name_length, name);
+			return 0;
+		}
+		int b_lo = hexdigit(*(*chr)++);
+		if (b_hi < 0 || b_lo < 0) {
+			set_error(set, "Invalid hex in gadget data '%s' for gadget '%.*s'",
+					string, name_length, name);
+			return 0;
+		}
+		*data++ = (b_hi << 4) | b_lo;
+	}
+	size_t length = data - out;
+	if (length == 0) {
+		set_error(set, "Zero-length component in gadget data '%s' for gadget '%.*s'",
+				string, name_length, name);
+		return 0;
+	}
+	if (little_endian) {
+		for (size_t i = 0; i < length / 2; i++) {
+			uint8_t byte_i = out[i];
+			out[i] = out[length - i - 1];
+			out[length - i - 1] = byte_i;
+		}
+	}
+	return length;
+}
+
+// Decode the gadget data and mask into out and mask_out, which must each have room for
+// strlen(string) / 2 bytes. Returns the size of the data, or 0 on error. Components without a
+// mask get a mask of all ones.
+static size_t decode_data(struct gadget_set *set, uint8_t *out, uint8_t *mask_out,
+		const char *string, const char *name, int name_length) {
+	const char *chr = string;
+	size_t size = 0;
+	for (;;) {
+		size_t length = decode_bytes(set, out + size, &chr, string, name, name_length);
+		if (length == 0) {
+			return 0;
+		}
+		if (*chr == '/') {
+			chr++;
+			size_t mask_length = decode_bytes(set, mask_out + size, &chr, string, name,
+					name_length);
+			if (mask_length == 0) {
+				return 0;
+			}
+			if (mask_length != length) {
+				set_error(set, "Mask length differs from value length in gadget data "
+						"'%s' for gadget '%.*s'", string, name_length, name);
+				return 0;
+			}
+			for (size_t i = 0; i < length; i++) {
+				out[size + i] &= mask_out[size + i];
+			}
+		} else {
+			memset(mask_out + size, 0xff, length);
+		}
+		size += length;
+		if (*chr == ',') {
+			chr++;
+		} else if (*chr != 0) {
+			set_error(set, "Unexpected '%c' in gadget data '%s' for gadget '%.*s'", *chr,
+					string, name_length, name);
+			return 0;
+		} else {
+			break;
+		}
+	}
+	return size;
+}
+
+void gadget_set_init(struct gadget_set *set) {
+	memset(set, 0, sizeof(*set));
+}
+
+bool gadget_set_add(struct gadget_set *set, const char *string) {
+	const char *colon = strchr(string, ':');
+	if (colon == NULL) {
+		set_error(set, "Bad format gadget string '%s'", string);
+		return false;
+	}
+	const char *name = string;
+	size_t name_length = colon - string;
+	const char *data_string = colon + 1;
+	size_t len = strlen(data_string);
+	if (len == 0) {
+		set_error(set, "Missing gadget data for gadget '%.*s'", (int)name_length, name);
+		return false;
+	}
+	// Each gadget has a name offset and a data offset. Every data byte takes at least 2
+	// characters, so len / 2 bytes hold the data and the mask.
+	if (!reserve((void **)&set->offsets, &set->capacity, 2 * (set->count + 1),
+				sizeof(*set->offsets))
+			|| !reserve((void **)&set->data, &set->data_capacity,
+				set->data_size + len / 2 + 1, 1)
+			|| !reserve((void **)&set->masks, &set->masks_capacity,
+				set->data_size + len / 2 + 1, 1)
+			|| !reserve((void **)&set->names, &set->names_capacity,
+				set->names_size + name_length + 1, 1)) {
+		set_error(set, "Could not allocate gadget '%.*s'", (int)name_length, name);
+		return false;
+	}
+	size_t size = decode_data(set, set->data + set->data_size, set->masks + set->data_size,
+			data_string, name, name_length);
+	if (size == 0) {
+		return false;
+	}
+	set->offsets[2 * set->count]     = set->names_size;
+	set->offsets[2 * set->count + 1] = set->data_size;
+	memcpy(set->names + set->names_size, name, name_length);
+	set->names[set->names_size + name_length] = 0;
+	set->names_size += name_length + 1;
+	set->data_size += size;
+	set->count++;
+	return true;
+}
+
+static void free_buffers(struct gadget_set *set) {
+	free(set->offsets);
+	free(set->data);
+	free(set->masks);
+	free(set->names);
+	set->offsets = NULL;
+	set->data = NULL;
+	set->masks = NULL;
+	set->names = NULL;
+	set->capacity = 0;
+	set->data_capacity = 0;
+	set->masks_capacity = 0;
+	set->names_capacity = 0;
+}
+
+// Returns true if any byte of the gadget's mask is not all ones.
+static bool is_masked(const uint8_t *mask, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		if (mask[i] != 0xff) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool gadget_set_finish(struct gadget_set *set) {
+	// The arena holds the gadget array, then the gadget bytes, then the masks of the masked
+	// gadgets, then the names.
+	size_t masks_size = 0;
+	for (size_t i = 0; i < set->count; i++) {
+		size_t data = set->offsets[2 * i + 1];
+		size_t end = (i + 1 < set->count ? set->offsets[2 * i + 3] : set->data_size);
+		if (is_masked(set->masks + data, end - data)) {
+			masks_size += end - data;
+		}
+	}
+	size_t gadgets_size = set->count * sizeof(*set->gadgets);
+	size_t data_start = (gadgets_size + 15) & ~(size_t)15;
+	size_t masks_start = data_start + set->data_size;
+	size_t names_start = masks_start + masks_size;
+	uint8_t *arena = malloc(names_start + set->names_size + 1);
+	if (arena == NULL) {
+		set_error(set, "Could not allocate gadgets");
+		return false;
+	}
+	memcpy(arena + data_start, set->data, set->data_size);
+	memcpy(arena + names_start, set->names, set->names_size);
+	struct gadget *gadgets = (struct gadget *)arena;
+	uint8_t *mask = arena + masks_start;
+	for (size_t i = 0; i < set->count; i++) {
+		size_t data = set->offsets[2 * i + 1];
+		size_t end = (i + 1 < set->count ? set->offsets[2 * i + 3] : set->data_size);
+		gadgets[i].name = (const char *)(arena + names_start + set->offsets[2 * i]);
+		gadgets[i].data = arena + data_start + data;
+		gadgets[i].mask = NULL;
+		gadgets[i].size = end - data;
+		gadgets[i].address = 0;
+		if (is_masked(set->masks + data, end - data)) {
+			memcpy(mask, set->masks + data, end - data);
+			gadgets[i].mask = mask;
+			mask += end - data;
+		}
+	}
+	free_buffers(set);
+	set->arena = arena;
+	set->gadgets = gadgets;
+	return true;
+}
+
+bool gadget_set_compile(struct gadget_set *set, unsigned align) {
+	return gadget_set_compile_sampled(set, align, NULL, 0);
+}
+
+bool gadget_set_compile_sampled(struct gadget_set *set, unsigned align, const uint32_t *sample,
+		size_t nsample) {
+	if (align != 1 && align != 4) {
+		set_error(set, "Invalid alignment %u: must be 1 or 4", align);
+		return false;
+	}
+	if (set->compiled[align == 4]) {
+		return true;
+	}
+	if (set->arena == NULL && !gadget_set_finish(set)) {
+		return false;
+	}
+	for (size_t i = 0; i < set->count; i++) {
+		if (set->gadgets[i].size % align != 0) {
+			set_error(set, "Size of gadget '%s' is not a multiple of the alignment %u",
+					set->gadgets[i].name, align);
+			return false;
+		}
+	}
+	if (!matcher_init_anchored(&set->matchers[align == 4], set->gadgets, set->count, align,
+				sample, nsample)) {
+		set_error(set, "Could not allocate gadget matcher");
+		return false;
+	}
+	set->compiled[align == 4] = true;
+	return true;
+}
+
+bool gadget_set_find(const struct gadget_set *set, const char *name, size_t *index) {
+	for (size_t i = 0; i < set->count; i++) {
+		if (strcmp(set->gadgets[i].name, name) == 0) {
+			*index = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Find the ranges of the Mach-O to scan.
+static bool find_ranges(struct range_list *ranges, const struct macho *macho,
+		const struct gadget_scan_options *options, struct gadget_results *results) {
+	bool success;
+	if (macho_is_fileset(macho)) {
+		success = range_list_add_fileset(ranges, macho, options->entry_ids,
+				options->nentry_ids);
+	} else if (options->nentry_ids > 0) {
+		results_error(results, "Fileset entries given for a Mach-O that isn't an "
+				"MH_FILESET");
+		return false;
+	} else {
+		success = range_list_add_macho(ranges, macho);
+	}
+	if (!success) {
+		memcpy(results->error, ranges->error, sizeof(results->error));
+	}
+	return success;
+}
+
+bool gadget_set_scan(const struct gadget_set *set, const struct macho *macho,
+		const struct gadget_scan_options *options, struct gadget_results *results) {
+	static const struct gadget_scan_options default_options;
+	if (options == NULL) {
+		options = &default_options;
+	}
+	unsigned align = options->align;
+	if (align == 0) {
+		align = (macho->mh32->cputype == CPU_TYPE_ARM64 ? 4 : 1);
+	}
+	if ((align != 1 && align != 4) || !set->compiled[align == 4]) {
+		results_error(results, "The gadget set is not compiled for alignment %u", align);
+		return false;
+	}
+	const struct matcher *matcher = &set->matchers[align == 4];
+	if (results->count != set->count || results->addresses == NULL) {
+		gadget_results_free(results);
+		results->addresses = calloc(set->count + 1, sizeof(*results->addresses));
+		results->hits = calloc(set->count + 1, sizeof(*results->hits));
+		if (results->addresses == NULL || results->hits == NULL) {
+			gadget_results_free(results);
+			results_error(results, "Could not allocate results");
+			return false;
+		}
+		results->count = set->count;
+	}
+	struct range_list ranges;
+	range_list_init(&ranges);
+	ranges.filter = options->filter;
+	if (!find_ranges(&ranges, macho, options, results)) {
+		range_list_free(&ranges);
+		return false;
+	}
+	struct matcher_state state;
+	if (!matcher_state_init(&state, matcher)) {
+		range_list_free(&ranges);
+		results_error(results, "Could not allocate scan state");
+		return false;
+	}
+	if (options->hit != NULL) {
+		matcher_state_report_all(&state, options->hit, options->hit_context,
+				options->max_hits);
+	}
+	bool success = scan_ranges(matcher, &state, ranges.ranges, ranges.count,
+			(options->threads == 0 ? 1 : options->threads), NULL, NULL, NULL);
+	if (success) {
+		memcpy(results->addresses, state.addresses,
+				set->count * sizeof(*results->addresses));
+		memcpy(results->hits, state.hits, set->count * sizeof(*results->hits));
+	} else {
+		results_error(results, "Could not allocate scan state");
+	}
+	matcher_state_deinit(&state);
+	range_list_free(&ranges);
+	return success;
+}
+
+uint64_t gadget_results_address(const struct gadget_results *results, size_t gadget) {
+	return (gadget < results->count ? results->addresses[gadget] : 0);
+}
+
+void gadget_results_free(struct gadget_results *results) {
+	free(results->addresses);
+	free(results->hits);
+	results->addresses = NULL;
+	results->hits = NULL;
+	results->count = 0;
+}
+
+void gadget_set_free(struct gadget_set *set) {
+	for (int k = 0; k < 2; k++) {
+		if (set->compiled[k]) {
+			matcher_deinit(&set->matchers[k]);
+			set->compiled[k] = false;
+		}
+	}
+	free_buffers(set);
+	free(set->arena);
+	set->arena = NULL;
+	set->gadgets = NULL;
+	set->count = 0;
+}
@@ -0,0 +1,215 @@
+#ifndef MACHO_GADGETS__GADGET_SET_H_
+#define MACHO_GADGETS__GADGET_SET_H_
+
+#include "macho.h"
+#include "matcher.h"
+#include "range_list.h"
+
+/*
+ * struct gadget_set
+ *
+ * Description:
+ * 	A set of gadgets decoded from gadget strings.
+ *
+ * 	While gadgets are being added, their names, bytes, and masks are accumulated in growable
+ * 	buffers. gadget_set_finish then lays out the gadget array, all the gadgets' bytes packed
+ * 	back to back in order, the masks of the masked gadgets, and all their names in a single
+ * 	allocation, so that the matcher walks the bytes sequentially and the whole set is freed at
+ * 	once.
+ *
+ * 	gadget_set_compile then builds a matcher for the gadgets, after which the set can be
+ * 	scanned against any number of Mach-O files, from any number of threads at once, with
+ * 	gadget_set_scan.
+ */
+struct gadget_set {
+	struct gadget *gadgets;
+	size_t count;
+	void *arena;
+	// Used while gadgets are being added.
+	// The name offset and data offset of each gadget.
+	size_t *offsets;
+	size_t capacity;
+	// The gadget bytes and, in parallel, their masks.
+	uint8_t *data;
+	uint8_t *masks;
+	size_t data_size;
+	size_t data_capacity;
+	size_t masks_capacity;
+	char *names;
+	size_t names_size;
+	size_t names_capacity;
+	// The matchers for alignments 1 and 4, once compiled.
+	struct matcher matchers[2];
+	bool compiled[2];
+	// A description of the last error.
+	char error[256];
+};
+
+/*
+ * gadget_set_init
+ *
+ * Description:
+ * 	Initialize an empty gadget set.
+ */
+void gadget_set_init(struct gadget_set *set);
+
+/*
+ * gadget_set_add
+ *
+ * Description:
+ * 	Decode a gadget string and add the gadget to the set. The format is described in the
+ * 	README.
+ *
+ * Returns:
+ * 	True on success. On failure, the set's error describes the problem and the set is
+ * 	unchanged.
+ */
+bool gadget_set_add(struct gadget_set *set, const char *string);
+
+/*
+ * gadget_set_finish
+ *
+ * Description:
+ * 	Lay out the gadgets added so far in the set's arena. After this, the set's gadgets array is
+ * 	valid and no more gadgets may be added.
+ *
+ * Returns:
+ * 	True on success, false if memory could not be allocated.
+ */
+bool gadget_set_finish(struct gadget_set *set);
+
+/*
+ * gadget_set_compile
+ *
+ * Description:
+ * 	Build the matcher used to scan for the set's gadgets with the given alignment, finishing
+ * 	the set first if needed. Compiling an alignment that is already compiled does nothing.
+ * 	The matcher is set->matchers[align == 4].
+ *
+ * Parameters:
+ * 		set			The gadget set.
+ * 		align			The alignment of matches, either 1 or 4.
+ *
+ * Returns:
+ * 	True on success. On failure, the set's error describes the problem.
+ */
+bool gadget_set_compile(struct gadget_set *set, unsigned align);
+
+/*
+ * gadget_set_compile_sampled
+ *
+ * Description:
+ * 	Like gadget_set_compile, but for alignment 4, dispatch each gadget on the word that is
+ * 	rarest in a sample of the data to be scanned, as with matcher_init_anchored. Gadgets
+ * 	made of common instructions then cost far fewer lookups during the scan. The sample can be
+ * 	taken with scan_sample.
+ *
+ * Parameters:
+ * 		set			The gadget set.
+ * 		align			The alignment of matches, either 1 or 4.
+ * 		sample			Words sampled from the data to be scanned, or NULL.
+ * 		nsample			The number of sampled words.
+ *
+ * Returns:
+ * 	True on success. On failure, the set's error describes the problem.
+ */
+bool gadget_set_compile_sampled(struct gadget_set *set, unsigned align, const uint32_t *sample,
+		size_t nsample);
+
+/*
+ * gadget_set_find
+ *
+ * Description:
+ * 	Find the index of the gadget with the given name in a finished set.
+ *
+ * Returns:
+ * 	True if the gadget was found.
+ */
+bool gadget_set_find(const struct gadget_set *set, const char *name, size_t *index);
+
+/*
+ * struct gadget_scan_options
+ *
+ * Description:
+ * 	Options for gadget_set_scan. A zero-initialized struct gives the defaults.
+ *
+ * 	If align is 0, it is 4 for arm64 Mach-O files and 1 otherwise. threads is the maximum
+ * 	number of threads to scan with, including the calling thread; 0 means 1. For an MH_FILESET
+ * 	Mach-O, only the executable segments of the entries in entry_ids are scanned, or of every
+ * 	entry if there are none. If filter is not NULL, only the parts of those segments that it
+ * 	selects are scanned. If hit is not NULL, every match is passed to it, in address order, up
+ * 	to max_hits per gadget if max_hits is not 0.
+ */
+struct gadget_scan_options {
+	unsigned align;
+	unsigned threads;
+	const char **entry_ids;
+	size_t nentry_ids;
+	const struct range_filter *filter;
+	matcher_hit_fn hit;
+	void *hit_context;
+	size_t max_hits;
+};
+
+/*
+ * struct gadget_results
+ *
+ * Description:
+ * 	The results of gadget_set_scan. A results struct should be zero-initialized before its
+ * 	first use, and may then be reused for any number of scans of the same set without
+ * 	reallocating.
+ */
+struct gadget_results {
+	uint64_t *addresses;
+	size_t *hits;
+	size_t count;
+	// A description of the last error.
+	char error[256];
+};
+
+/*
+ * gadget_set_scan
+ *
+ * Description:
+ * 	Scan the executable segments of a Mach-O file for the gadgets in a compiled set. The set
+ * 	is not modified, so it may be scanned from many threads at once with separate results.
+ *
+ * Parameters:
+ * 		set			The gadget set, compiled for the alignment used.
+ * 		macho			The Mach-O file. It must have been validated.
+ * 		options			The scan options, or NULL for the defaults.
+ * 	out	results			On return, the lowest address of each gadget, or 0 if it
+ * 					wasn't found, and with options->hit, the number of
+ * 					matches of each gadget.
+ *
+ * Returns:
+ * 	True on success. On failure, the results' error describes the problem.
+ */
+bool gadget_set_scan(const struct gadget_set *set, const struct macho *macho,
+		const struct gadget_scan_options *options, struct gadget_results *results);
+
+/*
+ * gadget_results_address
+ *
+ * Description:
+ * 	Returns the lowest address of the given gadget, or 0 if it wasn't found.
+ */
+uint64_t gadget_results_address(const struct gadget_results *results, size_t gadget);
+
+/*
+ * gadget_results_free
+ *
+ * Description:
+ * 	Free the results.
+ */
+void gadget_results_free(struct gadget_results *results);
+
+/*
+ * gadget_set_free
+ *
+ * Description:
+ * 	Free the gadget set and its matchers.
+ */
+void gadget_set_free(struct gadget_set *set);
+
+#endif
@@ -0,0 +1,404 @@
+#include "kernelcache.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#if defined(__APPLE__)
+#include <compression.h>
+#endif
+
+// How much output is produced between progress updates.
+#define KERNELCACHE_STEP (1 << 20)
+
+// The size of the "complzss" header preceding LZSS data.
+#define LZSS_HEADER_SIZE 0x180
+
+// The compression algorithm identifier for LZFSE in an IM4P compression info sequence.
+#define IM4P_COMPRESSION_LZFSE 1
+
+static void set_error(struct kernelcache *kc, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void set_error(struct kernelcache *kc, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(kc->error, sizeof(kc->error), fmt, ap);
+	va_end(ap);
+}
+
+static uint32_t load_be32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Read the next DER element from [*p, end), advancing *p past it.
+static bool der_next(const uint8_t **p, const uint8_t *end, uint8_t *tag,
+		const uint8_t **value, size_t *length) {
+	if (end - *p < 2) {
+		return false;
+	}
+	*tag = *(*p)++;
+	size_t len = *(*p)++;
+	if (len & 0x80) {
+		size_t n = len & 0x7f;
+		if (n == 0 || n > sizeof(size_t) || (size_t)(end - *p) < n) {
+			return false;
+		}
+		len = 0;
+		for (size_t i = 0; i < n; i++) {
+			len = (len << 8) | *(*p)++;
+		}
+	}
+	if (len > (size_t)(end - *p)) {
+		return false;
+	}
+	*value = *p;
+	*length = len;
+	*p += len;
+	return true;
+}
+
+static bool der_string_is(uint8_t tag, const uint8_t *value, size_t length, const char *string) {
+	return (tag == 0x16 && length == strlen(string) && memcmp(value, string, length) == 0);
+}
+
+static uint64_t der_integer(const uint8_t *value, size_t length) {
+	uint64_t integer = 0;
+	for (size_t i = 0; i < length; i++) {
+		integer = (integer << 8) | value[i];
+	}
+	return integer;
+}
+
+// Find the payload in an IMG4 or IM4P container. Files that aren't DER are treated as a bare
+// payload. If the container records the decompressed size, it is stored in raw_size.
+static bool find_payload(struct kernelcache *kc, const uint8_t *file, size_t size,
+		size_t *raw_size) {
+	kc->payload = file;
+	kc->payload_size = size;
+	*raw_size = 0;
+	const uint8_t *p = file;
+	const uint8_t *end = file + size;
+	uint8_t tag;
+	const uint8_t *value;
+	size_t length;
+	if (size == 0 || file[0] != 0x30 || !der_next(&p, end, &tag, &value, &length)) {
+		return true;
+	}
+	p = value;
+	end = value + length;
+	if (!der_next(&p, end, &tag, &value, &length)) {
+		goto bad;
+	}
+	// An IMG4 wraps the IM4P in a sequence along with the manifest.
+	if (der_string_is(tag, value, length, "IMG4")) {
+		if (!der_next(&p, end, &tag, &value, &length) || tag != 0x30) {
+			goto bad;
+		}
+		p = value;
+		end = value + length;
+		if (!der_next(&p, end, &tag, &value, &length)) {
+			goto bad;
+		}
+	}
+	if (!der_string_is(tag, value, length, "IM4P")) {
+		goto bad;
+	}
+	// Skip the type and description strings.
+	for (int i = 0; i < 2; i++) {
+		if (!der_next(&p, end, &tag, &value, &length) || tag != 0x16) {
+			goto bad;
+		}
+	}
+	if (!der_next(&p, end, &tag, &value, &length) || tag != 0x04) {
+		goto bad;
+	}
+	kc->payload = value;
+	kc->payload_size = length;
+	if (p < end) {
+		if (!der_next(&p, end, &tag, &value, &length)) {
+			goto bad;
+		}
+		if (tag == 0x04) {
+			set_error(kc, "Encrypted IM4P payloads are not supported");
+			return false;
+		}
+		// The optional compression info sequence holds the algorithm and the decompressed
+		// size.
+		if (tag == 0x30) {
+			const uint8_t *q = value;
+			const uint8_t *q_end = value + length;
+			uint8_t t1, t2;
+			const uint8_t *v1, *v2;
+			size_t l1, l2;
+			if (der_next(&q, q_end, &t1, &v1, &l1) && t1 == 0x02 && l1 <= 8
+					&& der_next(&q, q_end, &t2, &v2, &l2) && t2 == 0x02
+					&& l2 <= 8
+					&& der_integer(v1, l1) == IM4P_COMPRESSION_LZFSE) {
+				*raw_size = der_integer(v2, l2);
+			}
+		}
+	}
+	return true;
+bad:
+	set_error(kc, "Malformed IMG4 container");
+	return false;
+}
+
+static enum kernelcache_format payload_format(const uint8_t *payload, size_t size) {
+	if (size >= LZSS_HEADER_SIZE && memcmp(payload, "complzss", 8) == 0) {
+		return KERNELCACHE_LZSS;
+	}
+	if (size >= 4 && memcmp(payload, "bvx", 3) == 0
+			&& strchr("12n-", payload[3]) != NULL && payload[3] != 0) {
+		return KERNELCACHE_LZFSE;
+	}
+	return KERNELCACHE_NONE;
+}
+
+enum kernelcache_format kernelcache_format(const void *file, size_t size) {
+	struct kernelcache kc;
+	size_t raw_size;
+	if (!find_payload(&kc, file, size, &raw_size)) {
+		return KERNELCACHE_NONE;
+	}
+	return payload_format(kc.payload, kc.payload_size);
+}
+
+// Publish that the first available bytes of the output are ready.
+static void publish(struct kernelcache *kc, size_t available, bool done, bool failed) {
+	pthread_mutex_lock(&kc->lock);
+	atomic_store(&kc->available, available);
+	kc->done = done;
+	kc->failed = failed;
+	pthread_cond_broadcast(&kc->cond);
+	pthread_mutex_unlock(&kc->lock);
+}
+
+static uint32_t adler32(const uint8_t *data, size_t size) {
+	uint32_t a = 1, b = 0;
+	while (size > 0) {
+		// 5552 is the largest block for which b can't overflow before the reduction.
+		size_t n = (size < 5552 ? size : 5552);
+		for (size_t i = 0; i < n; i++) {
+			a += data[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+		data += n;
+		size -= n;
+	}
+	return (b << 16) | a;
+}
+
+// Decompress an LZSS payload. This is a 4096-byte window with 3 to 18 byte matches, as used by
+// the "complzss" kernelcache format.
+static bool decompress_lzss(struct kernelcache *kc) {
+	enum { N = 4096, F = 18, THRESHOLD = 2 };
+	const uint8_t *header = kc->payload;
+	uint32_t checksum = load_be32(header + 8);
+	uint32_t compressed_size = load_be32(header + 16);
+	const uint8_t *src = header + LZSS_HEADER_SIZE;
+	if (compressed_size > kc->payload_size - LZSS_HEADER_SIZE) {
+		set_error(kc, "LZSS payload is truncated");
+		return false;
+	}
+	const uint8_t *src_end = src + compressed_size;
+	uint8_t *dst = kc->data;
+	uint8_t *dst_end = kc->data + kc->capacity;
+	uint8_t *next_publish = dst + KERNELCACHE_STEP;
+	uint8_t window[N];
+	memset(window, ' ', N - F);
+	unsigned r = N - F;
+	unsigned flags = 0;
+	for (;;) {
+		if (((flags >>= 1) & 0x100) == 0) {
+			if (src >= src_end) {
+				break;
+			}
+			flags = *src++ | 0xff00;
+		}
+		if (flags & 1) {
+			if (src >= src_end) {
+				break;
+			}
+			if (dst >= dst_end) {
+				goto overflow;
+			}
+			uint8_t c = *src++;
+			*dst++ = c;
+			window[r++] = c;
+			r &= N - 1;
+		} else {
+			if (src_end - src < 2) {
+				break;
+			}
+			unsigned i = src[0] | ((src[1] & 0xf0) << 4);
+			unsigned j = (src[1] & 0x0f) + THRESHOLD;
+			src += 2;
+			if ((size_t)(dst_end - dst) < j + 1) {
+				goto overflow;
+			}
+			for (unsigned k = 0; k <= j; k++) {
+				uint8_t c = window[(i + k) & (N - 1)];
+				*dst++ = c;
+				window[r++] = c;
+				r &= N - 1;
+			}
+		}
+		if (dst >= next_publish) {
+			publish(kc, dst - kc->data, false, false);
+			next_publish = dst + KERNELCACHE_STEP;
+		}
+	}
+	kc->size = dst - kc->data;
+	if (kc->size != kc->capacity || adler32(kc->data, kc->size) != checksum) {
+		set_error(kc, "LZSS payload is corrupt");
+		return false;
+	}
+	return true;
+overflow:
+	set_error(kc, "LZSS payload is larger than its header says");
+	return false;
+}
+
+#if defined(__APPLE__)
+
+static bool decompress_lzfse(struct kernelcache *kc) {
+	compression_stream stream;
+	if (compression_stream_init(&stream, COMPRESSION_STREAM_DECODE, COMPRESSION_LZFSE)
+			!= COMPRESSION_STATUS_OK) {
+		set_error(kc, "Could not initialize LZFSE decoder");
+		return false;
+	}
+	stream.src_ptr = kc->payload;
+	stream.src_size = kc->payload_size;
+	stream.dst_ptr = kc->data;
+	stream.dst_size = 0;
+	bool success = false;
+	for (;;) {
+		size_t produced = stream.dst_ptr - kc->data;
+		size_t left = kc->capacity - produced;
+		stream.dst_size = (left < KERNELCACHE_STEP ? left : KERNELCACHE_STEP);
+		compression_status status = compression_stream_process(&stream,
+				COMPRESSION_STREAM_FINALIZE);
+		produced = stream.dst_ptr - kc->data;
+		if (status == COMPRESSION_STATUS_END) {
+			kc->size = produced;
+			success = true;
+			break;
+		}
+		if (status != COMPRESSION_STATUS_OK) {
+			set_error(kc, "LZFSE payload is corrupt");
+			break;
+		}
+		if (produced == kc->capacity) {
+			set_error(kc, "LZFSE payload is larger than expected");
+			break;
+		}
+		publish(kc, produced, false, false);
+	}
+	compression_stream_destroy(&stream);
+	return success;
+}
+
+#else
+
+static bool decompress_lzfse(struct kernelcache *kc) {
+	set_error(kc, "LZFSE kernelcaches can only be decompressed on macOS");
+	return false;
+}
+
+#endif
+
+static void *decompress_main(void *arg) {
+	struct kernelcache *kc = arg;
+	bool success;
+	if (kc->format == KERNELCACHE_LZSS) {
+		success = decompress_lzss(kc);
+	} else {
+		success = decompress_lzfse(kc);
+	}
+	publish(kc, (success ? kc->size : atomic_load(&kc->available)), true, !success);
+	return NULL;
+}
+
+bool kernelcache_open(struct kernelcache *kc, const void *file, size_t size) {
+	memset(kc, 0, sizeof(*kc));
+	size_t raw_size;
+	if (!find_payload(kc, file, size, &raw_size)) {
+		return false;
+	}
+	kc->format = payload_format(kc->payload, kc->payload_size);
+	if (kc->format == KERNELCACHE_LZSS) {
+		raw_size = load_be32(kc->payload + 12);
+	} else if (kc->format == KERNELCACHE_LZFSE) {
+		// Without a recorded size, reserve generously; untouched pages cost nothing.
+		if (raw_size == 0) {
+			raw_size = 16 * kc->payload_size;
+			raw_size = (raw_size < (1 << 26) ? (1 << 26) : raw_size);
+		}
+	} else {
+		set_error(kc, "Unrecognized kernelcache compression");
+		return false;
+	}
+	if (raw_size == 0) {
+		set_error(kc, "Kernelcache is empty");
+		return false;
+	}
+	int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+	kc->data = mmap(NULL, raw_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (kc->data == MAP_FAILED) {
+		kc->data = NULL;
+		set_error(kc, "Could not map %zu bytes for the decompressed kernelcache", raw_size);
+		return false;
+	}
+	kc->capacity = raw_size;
+	kc->size = raw_size;
+	pthread_mutex_init(&kc->lock, NULL);
+	pthread_cond_init(&kc->cond, NULL);
+	if (pthread_create(&kc->thread, NULL, decompress_main, kc) != 0) {
+		// Decompress on this thread instead.
+		decompress_main(kc);
+		kc->joined = true;
+	}
+	return true;
+}
+
+bool kernelcache_wait(struct kernelcache *kc, size_t size) {
+	if (atomic_load(&kc->available) >= size) {
+		return true;
+	}
+	pthread_mutex_lock(&kc->lock);
+	while (!kc->done && atomic_load(&kc->available) < size) {
+		pthread_cond_wait(&kc->cond, &kc->lock);
+	}
+	bool success = (atomic_load(&kc->available) >= size);
+	pthread_mutex_unlock(&kc->lock);
+	return success;
+}
+
+bool kernelcache_finish(struct kernelcache *kc) {
+	if (!kc->joined) {
+		pthread_join(kc->thread, NULL);
+		kc->joined = true;
+	}
+	return !kc->failed;
+}
+
+void kernelcache_close(struct kernelcache *kc) {
+	if (kc->data == NULL) {
+		return;
+	}
+	kernelcache_finish(kc);
+	munmap(kc->data, kc->capacity);
+	kc->data = NULL;
+	pthread_cond_destroy(&kc->cond);
+	pthread_mutex_destroy(&kc->lock);
+}
@@ -0,0 +1,109 @@
+#ifndef MACHO_GADGETS__KERNELCACHE_H_
+#define MACHO_GADGETS__KERNELCACHE_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * enum kernelcache_format
+ *
+ * Description:
+ * 	The compression format of a kernelcache payload.
+ */
+enum kernelcache_format {
+	KERNELCACHE_NONE,
+	KERNELCACHE_LZSS,
+	KERNELCACHE_LZFSE,
+};
+
+/*
+ * struct kernelcache
+ *
+ * Description:
+ * 	A compressed kernelcache being decompressed into an anonymous mapping.
+ *
+ * 	The payload may be wrapped in an IMG4 or IM4P container, and is either an LZSS payload with
+ * 	a "complzss" header or an LZFSE stream. Decompression runs on a background thread that
+ * 	publishes how much of the output is available, so that the image can be scanned while it
+ * 	is still being decompressed.
+ */
+struct kernelcache {
+	enum kernelcache_format format;
+	const uint8_t *payload;
+	size_t payload_size;
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+	atomic_size_t available;
+	bool done;
+	bool failed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool joined;
+	char error[256];
+};
+
+/*
+ * kernelcache_format
+ *
+ * Description:
+ * 	Returns the compression format of the given file, or KERNELCACHE_NONE if it is not a
+ * 	recognized compressed kernelcache.
+ */
+enum kernelcache_format kernelcache_format(const void *file, size_t size);
+
+/*
+ * kernelcache_open
+ *
+ * Description:
+ * 	Start decompressing a kernelcache. The file must stay mapped until kernelcache_finish
+ * 	returns.
+ *
+ * Parameters:
+ * 	out	kc			The kernelcache.
+ * 		file			The contents of the compressed file.
+ * 		size			The size of the file.
+ *
+ * Returns:
+ * 	True if decompression was started. On failure, kc->error describes the problem.
+ */
+bool kernelcache_open(struct kernelcache *kc, const void *file, size_t size);
+
+/*
+ * kernelcache_wait
+ *
+ * Description:
+ * 	Wait until the first size bytes of the decompressed image are available, or until
+ * 	decompression is done.
+ *
+ * Returns:
+ * 	False if decompression failed, or if it succeeded but the decompressed image is shorter
+ * 	than size bytes.
+ */
+bool kernelcache_wait(struct kernelcache *kc, size_t size);
+
+/*
+ * kernelcache_finish
+ *
+ * Description:
+ * 	Wait for decompression to complete. After this, kc->size is the size of the decompressed
+ * 	image.
+ *
+ * Returns:
+ * 	True on success. On failure, kc->error describes the problem.
+ */
+bool kernelcache_finish(struct kernelcache *kc);
+
+/*
+ * kernelcache_close
+ *
+ * Description:
+ * 	Wait for decompression to complete and unmap the decompressed image.
+ */
+void kernelcache_close(struct kernelcache *kc);
+
+#endif
@@ -22,6 +22,8 @@
 #include "macho.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
 
 #define MACHO_STRUCT_FIELD(macho, struct_type, object, field)		\
@@ -31,6 +33,92 @@
 #define MACHO_STRUCT_SIZE(macho, struct_type)				\
 	(macho_is_64(macho) ? sizeof(struct_type##_64) : sizeof(struct_type))
 
+/*
+ * The routines that walk the symbol table or the load commands are written once as
+ * MACHO_SPECIALIZED functions taking the Mach-O's width as a constant is_64 parameter, using
+ * MACHO_FIELD and MACHO_SIZE instead of MACHO_STRUCT_FIELD and MACHO_STRUCT_SIZE. The public
+ * functions check the width once with MACHO_SPECIALIZE and call a 64-bit or a 32-bit copy in
+ * which every field access is a plain load.
+ */
+#define MACHO_SPECIALIZED static inline __attribute__((always_inline))
+
+#define MACHO_FIELD(is_64, struct_type, object, field)			\
+	(is_64 ? ((const struct_type##_64 *)(object))->field		\
+	       : ((const struct_type *)(object))->field)
+
+#define MACHO_SIZE(is_64, struct_type)					\
+	(is_64 ? sizeof(struct_type##_64) : sizeof(struct_type))
+
+#define MACHO_SPECIALIZE(macho, function, ...)				\
+	(macho_is_64(macho) ? function(__VA_ARGS__, true) : function(__VA_ARGS__, false))
+
+/*
+ * struct macho_symbol_index
+ *
+ * Description:
+ * 	The entries of a symtab sorted by address and then by nlist index. Only section symbols
+ * 	are resolved to, but all entries bound the size of the symbol before them.
+ */
+struct macho_symbol_index {
+	const struct symtab_command *symtab;
+	uint32_t count;
+	struct macho_symbol {
+		uint64_t address;
+		uint32_t strx;
+		uint32_t index;
+		bool section;
+	} symbols[];
+};
+
+/*
+ * struct macho_name_index
+ *
+ * Description:
+ * 	An open-addressing hash table from symbol names to nlist entries. Each slot holds the hash
+ * 	of the name and the nlist index plus 1, or 0 if the slot is empty.
+ */
+struct macho_name_index {
+	const struct symtab_command *symtab;
+	uint32_t mask;
+	struct macho_name_slot {
+		uint32_t hash;
+		uint32_t entry;
+	} slots[];
+};
+
+/*
+ * struct macho_layout
+ *
+ * Description:
+ * 	The segments and sections of a Mach-O with their fields widened to 64 bits.
+ *
+ * 	segments holds the segments with a nonzero size sorted by address. The sections of each of
+ * 	those segments with a nonzero size are in sections, sorted by address, starting at
+ * 	first_section. section_by_index lists all sections in load command order. If the
+ * 	intervals of some segments, or of some sections in a segment, overlap, lookups in them
+ * 	walk the load commands instead, so that overlapping intervals resolve in load command
+ * 	order.
+ */
+struct macho_layout {
+	uint32_t nsegments;
+	uint32_t nsections;
+	bool overlapping;
+	struct macho_segment_interval {
+		uint64_t addr;
+		uint64_t size;
+		const struct load_command *lc;
+		uint32_t first_section;
+		uint32_t nsections;
+		bool overlapping;
+	} *segments;
+	struct macho_section_interval {
+		uint64_t addr;
+		uint64_t size;
+		const void *section;
+	} *sections;
+	const void **section_by_index;
+};
+
 bool
 macho_is_32(const struct macho *macho) {
 	return (macho->mh32->magic == MH_MAGIC);
@@ -46,15 +134,49 @@ macho_header_size(const struct macho *macho) {
 	return MACHO_STRUCT_SIZE(macho, struct mach_header);
 }
 
+/*
+ * macho_file_data
+ *
+ * Description:
+ * 	Get a pointer to the data at the given offset in the file containing the Mach-O.
+ */
+static const void *
+macho_file_data(const struct macho *macho, size_t offset) {
+	return (const void *)((uintptr_t)macho->mh - macho->fileoff + offset);
+}
+
+/*
+ * macho_section_is_zerofill
+ *
+ * Description:
+ * 	Returns true if a section with the given flags has no contents in the file.
+ */
+static bool
+macho_section_is_zerofill(uint32_t flags) {
+	uint32_t type = flags & SECTION_TYPE;
+	return (type == S_ZEROFILL || type == S_GB_ZEROFILL || type == S_THREAD_LOCAL_ZEROFILL);
+}
+
 /*
  * macho_get_nlist
  */
+MACHO_SPECIALIZED const void *
+macho_get_nlist_impl(const struct macho *macho, const struct symtab_command *symtab, uint32_t idx,
+		const bool is_64) {
+	return (const void *)((uintptr_t)macho_file_data(macho, symtab->symoff)
+			+ idx * MACHO_SIZE(is_64, struct nlist));
+}
+
 static const void *
 macho_get_nlist(const struct macho *macho, const struct symtab_command *symtab, uint32_t idx) {
-	return (const void *)((uintptr_t)macho->mh + symtab->symoff
-			+ idx * MACHO_STRUCT_SIZE(macho, struct nlist));
+	return MACHO_SPECIALIZE(macho, macho_get_nlist_impl, macho, symtab, idx);
 }
 
+static const struct macho_segment_interval *macho_layout_segment(const struct macho_layout *layout,
+		uint64_t addr);
+static const struct macho_section_interval *macho_layout_section(const struct macho_layout *layout,
+		const struct macho_segment_interval *segment, uint64_t addr);
+
 static size_t
 guess_symbol_size(const struct macho *macho, uint64_t addr, uint64_t next) {
 	size_t size = -1;
@@ -62,6 +184,25 @@ guess_symbol_size(const struct macho *macho, uint64_t addr, uint64_t next) {
 	if (next != -1) {
 		size = next - addr;
 	}
+	const struct macho_layout *layout = macho->layout;
+	if (layout != NULL && !layout->overlapping) {
+		const struct macho_segment_interval *segment = macho_layout_segment(layout, addr);
+		if (segment == NULL) {
+			return (size == -1 ? 0 : size);
+		}
+		if (!segment->overlapping) {
+			// Limit the size to the section and the segment.
+			const struct macho_section_interval *sect =
+				macho_layout_section(layout, segment, addr);
+			if (sect != NULL && sect->addr + sect->size - addr < size) {
+				size = sect->addr + sect->size - addr;
+			}
+			if (segment->addr + segment->size - addr < size) {
+				size = segment->addr + segment->size - addr;
+			}
+			return (size == -1 ? 0 : size);
+		}
+	}
 	// See if any segment contains this address.
 	const struct load_command *sc = macho_segment_containing_address(macho, addr);
 	if (sc != NULL) {
@@ -86,24 +227,25 @@ guess_symbol_size(const struct macho *macho, uint64_t addr, uint64_t next) {
 	return (size == -1 ? 0 : size);
 }
 
-// TODO: Make this resilient to malformed images.
 /*
  * macho_symtab_string
  *
  * Description:
- * 	Find the string at the given index in the symtab.
+ * 	Find the string at the given index in the symtab. macho_validate checked that the string
+ * 	table lies within the file, but it can't read the table itself, since a kernelcache's
+ * 	load commands are validated before the rest of it has been decompressed. A table that
+ * 	doesn't end in a NUL has no strings, so that no string runs off its end.
  */
 static const char *
 macho_symtab_string(const struct macho *macho, const struct symtab_command *symtab,
 		uint32_t strx) {
-	uintptr_t base = (uintptr_t)macho->mh + symtab->stroff;
-	if (strx < 4 || strx >= symtab->strsize) {
+	const char *base = (const char *)macho_file_data(macho, symtab->stroff);
+	if (strx < 4 || strx >= symtab->strsize || base[symtab->strsize - 1] != 0) {
 		return NULL;
 	}
-	return (const char *)(base + strx);
+	return base + strx;
 }
 
-// TODO: Make this resilient to malformed images.
 /*
  * macho_symtab_string_index
  *
@@ -113,7 +255,7 @@ macho_symtab_string(const struct macho *macho, const struct symtab_command *symt
 static uint32_t
 macho_symtab_string_index(const struct macho *macho, const struct symtab_command *symtab,
 		const char *name) {
-	uintptr_t base = (uintptr_t)macho->mh + symtab->stroff;
+	uintptr_t base = (uintptr_t)macho_file_data(macho, symtab->stroff);
 	const char *str = (const char *)(base + 4);
 	const char *end = (const char *)(base + symtab->strsize);
 	uint32_t strx;
@@ -139,68 +281,226 @@ macho_symtab_string_index(const struct macho *macho, const struct symtab_command
 	}
 }
 
-macho_result
-macho_validate_32(const struct mach_header *mh, size_t size) {
-	if (mh->magic != MH_MAGIC) {
-		macho_error("32-bit Mach-O invalid magic: %x", mh->magic);
+/*
+ * macho_range_in_file
+ *
+ * Description:
+ * 	Returns true if the count elements of elem_size bytes at offset all lie within a file of
+ * 	file_size bytes.
+ */
+static bool
+macho_range_in_file(uint64_t offset, uint64_t count, uint64_t elem_size, uint64_t file_size) {
+	return (offset <= file_size && count <= (file_size - offset) / elem_size);
+}
+
+/*
+ * macho_validate_segment
+ *
+ * Description:
+ * 	Validate a segment command and its sections. The segment's file contents must lie within
+ * 	the file, and the contents of each section that isn't zero-filled within the segment's.
+ */
+MACHO_SPECIALIZED macho_result
+macho_validate_segment(const struct load_command *lc, uint64_t file_size, const bool is_64) {
+	const size_t segment_size = MACHO_SIZE(is_64, struct segment_command);
+	const size_t section_size = MACHO_SIZE(is_64, struct section);
+	if (lc->cmdsize < segment_size) {
+		macho_error("Mach-O segment command too small");
 		return MACHO_ERROR;
 	}
-	if (size < sizeof(*mh)) {
-		macho_error("32-bit Mach-O too small");
+	uint64_t nsects   = MACHO_FIELD(is_64, struct segment_command, lc, nsects);
+	uint64_t vmaddr   = MACHO_FIELD(is_64, struct segment_command, lc, vmaddr);
+	uint64_t fileoff  = MACHO_FIELD(is_64, struct segment_command, lc, fileoff);
+	uint64_t filesize = MACHO_FIELD(is_64, struct segment_command, lc, filesize);
+	if (!macho_range_in_file(segment_size, nsects, section_size, lc->cmdsize)) {
+		macho_error("Mach-O segment command too small for its sections");
 		return MACHO_ERROR;
 	}
-	if (mh->sizeofcmds > size) {
-		macho_error("Mach-O sizeofcmds greater than file size");
+	if (!macho_range_in_file(fileoff, filesize, 1, file_size)) {
+		macho_error("Mach-O segment outside the file");
 		return MACHO_ERROR;
 	}
-	// TODO: Validate commands.
+	uintptr_t sect = (uintptr_t)lc + segment_size;
+	for (uint64_t i = 0; i < nsects; i++, sect += section_size) {
+		if (macho_section_is_zerofill(MACHO_FIELD(is_64, struct section, sect, flags))) {
+			continue;
+		}
+		uint64_t addr = MACHO_FIELD(is_64, struct section, sect, addr);
+		uint64_t size = MACHO_FIELD(is_64, struct section, sect, size);
+		if (size > 0 && (addr < vmaddr
+				|| !macho_range_in_file(addr - vmaddr, size, 1, filesize))) {
+			macho_error("Mach-O section outside its segment");
+			return MACHO_ERROR;
+		}
+	}
 	return MACHO_SUCCESS;
 }
 
-macho_result
-macho_validate_64(const struct mach_header_64 *mh, size_t size) {
-	if (mh->magic != MH_MAGIC_64) {
-		macho_error("64-bit Mach-O invalid magic: %x", mh->magic);
+/*
+ * macho_validate_command
+ *
+ * Description:
+ * 	Validate a load command whose cmdsize has been checked. The commands that are read by the
+ * 	routines below must be large enough for their struct, and the file ranges they describe
+ * 	must lie within the file.
+ */
+MACHO_SPECIALIZED macho_result
+macho_validate_command(const struct load_command *lc, uint64_t file_size, const bool is_64) {
+	switch (lc->cmd) {
+		case LC_SEGMENT:
+		case LC_SEGMENT_64:
+			// Only segments of the Mach-O's own width are ever looked at.
+			if ((lc->cmd == LC_SEGMENT_64) != is_64) {
+				return MACHO_SUCCESS;
+			}
+			return macho_validate_segment(lc, file_size, is_64);
+		case LC_SYMTAB: {
+			const struct symtab_command *symtab = (const struct symtab_command *)lc;
+			if (lc->cmdsize < sizeof(*symtab)) {
+				macho_error("Malformed LC_SYMTAB");
+				return MACHO_ERROR;
+			}
+			const size_t nlist_size = MACHO_SIZE(is_64, struct nlist);
+			const size_t nlist_align = (is_64 ? _Alignof(struct nlist_64)
+					: _Alignof(struct nlist));
+			if (symtab->symoff % nlist_align != 0) {
+				macho_error("Mach-O symbol table is misaligned");
+				return MACHO_ERROR;
+			}
+			bool syms_ok = macho_range_in_file(symtab->symoff, symtab->nsyms,
+					nlist_size, file_size);
+			bool strs_ok = macho_range_in_file(symtab->stroff, symtab->strsize, 1,
+					file_size);
+			if (!syms_ok || !strs_ok) {
+				macho_error("Mach-O symbol table outside the file");
+				return MACHO_ERROR;
+			}
+			return MACHO_SUCCESS;
+		}
+		case LC_UUID:
+			if (lc->cmdsize < sizeof(struct uuid_command)) {
+				macho_error("Malformed LC_UUID");
+				return MACHO_ERROR;
+			}
+			return MACHO_SUCCESS;
+		case LC_FILESET_ENTRY: {
+			const struct fileset_entry_command *fe =
+				(const struct fileset_entry_command *)lc;
+			if (lc->cmdsize < sizeof(*fe) || fe->entry_id.offset < sizeof(*fe)
+					|| fe->entry_id.offset >= lc->cmdsize
+					|| memchr((const char *)fe + fe->entry_id.offset, 0,
+						lc->cmdsize - fe->entry_id.offset) == NULL) {
+				macho_error("Malformed LC_FILESET_ENTRY");
+				return MACHO_ERROR;
+			}
+			if (fe->fileoff >= file_size) {
+				macho_error("Fileset entry outside the file");
+				return MACHO_ERROR;
+			}
+			if (fe->fileoff % 8 != 0) {
+				macho_error("Fileset entry is misaligned");
+				return MACHO_ERROR;
+			}
+			return MACHO_SUCCESS;
+		}
+		default:
+			return MACHO_SUCCESS;
+	}
+}
+
+/*
+ * macho_validate_header
+ *
+ * Description:
+ * 	Validate a Mach-O header of the given width and its load commands. The Mach-O is fileoff
+ * 	bytes into the file containing it, and size bytes long.
+ */
+MACHO_SPECIALIZED macho_result
+macho_validate_header(const void *mh, size_t size, size_t fileoff, const bool is_64) {
+	const size_t header_size = MACHO_SIZE(is_64, struct mach_header);
+	uint32_t magic = MACHO_FIELD(is_64, struct mach_header, mh, magic);
+	if (magic != (is_64 ? MH_MAGIC_64 : MH_MAGIC)) {
+		macho_error("%s Mach-O invalid magic: %x", (is_64 ? "64-bit" : "32-bit"), magic);
 		return MACHO_ERROR;
 	}
-	if (size < sizeof(*mh)) {
-		macho_error("64-bit Mach-O too small");
+	if (size < header_size) {
+		macho_error("%s Mach-O too small", (is_64 ? "64-bit" : "32-bit"));
 		return MACHO_ERROR;
 	}
-	if (mh->sizeofcmds > size) {
+	uint32_t sizeofcmds = MACHO_FIELD(is_64, struct mach_header, mh, sizeofcmds);
+	if (sizeofcmds > size - header_size) {
 		macho_error("Mach-O sizeofcmds greater than file size");
 		return MACHO_ERROR;
 	}
-	// TODO: Validate commands.
+	// Check each load command's size before looking at it, so that walking the commands
+	// never leaves the commands area. Commands are 8-byte aligned in a 64-bit Mach-O.
+	const uint32_t cmd_align = (is_64 ? 8 : 4);
+	uint64_t file_size = (uint64_t)fileoff + size;
+	const uint8_t *cmds = (const uint8_t *)mh + header_size;
+	for (uint32_t offset = 0; offset < sizeofcmds;) {
+		const struct load_command *lc = (const struct load_command *)(cmds + offset);
+		if (sizeofcmds - offset < sizeof(*lc) || lc->cmdsize < sizeof(*lc)
+				|| lc->cmdsize % cmd_align != 0
+				|| lc->cmdsize > sizeofcmds - offset) {
+			macho_error("Mach-O load command at offset %u is malformed", offset);
+			return MACHO_ERROR;
+		}
+		if (macho_validate_command(lc, file_size, is_64) != MACHO_SUCCESS) {
+			return MACHO_ERROR;
+		}
+		offset += lc->cmdsize;
+	}
 	return MACHO_SUCCESS;
 }
 
 macho_result
-macho_validate(const void *mh, size_t size) {
+macho_validate_32(const struct mach_header *mh, size_t size) {
+	return macho_validate_header(mh, size, 0, false);
+}
+
+macho_result
+macho_validate_64(const struct mach_header_64 *mh, size_t size) {
+	return macho_validate_header(mh, size, 0, true);
+}
+
+/*
+ * macho_validate_in_file
+ *
+ * Description:
+ * 	Validate a Mach-O that is fileoff bytes into the file containing it, and size bytes long.
+ */
+static macho_result
+macho_validate_in_file(const void *mh, size_t size, size_t fileoff) {
 	const struct mach_header *mh32 = mh;
 	if (size < sizeof(*mh32)) {
 		macho_error("Mach-O too small");
 		return MACHO_ERROR;
 	}
 	if (mh32->magic == MH_MAGIC) {
-		return macho_validate_32(mh32, size);
+		return macho_validate_header(mh, size, fileoff, false);
 	} else if (mh32->magic == MH_MAGIC_64) {
-		return macho_validate_64((const struct mach_header_64 *)mh, size);
+		return macho_validate_header(mh, size, fileoff, true);
 	} else {
 		macho_error("Mach-O invalid magic: %x", mh32->magic);
 		return MACHO_ERROR;
 	}
 }
 
-const struct load_command *
-macho_next_load_command(const struct macho *macho, const struct load_command *lc) {
-	uintptr_t lc_start = (uintptr_t)macho->mh + macho_header_size(macho);
+macho_result
+macho_validate(const void *mh, size_t size) {
+	return macho_validate_in_file(mh, size, 0);
+}
+
+MACHO_SPECIALIZED const struct load_command *
+macho_next_load_command_impl(const struct macho *macho, const struct load_command *lc,
+		const bool is_64) {
+	uintptr_t lc_start = (uintptr_t)macho->mh + MACHO_SIZE(is_64, struct mach_header);
 	if (lc == NULL) {
 		lc = (const struct load_command *) lc_start;
 	} else {
 		lc = (const struct load_command *)((uintptr_t)lc + lc->cmdsize);
 	}
-	size_t sizeofcmds = MACHO_STRUCT_FIELD(macho, struct mach_header, macho->mh, sizeofcmds);
+	size_t sizeofcmds = MACHO_FIELD(is_64, struct mach_header, macho->mh, sizeofcmds);
 	if ((uintptr_t)lc >= lc_start + sizeofcmds) {
 		lc = NULL;
 	}
@@ -208,9 +508,15 @@ macho_next_load_command(const struct macho *macho, const struct load_command *lc
 }
 
 const struct load_command *
-macho_find_load_command(const struct macho *macho, const struct load_command *lc, uint32_t cmd) {
+macho_next_load_command(const struct macho *macho, const struct load_command *lc) {
+	return MACHO_SPECIALIZE(macho, macho_next_load_command_impl, macho, lc);
+}
+
+MACHO_SPECIALIZED const struct load_command *
+macho_find_load_command_impl(const struct macho *macho, const struct load_command *lc, uint32_t cmd,
+		const bool is_64) {
 	for (;;) {
-		lc = macho_next_load_command(macho, lc);
+		lc = macho_next_load_command_impl(macho, lc, is_64);
 		if (lc == NULL) {
 			return NULL;
 		}
@@ -221,20 +527,95 @@ macho_find_load_command(const struct macho *macho, const struct load_command *lc
 }
 
 const struct load_command *
-macho_next_segment(const struct macho *macho, const struct load_command *sc) {
-	const uint32_t cmd = (macho_is_64(macho) ? LC_SEGMENT_64 : LC_SEGMENT);
-	return macho_find_load_command(macho, sc, cmd);
+macho_find_load_command(const struct macho *macho, const struct load_command *lc, uint32_t cmd) {
+	return MACHO_SPECIALIZE(macho, macho_find_load_command_impl, macho, lc, cmd);
+}
+
+bool
+macho_is_fileset(const struct macho *macho) {
+	return (MACHO_STRUCT_FIELD(macho, struct mach_header, macho->mh, filetype) == MH_FILESET);
+}
+
+macho_result
+macho_fileset_entry(const struct macho *fileset, const struct load_command *entry,
+		struct macho *macho, const char **entry_id) {
+	const struct fileset_entry_command *fe = (const struct fileset_entry_command *)entry;
+	if (fe->cmdsize < sizeof(*fe) || fe->entry_id.offset < sizeof(*fe)
+			|| fe->entry_id.offset >= fe->cmdsize) {
+		macho_error("Malformed LC_FILESET_ENTRY");
+		return MACHO_ERROR;
+	}
+	const char *id = (const char *)fe + fe->entry_id.offset;
+	if (memchr(id, 0, fe->cmdsize - fe->entry_id.offset) == NULL) {
+		macho_error("LC_FILESET_ENTRY identifier is not terminated");
+		return MACHO_ERROR;
+	}
+	// Entry offsets are relative to the start of the file containing the fileset.
+	size_t file_size = fileset->fileoff + fileset->size;
+	if (fe->fileoff >= file_size) {
+		macho_error("Fileset entry '%s' is outside the file", id);
+		return MACHO_ERROR;
+	}
+	const void *mh = macho_file_data(fileset, fe->fileoff);
+	size_t size = file_size - fe->fileoff;
+	if (macho_validate_in_file(mh, size, fe->fileoff) != MACHO_SUCCESS) {
+		return MACHO_ERROR;
+	}
+	macho->mh = (void *)mh;
+	macho->size = size;
+	macho->fileoff = fe->fileoff;
+	macho->symbol_index = NULL;
+	macho->name_index = NULL;
+	macho->layout = NULL;
+	macho->index_threads = fileset->index_threads;
+	if (entry_id != NULL) {
+		*entry_id = id;
+	}
+	return MACHO_SUCCESS;
+}
+
+macho_result
+macho_find_fileset_entry(const struct macho *fileset, const char *entry_id,
+		struct macho *macho) {
+	const struct load_command *lc = NULL;
+	for (;;) {
+		lc = macho_find_load_command(fileset, lc, LC_FILESET_ENTRY);
+		if (lc == NULL) {
+			return MACHO_NOT_FOUND;
+		}
+		const char *id;
+		struct macho entry;
+		if (macho_fileset_entry(fileset, lc, &entry, &id) != MACHO_SUCCESS) {
+			return MACHO_ERROR;
+		}
+		if (strcmp(id, entry_id) == 0) {
+			*macho = entry;
+			return MACHO_SUCCESS;
+		}
+	}
+}
+
+MACHO_SPECIALIZED const struct load_command *
+macho_next_segment_impl(const struct macho *macho, const struct load_command *sc,
+		const bool is_64) {
+	const uint32_t cmd = (is_64 ? LC_SEGMENT_64 : LC_SEGMENT);
+	return macho_find_load_command_impl(macho, sc, cmd, is_64);
 }
 
 const struct load_command *
-macho_find_segment(const struct macho *macho, const char *segname) {
+macho_next_segment(const struct macho *macho, const struct load_command *sc) {
+	return MACHO_SPECIALIZE(macho, macho_next_segment_impl, macho, sc);
+}
+
+MACHO_SPECIALIZED const struct load_command *
+macho_find_segment_impl(const struct macho *macho, const char *segname, const bool is_64) {
 	const struct load_command *lc = NULL;
 	for (;;) {
-		lc = macho_next_segment(macho, lc);
+		lc = macho_next_segment_impl(macho, lc, is_64);
 		if (lc == NULL) {
 			return NULL;
 		}
-		const char *lc_segname = MACHO_STRUCT_FIELD(macho, struct segment_command, lc, segname);
+		const char *lc_segname = MACHO_FIELD(is_64, struct segment_command, lc, segname);
 		if (strcmp(lc_segname, segname) != 0) {
 			continue;
 		}
@@ -242,16 +623,21 @@ macho_find_segment(const struct macho *macho, const char *segname) {
 	}
 }
 
-const void *
-macho_find_section(const struct macho *macho, const struct load_command *segment,
-		const char *sectname) {
-	const size_t segment_size = MACHO_STRUCT_SIZE(macho, struct segment_command);
-	const size_t section_size = MACHO_STRUCT_SIZE(macho, struct section);
+const struct load_command *
+macho_find_segment(const struct macho *macho, const char *segname) {
+	return MACHO_SPECIALIZE(macho, macho_find_segment_impl, macho, segname);
+}
+
+MACHO_SPECIALIZED const void *
+macho_find_section_impl(const struct macho *macho, const struct load_command *segment,
+		const char *sectname, const bool is_64) {
+	const size_t segment_size = MACHO_SIZE(is_64, struct segment_command);
+	const size_t section_size = MACHO_SIZE(is_64, struct section);
 	uintptr_t sect = (uintptr_t)segment + segment_size;
-	size_t nsects = MACHO_STRUCT_FIELD(macho, struct segment_command, segment, nsects);
+	size_t nsects = MACHO_FIELD(is_64, struct segment_command, segment, nsects);
 	uintptr_t end  = sect + nsects * section_size;
 	for (; sect < end; sect += section_size) {
-		const char *name = MACHO_STRUCT_FIELD(macho, struct section, sect, sectname);
+		const char *name = MACHO_FIELD(is_64, struct section, sect, sectname);
 		if (strcmp(name, sectname) == 0) {
 			return (const void *)sect;
 		}
@@ -259,17 +645,49 @@ macho_find_section(const struct macho *macho, const struct load_command *segment
 	return NULL;
 }
 
+const void *
+macho_find_section(const struct macho *macho, const struct load_command *segment,
+		const char *sectname) {
+	return MACHO_SPECIALIZE(macho, macho_find_section_impl, macho, segment, sectname);
+}
+
+MACHO_SPECIALIZED const void *
+macho_next_section_impl(const struct macho *macho, const struct load_command *segment,
+		const void *section, const bool is_64) {
+	const size_t segment_size = MACHO_SIZE(is_64, struct segment_command);
+	const size_t section_size = MACHO_SIZE(is_64, struct section);
+	uintptr_t first = (uintptr_t)segment + segment_size;
+	size_t nsects = MACHO_FIELD(is_64, struct segment_command, segment, nsects);
+	uintptr_t sect = (section == NULL ? first : (uintptr_t)section + section_size);
+	if (sect >= first + nsects * section_size) {
+		return NULL;
+	}
+	return (const void *)sect;
+}
+
+const void *
+macho_next_section(const struct macho *macho, const struct load_command *segment,
+		const void *section) {
+	return MACHO_SPECIALIZE(macho, macho_next_section_impl, macho, segment, section);
+}
+
+uint32_t
+macho_section_flags(const struct macho *macho, const void *section) {
+	return MACHO_STRUCT_FIELD(macho, struct section, section, flags);
+}
+
 void
 macho_segment_data(const struct macho *macho, const struct load_command *segment,
 		const void **data, uint64_t *addr, size_t *size) {
-	size_t   fileoff = MACHO_STRUCT_FIELD(macho, struct segment_command, segment, fileoff);
-	uint64_t vmaddr  = MACHO_STRUCT_FIELD(macho, struct segment_command, segment, vmaddr);
-	size_t   vmsize  = MACHO_STRUCT_FIELD(macho, struct segment_command, segment, vmsize);
+	size_t   fileoff  = MACHO_STRUCT_FIELD(macho, struct segment_command, segment, fileoff);
+	size_t   filesize = MACHO_STRUCT_FIELD(macho, struct segment_command, segment, filesize);
+	uint64_t vmaddr   = MACHO_STRUCT_FIELD(macho, struct segment_command, segment, vmaddr);
+	size_t   vmsize   = MACHO_STRUCT_FIELD(macho, struct segment_command, segment, vmsize);
 	if (data != NULL) {
-		*data = (const void *)((uintptr_t)macho->mh + fileoff);
+		*data = macho_file_data(macho, fileoff);
 	}
 	*addr = vmaddr;
-	*size = vmsize;
+	*size = (vmsize < filesize ? vmsize : filesize);
 }
 
 void
@@ -277,11 +695,14 @@ macho_section_data(const struct macho *macho, const struct load_command *segment
 		const void *section, const void **data, uint64_t *addr, size_t *size) {
 	uint64_t section_addr = MACHO_STRUCT_FIELD(macho, struct section, section, addr);
 	size_t   section_size = MACHO_STRUCT_FIELD(macho, struct section, section, size);
+	if (macho_section_is_zerofill(MACHO_STRUCT_FIELD(macho, struct section, section, flags))) {
+		section_size = 0;
+	}
 	if (data != NULL) {
 		uint64_t segment_addr = MACHO_STRUCT_FIELD(macho, struct segment_command, segment, vmaddr);
 		size_t fileoff = MACHO_STRUCT_FIELD(macho, struct segment_command, segment, fileoff);
 		uint64_t vmoff = section_addr - segment_addr;
-		*data = (const void *)((uintptr_t)macho->mh + fileoff + vmoff);
+		*data = macho_file_data(macho, fileoff + vmoff);
 	}
 	*addr = section_addr;
 	*size = section_size;
@@ -306,14 +727,14 @@ macho_find_base(const struct macho *macho, uint64_t *base) {
 	}
 }
 
-void
-macho_for_each_symbol(const struct macho *macho, const struct symtab_command *symtab,
-		macho_for_each_symbol_fn callback, void *context) {
+MACHO_SPECIALIZED void
+macho_for_each_symbol_impl(const struct macho *macho, const struct symtab_command *symtab,
+		macho_for_each_symbol_fn callback, void *context, const bool is_64) {
 	bool stop = false;
 	for (uint32_t i = 0; !stop && i < symtab->nsyms; i++) {
-		const void *nl_i = macho_get_nlist(macho, symtab, i);
-		uint32_t n_strx = MACHO_STRUCT_FIELD(macho, struct nlist, nl_i, n_un.n_strx);
-		uint8_t n_type = MACHO_STRUCT_FIELD(macho, struct nlist, nl_i, n_type);
+		const void *nl_i = macho_get_nlist_impl(macho, symtab, i, is_64);
+		uint32_t n_strx = MACHO_FIELD(is_64, struct nlist, nl_i, n_un.n_strx);
+		uint8_t n_type = MACHO_FIELD(is_64, struct nlist, nl_i, n_type);
 		// We can't currently handle STAB entries or non-section symbol types.
 		if ((n_type & N_STAB) != 0 || (n_type & N_TYPE) != N_SECT) {
 			continue;
@@ -322,23 +743,461 @@ macho_for_each_symbol(const struct macho *macho, const struct symtab_command *sy
 		if (symbol == NULL) {
 			continue;
 		}
-		uint64_t address = MACHO_STRUCT_FIELD(macho, struct nlist, nl_i, n_value);
+		uint64_t address = MACHO_FIELD(is_64, struct nlist, nl_i, n_value);
 		stop = callback(context, symbol, address);
 	}
 }
 
+void
+macho_for_each_symbol(const struct macho *macho, const struct symtab_command *symtab,
+		macho_for_each_symbol_fn callback, void *context) {
+	MACHO_SPECIALIZE(macho, macho_for_each_symbol_impl, macho, symtab, callback, context);
+}
+
+/*
+ * macho_run_parallel
+ *
+ * Description:
+ * 	Call fn with each task index from 0 to count - 1, one task per thread, with the calling
+ * 	thread running task 0. Tasks whose thread can't be started run on the calling thread.
+ */
+struct macho_task {
+	void (*fn)(void *context, unsigned task);
+	void *context;
+	unsigned task;
+	pthread_t thread;
+	bool started;
+};
+
+static void *
+macho_run_task(void *arg) {
+	struct macho_task *task = arg;
+	task->fn(task->context, task->task);
+	return NULL;
+}
+
+static void
+macho_run_parallel(unsigned count, void (*fn)(void *context, unsigned task), void *context) {
+	struct macho_task tasks[count];
+	for (unsigned i = 1; i < count; i++) {
+		tasks[i] = (struct macho_task) { fn, context, i };
+		tasks[i].started = (pthread_create(&tasks[i].thread, NULL, macho_run_task,
+					&tasks[i]) == 0);
+	}
+	fn(context, 0);
+	for (unsigned i = 1; i < count; i++) {
+		if (tasks[i].started) {
+			pthread_join(tasks[i].thread, NULL);
+		} else {
+			fn(context, i);
+		}
+	}
+}
+
+// The number of entries macho_for_each_symbol_chunk decodes at a time.
+#define MACHO_SYMBOL_CHUNK 1024
+
+// How many entries ahead of the one being decoded to prefetch the name of.
+#define MACHO_PREFETCH_DISTANCE 16
+
+struct macho_symbol_pool {
+	const struct macho *macho;
+	const struct symtab_command *symtab;
+	bool prefetch;
+	macho_symbol_chunk_fn callback;
+	void *context;
+	uint32_t nchunks;
+	atomic_uint next;
+};
+
+MACHO_SPECIALIZED void
+macho_decode_symbols_impl(const struct macho *macho, const struct symtab_command *symtab,
+		uint32_t first, uint32_t count, bool prefetch, struct macho_nlist_entry *entries,
+		const bool is_64) {
+	const char *strings = (const char *)macho_file_data(macho, symtab->stroff);
+	// Check the end of the string table once, as macho_symtab_string does for each string, so
+	// that each name only takes one compare: strx - 4 wraps around for the indexes below 4,
+	// which have no name.
+	uint32_t names = 0;
+	if (symtab->strsize > 4 && strings[symtab->strsize - 1] == 0) {
+		names = symtab->strsize - 4;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t idx = first + i;
+		if (prefetch && symtab->nsyms - idx > MACHO_PREFETCH_DISTANCE) {
+			const void *ahead = macho_get_nlist_impl(macho, symtab,
+					idx + MACHO_PREFETCH_DISTANCE, is_64);
+			uint32_t strx = MACHO_FIELD(is_64, struct nlist, ahead, n_un.n_strx);
+			if (strx < symtab->strsize) {
+				__builtin_prefetch(strings + strx);
+			}
+		}
+		const void *nl = macho_get_nlist_impl(macho, symtab, idx, is_64);
+		struct macho_nlist_entry *entry = &entries[i];
+		entry->strx    = MACHO_FIELD(is_64, struct nlist, nl, n_un.n_strx);
+		entry->name    = (entry->strx - 4 < names ? strings + entry->strx : NULL);
+		entry->address = MACHO_FIELD(is_64, struct nlist, nl, n_value);
+		entry->index   = idx;
+		entry->type    = MACHO_FIELD(is_64, struct nlist, nl, n_type);
+		entry->sect    = MACHO_FIELD(is_64, struct nlist, nl, n_sect);
+	}
+}
+
+static void
+macho_symbol_worker(void *context, unsigned thread) {
+	struct macho_symbol_pool *pool = context;
+	struct macho_nlist_entry entries[MACHO_SYMBOL_CHUNK];
+	for (;;) {
+		uint32_t chunk = atomic_fetch_add(&pool->next, 1);
+		if (chunk >= pool->nchunks) {
+			break;
+		}
+		uint32_t first = chunk * MACHO_SYMBOL_CHUNK;
+		uint32_t count = pool->symtab->nsyms - first;
+		if (count > MACHO_SYMBOL_CHUNK) {
+			count = MACHO_SYMBOL_CHUNK;
+		}
+		MACHO_SPECIALIZE(pool->macho, macho_decode_symbols_impl, pool->macho, pool->symtab,
+				first, count, pool->prefetch, entries);
+		pool->callback(pool->context, thread, entries, count);
+	}
+}
+
+void
+macho_for_each_symbol_chunk(const struct macho *macho, const struct symtab_command *symtab,
+		unsigned threads, bool prefetch, macho_symbol_chunk_fn callback, void *context) {
+	struct macho_symbol_pool pool = { macho, symtab, prefetch, callback, context };
+	pool.nchunks = (symtab->nsyms + MACHO_SYMBOL_CHUNK - 1) / MACHO_SYMBOL_CHUNK;
+	atomic_init(&pool.next, 0);
+	if (threads > pool.nchunks) {
+		threads = pool.nchunks;
+	}
+	macho_run_parallel((threads > 0 ? threads : 1), macho_symbol_worker, &pool);
+}
+
+static int
+compare_symbols(const void *a, const void *b) {
+	const struct macho_symbol *sym_a = a;
+	const struct macho_symbol *sym_b = b;
+	if (sym_a->address != sym_b->address) {
+		return (sym_a->address < sym_b->address ? -1 : 1);
+	}
+	return (sym_a->index > sym_b->index) - (sym_a->index < sym_b->index);
+}
+
+static void
+macho_fill_symbol_index(void *context, unsigned thread, const struct macho_nlist_entry *entries,
+		size_t count) {
+	struct macho_symbol_index *index = context;
+	for (size_t i = 0; i < count; i++) {
+		const struct macho_nlist_entry *entry = &entries[i];
+		struct macho_symbol *sym = &index->symbols[entry->index];
+		sym->address = entry->address;
+		sym->strx    = entry->strx;
+		sym->index   = entry->index;
+		sym->section = ((entry->type & N_TYPE) == N_SECT);
+	}
+}
+
+/*
+ * struct macho_symbol_sort
+ *
+ * Description:
+ * 	A parallel merge sort of the symbol index. The symbols are split into one slice per
+ * 	thread, the slices are sorted concurrently, and then pairs of sorted runs are merged
+ * 	concurrently, doubling the width of the runs each round, until one run is left.
+ */
+struct macho_symbol_sort {
+	struct macho_symbol *from;
+	struct macho_symbol *to;
+	uint32_t count;
+	unsigned slices;
+	unsigned width;
+};
+
+static uint32_t
+macho_slice_start(const struct macho_symbol_sort *sort, unsigned slice) {
+	if (slice > sort->slices) {
+		slice = sort->slices;
+	}
+	return (uint64_t)sort->count * slice / sort->slices;
+}
+
+static void
+macho_sort_slice(void *context, unsigned slice) {
+	struct macho_symbol_sort *sort = context;
+	uint32_t start = macho_slice_start(sort, slice);
+	uint32_t end = macho_slice_start(sort, slice + 1);
+	qsort(sort->from + start, end - start, sizeof(sort->from[0]), compare_symbols);
+}
+
+static void
+macho_merge_runs(void *context, unsigned pair) {
+	struct macho_symbol_sort *sort = context;
+	unsigned first = 2 * pair * sort->width;
+	uint32_t i   = macho_slice_start(sort, first);
+	uint32_t mid = macho_slice_start(sort, first + sort->width);
+	uint32_t end = macho_slice_start(sort, first + 2 * sort->width);
+	uint32_t j = mid;
+	uint32_t out = i;
+	while (i < mid && j < end) {
+		if (compare_symbols(&sort->from[j], &sort->from[i]) < 0) {
+			sort->to[out++] = sort->from[j++];
+		} else {
+			sort->to[out++] = sort->from[i++];
+		}
+	}
+	memcpy(&sort->to[out], &sort->from[i], (mid - i) * sizeof(sort->to[0]));
+	out += mid - i;
+	memcpy(&sort->to[out], &sort->from[j], (end - j) * sizeof(sort->to[0]));
+}
+
+static void
+macho_sort_symbols(struct macho_symbol *symbols, uint32_t count, unsigned threads) {
+	struct macho_symbol *scratch = NULL;
+	if (threads > 1 && count >= 4 * MACHO_SYMBOL_CHUNK) {
+		scratch = malloc((size_t)count * sizeof(*scratch));
+	}
+	if (scratch == NULL) {
+		qsort(symbols, count, sizeof(symbols[0]), compare_symbols);
+		return;
+	}
+	struct macho_symbol_sort sort = { symbols, scratch, count, threads, 1 };
+	macho_run_parallel(threads, macho_sort_slice, &sort);
+	for (; sort.width < sort.slices; sort.width *= 2) {
+		unsigned pairs = (sort.slices + 2 * sort.width - 1) / (2 * sort.width);
+		macho_run_parallel(pairs, macho_merge_runs, &sort);
+		struct macho_symbol *swap = sort.from;
+		sort.from = sort.to;
+		sort.to = swap;
+	}
+	if (sort.from != symbols) {
+		memcpy(symbols, sort.from, (size_t)count * sizeof(symbols[0]));
+	}
+	free(scratch);
+}
+
+macho_result
+macho_index_symbols(struct macho *macho, const struct symtab_command *symtab) {
+	struct macho_symbol_index *index = macho->symbol_index;
+	if (index != NULL) {
+		if (index->symtab == symtab) {
+			return MACHO_SUCCESS;
+		}
+		free(index);
+		macho->symbol_index = NULL;
+	}
+	index = malloc(sizeof(*index) + (size_t)symtab->nsyms * sizeof(index->symbols[0]));
+	if (index == NULL) {
+		macho_error("could not allocate symbol index");
+		return MACHO_ERROR;
+	}
+	index->symtab = symtab;
+	index->count = symtab->nsyms;
+	macho_for_each_symbol_chunk(macho, symtab, macho->index_threads, false,
+			macho_fill_symbol_index, index);
+	macho_sort_symbols(index->symbols, index->count, macho->index_threads);
+	macho->symbol_index = index;
+	return MACHO_SUCCESS;
+}
+
+/*
+ * macho_symbol_name_hash
+ *
+ * Description:
+ * 	The FNV-1a hash of a symbol name.
+ */
+static uint32_t
+macho_symbol_name_hash(const char *name) {
+	uint32_t hash = 2166136261;
+	for (; *name != 0; name++) {
+		hash = (hash ^ (uint8_t)*name) * 16777619;
+	}
+	return hash;
+}
+
+/*
+ * macho_nlist_name_impl
+ *
+ * Description:
+ * 	Get the name of the nlist entry at the given index, or NULL if it has none.
+ */
+MACHO_SPECIALIZED const char *
+macho_nlist_name_impl(const struct macho *macho, const struct symtab_command *symtab, uint32_t idx,
+		uint32_t *strx, const bool is_64) {
+	const void *nl = macho_get_nlist_impl(macho, symtab, idx, is_64);
+	*strx = MACHO_FIELD(is_64, struct nlist, nl, n_un.n_strx);
+	return macho_symtab_string(macho, symtab, *strx);
+}
+
+struct macho_name_entry {
+	const char *name;
+	uint32_t hash;
+	uint32_t strx;
+};
+
+static void
+macho_hash_symbol_names(void *context, unsigned thread, const struct macho_nlist_entry *entries,
+		size_t count) {
+	struct macho_name_entry *names = context;
+	for (size_t i = 0; i < count; i++) {
+		struct macho_name_entry *name = &names[entries[i].index];
+		name->name = entries[i].name;
+		name->strx = entries[i].strx;
+		name->hash = (name->name != NULL ? macho_symbol_name_hash(name->name) : 0);
+	}
+}
+
+macho_result
+macho_index_symbol_names(struct macho *macho, const struct symtab_command *symtab) {
+	struct macho_name_index *index = macho->name_index;
+	if (index != NULL) {
+		if (index->symtab == symtab) {
+			return MACHO_SUCCESS;
+		}
+		free(index);
+		macho->name_index = NULL;
+	}
+	// Keep the load factor at most 1/2.
+	size_t nslots = 16;
+	while (nslots < 2 * (size_t)symtab->nsyms) {
+		nslots *= 2;
+	}
+	index = calloc(1, sizeof(*index) + nslots * sizeof(index->slots[0]));
+	struct macho_name_entry *names = malloc((size_t)symtab->nsyms * sizeof(*names) + 1);
+	if (index == NULL || names == NULL) {
+		free(index);
+		free(names);
+		macho_error("could not allocate symbol name index");
+		return MACHO_ERROR;
+	}
+	index->symtab = symtab;
+	index->mask = nslots - 1;
+	// Finding and hashing the names is most of the work, so that is done in parallel, and
+	// the table is filled in nlist order afterwards.
+	macho_for_each_symbol_chunk(macho, symtab, macho->index_threads, true,
+			macho_hash_symbol_names, names);
+	for (uint32_t i = 0; i < symtab->nsyms; i++) {
+		const struct macho_name_entry *name = &names[i];
+		if (name->name == NULL) {
+			continue;
+		}
+		// A name that appears more than once resolves like macho_symtab_string_index would:
+		// to the first entry using the lowest string index.
+		uint32_t slot = name->hash & index->mask;
+		for (;; slot = (slot + 1) & index->mask) {
+			struct macho_name_slot *s = &index->slots[slot];
+			if (s->entry == 0) {
+				s->hash = name->hash;
+				s->entry = i + 1;
+				break;
+			}
+			const struct macho_name_entry *other = &names[s->entry - 1];
+			if (s->hash == name->hash && strcmp(other->name, name->name) == 0) {
+				if (name->strx < other->strx) {
+					s->entry = i + 1;
+				}
+				break;
+			}
+		}
+	}
+	free(names);
+	macho->name_index = index;
+	return MACHO_SUCCESS;
+}
+
+/*
+ * macho_lookup_symbol_name_impl
+ *
+ * Description:
+ * 	Find the nlist entry for the symbol name in the name index.
+ *
+ * Returns:
+ * 	The nlist index of the symbol, or -1 if it was not found.
+ */
+MACHO_SPECIALIZED uint32_t
+macho_lookup_symbol_name_impl(const struct macho *macho, const struct macho_name_index *index,
+		const char *name, const bool is_64) {
+	uint32_t hash = macho_symbol_name_hash(name);
+	for (uint32_t slot = hash & index->mask;; slot = (slot + 1) & index->mask) {
+		const struct macho_name_slot *s = &index->slots[slot];
+		if (s->entry == 0) {
+			return -1;
+		}
+		if (s->hash != hash) {
+			continue;
+		}
+		uint32_t strx;
+		const char *other = macho_nlist_name_impl(macho, index->symtab, s->entry - 1, &strx,
+				is_64);
+		if (strcmp(other, name) == 0) {
+			return s->entry - 1;
+		}
+	}
+}
+
+void
+macho_free_indexes(struct macho *macho) {
+	free(macho->symbol_index);
+	free(macho->name_index);
+	free(macho->layout);
+	macho->symbol_index = NULL;
+	macho->name_index = NULL;
+	macho->layout = NULL;
+}
+
+/*
+ * macho_symbol_index_for
+ *
+ * Description:
+ * 	Returns the symbol index of the Mach-O if it was built for the given symtab.
+ */
+static const struct macho_symbol_index *
+macho_symbol_index_for(const struct macho *macho, const struct symtab_command *symtab) {
+	const struct macho_symbol_index *index = macho->symbol_index;
+	return (index != NULL && index->symtab == symtab ? index : NULL);
+}
+
+/*
+ * macho_symbol_index_upper_bound
+ *
+ * Description:
+ * 	Returns the index of the first symbol in the sorted symbol index whose address is greater
+ * 	than addr.
+ */
+static uint32_t
+macho_symbol_index_upper_bound(const struct macho_symbol_index *index, uint64_t addr) {
+	uint32_t lo = 0;
+	uint32_t hi = index->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (index->symbols[mid].address <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
 /*
  * macho_next_symbol
  *
  * Description:
  * 	Returns the address of the next symbol following addr.
  */
-static uint64_t
-macho_next_symbol(const struct macho *macho, const struct symtab_command *symtab, uint64_t addr) {
+MACHO_SPECIALIZED uint64_t
+macho_next_symbol_impl(const struct macho *macho, const struct symtab_command *symtab,
+		uint64_t addr, const bool is_64) {
+	const struct macho_symbol_index *index = macho_symbol_index_for(macho, symtab);
+	if (index != NULL) {
+		uint32_t next = macho_symbol_index_upper_bound(index, addr);
+		return (next < index->count ? index->symbols[next].address : -1);
+	}
 	uint64_t next = -1;
 	for (uint32_t i = 0; i < symtab->nsyms; i++) {
-		const void *nl_i = macho_get_nlist(macho, symtab, i);
-		uint64_t n_value = MACHO_STRUCT_FIELD(macho, struct nlist, nl_i, n_value);
+		const void *nl_i = macho_get_nlist_impl(macho, symtab, i, is_64);
+		uint64_t n_value = MACHO_FIELD(is_64, struct nlist, nl_i, n_value);
 		if (n_value > addr && n_value < next) {
 			next = n_value;
 		}
@@ -346,47 +1205,117 @@ macho_next_symbol(const struct macho *macho, const struct symtab_command *symtab
 	return next;
 }
 
-// TODO: Make this resilient to malformed images.
-macho_result
-macho_resolve_symbol(const struct macho *macho, const struct symtab_command *symtab,
-		const char *symbol, uint64_t *addr, size_t *size) {
-	uint32_t strx = macho_symtab_string_index(macho, symtab, symbol);
-	if (strx == 0) {
-		return MACHO_NOT_FOUND;
+static uint64_t
+macho_next_symbol(const struct macho *macho, const struct symtab_command *symtab, uint64_t addr) {
+	return MACHO_SPECIALIZE(macho, macho_next_symbol_impl, macho, symtab, addr);
+}
+
+/*
+ * macho_find_symbol_before
+ *
+ * Description:
+ * 	Find the section symbol with the greatest address not above addr, preferring the lowest
+ * 	nlist index among symbols at the same address.
+ *
+ * Returns:
+ * 	The nlist index of the symbol, or -1 if there is none.
+ */
+MACHO_SPECIALIZED uint32_t
+macho_find_symbol_before_impl(const struct macho *macho, const struct symtab_command *symtab,
+		uint64_t addr, const bool is_64) {
+	const struct macho_symbol_index *index = macho_symbol_index_for(macho, symtab);
+	if (index != NULL) {
+		uint32_t i = macho_symbol_index_upper_bound(index, addr);
+		while (i > 0 && !index->symbols[i - 1].section) {
+			i--;
+		}
+		if (i == 0) {
+			return -1;
+		}
+		// Symbols at the same address are sorted by nlist index.
+		uint32_t sym = i - 1;
+		for (; i > 0 && index->symbols[i - 1].address == index->symbols[sym].address; i--) {
+			if (index->symbols[i - 1].section) {
+				sym = i - 1;
+			}
+		}
+		return index->symbols[sym].index;
 	}
-	uint64_t addr0 = 0;
 	uint32_t symidx = -1;
+	uint64_t sym_addr = 0;
 	for (uint32_t i = 0; i < symtab->nsyms; i++) {
-		const void *nl_i = macho_get_nlist(macho, symtab, i);
-		uint32_t n_strx = MACHO_STRUCT_FIELD(macho, struct nlist, nl_i, n_un.n_strx);
-		if (n_strx == strx) {
-			uint8_t n_type = MACHO_STRUCT_FIELD(macho, struct nlist, nl_i, n_type);
-			if ((n_type & N_TYPE) == N_UNDF) {
-				return MACHO_NOT_FOUND;
-			}
-			if ((n_type & N_TYPE) != N_SECT) {
-				macho_error("unexpected Mach-O symbol type %x for symbol %s",
-						n_type & N_TYPE, symbol);
-				return MACHO_ERROR;
-			}
-			addr0 = MACHO_STRUCT_FIELD(macho, struct nlist, nl_i, n_value);
+		const void *nl_i = macho_get_nlist_impl(macho, symtab, i, is_64);
+		uint8_t n_type = MACHO_FIELD(is_64, struct nlist, nl_i, n_type);
+		if ((n_type & N_TYPE) != N_SECT) {
+			continue; // TODO: Handle other symbol types.
+		}
+		uint64_t n_value = MACHO_FIELD(is_64, struct nlist, nl_i, n_value);
+		if ((symidx == -1 || sym_addr < n_value) && n_value <= addr) {
 			symidx = i;
-			break;
+			sym_addr = n_value;
+		}
+	}
+	return symidx;
+}
+
+static uint32_t
+macho_find_symbol_before(const struct macho *macho, const struct symtab_command *symtab,
+		uint64_t addr) {
+	return MACHO_SPECIALIZE(macho, macho_find_symbol_before_impl, macho, symtab, addr);
+}
+
+MACHO_SPECIALIZED macho_result
+macho_resolve_symbol_impl(const struct macho *macho, const struct symtab_command *symtab,
+		const char *symbol, uint64_t *addr, size_t *size, const bool is_64) {
+	uint32_t symidx = -1;
+	const struct macho_name_index *index = macho->name_index;
+	if (index != NULL && index->symtab == symtab) {
+		symidx = macho_lookup_symbol_name_impl(macho, index, symbol, is_64);
+	} else {
+		uint32_t strx = macho_symtab_string_index(macho, symtab, symbol);
+		if (strx == 0) {
+			return MACHO_NOT_FOUND;
+		}
+		for (uint32_t i = 0; i < symtab->nsyms; i++) {
+			const void *nl_i = macho_get_nlist_impl(macho, symtab, i, is_64);
+			uint32_t n_strx = MACHO_FIELD(is_64, struct nlist, nl_i, n_un.n_strx);
+			if (n_strx == strx) {
+				symidx = i;
+				break;
+			}
 		}
 	}
 	if (symidx == -1) {
 		return MACHO_NOT_FOUND;
 	}
+	const void *nl = macho_get_nlist_impl(macho, symtab, symidx, is_64);
+	uint8_t n_type = MACHO_FIELD(is_64, struct nlist, nl, n_type);
+	if ((n_type & N_TYPE) == N_UNDF) {
+		return MACHO_NOT_FOUND;
+	}
+	if ((n_type & N_TYPE) != N_SECT) {
+		macho_error("unexpected Mach-O symbol type %x for symbol %s",
+				n_type & N_TYPE, symbol);
+		return MACHO_ERROR;
+	}
+	uint64_t addr0 = MACHO_FIELD(is_64, struct nlist, nl, n_value);
 	if (addr != NULL) {
 		*addr = addr0;
 	}
 	if (size != NULL) {
-		uint64_t next = macho_next_symbol(macho, symtab, addr0);
+		uint64_t next = macho_next_symbol_impl(macho, symtab, addr0, is_64);
 		*size = guess_symbol_size(macho, addr0, next);
 	}
 	return MACHO_SUCCESS;
 }
 
+macho_result
+macho_resolve_symbol(const struct macho *macho, const struct symtab_command *symtab,
+		const char *symbol, uint64_t *addr, size_t *size) {
+	return MACHO_SPECIALIZE(macho, macho_resolve_symbol_impl, macho, symtab, symbol, addr,
+			size);
+}
+
 size_t
 macho_guess_symbol_size(const struct macho *macho, const struct symtab_command *symtab,
 		uint64_t addr) {
@@ -400,25 +1329,12 @@ macho_guess_symbol_size(const struct macho *macho, const struct symtab_command *
 macho_result
 macho_resolve_address(const struct macho *macho, const struct symtab_command *symtab,
 		uint64_t addr, const char **name, size_t *size, size_t *offset) {
-	const void *sym = NULL;
-	uint32_t symidx;
-	uint64_t sym_addr;
-	for (uint32_t i = 0; i < symtab->nsyms; i++) {
-		const void *nl_i = macho_get_nlist(macho, symtab, i);
-		uint8_t n_type = MACHO_STRUCT_FIELD(macho, struct nlist, nl_i, n_type);
-		if ((n_type & N_TYPE) != N_SECT) {
-			continue; // TODO: Handle other symbol types.
-		}
-		uint64_t n_value = MACHO_STRUCT_FIELD(macho, struct nlist, nl_i, n_value);
-		if ((sym == NULL || sym_addr < n_value) && n_value <= addr) {
-			sym = nl_i;
-			symidx = i;
-			sym_addr = n_value;
-		}
-	}
-	if (sym == NULL) {
+	uint32_t symidx = macho_find_symbol_before(macho, symtab, addr);
+	if (symidx == -1) {
 		return MACHO_NOT_FOUND;
 	}
+	const void *sym = macho_get_nlist(macho, symtab, symidx);
+	uint64_t sym_addr = MACHO_STRUCT_FIELD(macho, struct nlist, sym, n_value);
 	uint32_t sym_sect = MACHO_STRUCT_FIELD(macho, struct nlist, sym, n_sect);
 	if (sym_sect == NO_SECT) {
 		macho_error("symbol index %d has no section", symidx);
@@ -438,7 +1354,90 @@ macho_resolve_address(const struct macho *macho, const struct symtab_command *sy
 	return MACHO_SUCCESS;
 }
 
-// TODO: Make this resilient to malformed images.
+struct macho_address_order {
+	uint64_t address;
+	size_t index;
+};
+
+static int
+compare_address_order(const void *a, const void *b) {
+	const struct macho_address_order *order_a = a;
+	const struct macho_address_order *order_b = b;
+	if (order_a->address != order_b->address) {
+		return (order_a->address < order_b->address ? -1 : 1);
+	}
+	return (order_a->index > order_b->index) - (order_a->index < order_b->index);
+}
+
+macho_result
+macho_resolve_addresses(struct macho *macho, const struct symtab_command *symtab,
+		const uint64_t *addrs, size_t count, struct macho_address_symbol *symbols) {
+	if (macho_index_symbols(macho, symtab) != MACHO_SUCCESS) {
+		return MACHO_ERROR;
+	}
+	struct macho_address_order *order = malloc(count * sizeof(*order) + 1);
+	if (order == NULL) {
+		macho_error("could not allocate address order");
+		return MACHO_ERROR;
+	}
+	for (size_t i = 0; i < count; i++) {
+		order[i].address = addrs[i];
+		order[i].index = i;
+	}
+	qsort(order, count, sizeof(*order), compare_address_order);
+	// Walk the sorted addresses and the sorted symbols together. sym is the section symbol
+	// that macho_find_symbol_before would pick for the current address: the one with the
+	// lowest nlist index at the greatest address not above it.
+	const struct macho_symbol_index *index = macho->symbol_index;
+	macho_result result = MACHO_SUCCESS;
+	uint32_t next = 0;
+	uint32_t sym = -1;
+	struct macho_address_symbol found = {};
+	uint64_t sym_addr = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t addr = order[i].address;
+		uint32_t prev_sym = sym;
+		for (; next < index->count && index->symbols[next].address <= addr; next++) {
+			if (index->symbols[next].section
+					&& (sym == -1 || index->symbols[sym].address
+						!= index->symbols[next].address)) {
+				sym = next;
+			}
+		}
+		if (sym != prev_sym) {
+			sym_addr = index->symbols[sym].address;
+			const void *nl = macho_get_nlist(macho, symtab, index->symbols[sym].index);
+			if (MACHO_STRUCT_FIELD(macho, struct nlist, nl, n_sect) == NO_SECT) {
+				macho_error("symbol index %d has no section",
+						index->symbols[sym].index);
+				result = MACHO_ERROR;
+				break;
+			}
+			uint32_t after = sym;
+			while (after < index->count && index->symbols[after].address == sym_addr) {
+				after++;
+			}
+			uint64_t next_addr = -1;
+			if (after < index->count) {
+				next_addr = index->symbols[after].address;
+			}
+			found.name = macho_symtab_string(macho, symtab, index->symbols[sym].strx);
+			found.size = guess_symbol_size(macho, sym_addr, next_addr);
+		}
+		struct macho_address_symbol *s = &symbols[order[i].index];
+		if (sym == -1) {
+			s->name = NULL;
+			s->size = 0;
+			s->offset = 0;
+			continue;
+		}
+		*s = found;
+		s->offset = addr - sym_addr;
+	}
+	free(order);
+	return result;
+}
+
 macho_result
 macho_search_data(const struct macho *macho, const void *data, size_t size, int minprot,
 		uint64_t *addr) {
@@ -454,7 +1453,7 @@ macho_search_data(const struct macho *macho, const void *data, size_t size, int
 		}
 		size_t fileoff  = MACHO_STRUCT_FIELD(macho, struct segment_command, lc, fileoff);
 		size_t filesize = MACHO_STRUCT_FIELD(macho, struct segment_command, lc, filesize);
-		const void *base = (const void *)((uintptr_t)macho->mh + fileoff);
+		const void *base = macho_file_data(macho, fileoff);
 		const void *found = memmem(base, filesize, data, size);
 		if (found == NULL) {
 			continue;
@@ -466,24 +1465,175 @@ macho_search_data(const struct macho *macho, const void *data, size_t size, int
 	}
 }
 
-const void *
-macho_section_by_index(const struct macho *macho, uint32_t sect) {
+static int
+compare_segment_intervals(const void *a, const void *b) {
+	const struct macho_segment_interval *seg_a = a;
+	const struct macho_segment_interval *seg_b = b;
+	return (seg_a->addr > seg_b->addr) - (seg_a->addr < seg_b->addr);
+}
+
+static int
+compare_section_intervals(const void *a, const void *b) {
+	const struct macho_section_interval *sect_a = a;
+	const struct macho_section_interval *sect_b = b;
+	return (sect_a->addr > sect_b->addr) - (sect_a->addr < sect_b->addr);
+}
+
+MACHO_SPECIALIZED macho_result
+macho_index_layout_impl(struct macho *macho, const bool is_64) {
+	if (macho->layout != NULL) {
+		return MACHO_SUCCESS;
+	}
+	const size_t segment_size = MACHO_SIZE(is_64, struct segment_command);
+	const size_t section_size = MACHO_SIZE(is_64, struct section);
+	size_t nsegments = 0;
+	size_t nsections = 0;
+	const struct load_command *lc = NULL;
+	while ((lc = macho_next_segment_impl(macho, lc, is_64)) != NULL) {
+		nsegments++;
+		nsections += MACHO_FIELD(is_64, struct segment_command, lc, nsects);
+	}
+	// The tables share one allocation.
+	struct macho_layout *layout = malloc(sizeof(*layout)
+			+ nsegments * sizeof(layout->segments[0])
+			+ nsections * sizeof(layout->sections[0])
+			+ nsections * sizeof(layout->section_by_index[0]));
+	if (layout == NULL) {
+		macho_error("could not allocate Mach-O layout");
+		return MACHO_ERROR;
+	}
+	layout->segments = (struct macho_segment_interval *)(layout + 1);
+	layout->sections = (struct macho_section_interval *)(layout->segments + nsegments);
+	layout->section_by_index = (const void **)(layout->sections + nsections);
+	layout->nsegments = 0;
+	layout->nsections = nsections;
+	layout->overlapping = false;
+	uint32_t nsorted = 0;
+	uint32_t idx = 0;
+	while ((lc = macho_next_segment_impl(macho, lc, is_64)) != NULL) {
+		struct macho_segment_interval *seg = &layout->segments[layout->nsegments];
+		seg->addr = MACHO_FIELD(is_64, struct segment_command, lc, vmaddr);
+		seg->size = MACHO_FIELD(is_64, struct segment_command, lc, vmsize);
+		seg->lc = lc;
+		seg->first_section = nsorted;
+		seg->overlapping = false;
+		uint32_t nsects = MACHO_FIELD(is_64, struct segment_command, lc, nsects);
+		uintptr_t sect = (uintptr_t)lc + segment_size;
+		for (uint32_t i = 0; i < nsects; i++, sect += section_size) {
+			layout->section_by_index[idx++] = (const void *)sect;
+			uint64_t size = MACHO_FIELD(is_64, struct section, sect, size);
+			if (seg->size == 0 || size == 0) {
+				continue;
+			}
+			struct macho_section_interval *interval = &layout->sections[nsorted++];
+			interval->addr = MACHO_FIELD(is_64, struct section, sect, addr);
+			interval->size = size;
+			interval->section = (const void *)sect;
+		}
+		seg->nsections = nsorted - seg->first_section;
+		if (seg->size == 0) {
+			continue;
+		}
+		struct macho_section_interval *sections = &layout->sections[seg->first_section];
+		qsort(sections, seg->nsections, sizeof(*sections), compare_section_intervals);
+		for (uint32_t i = 1; i < seg->nsections; i++) {
+			if (sections[i - 1].size > sections[i].addr - sections[i - 1].addr) {
+				seg->overlapping = true;
+			}
+		}
+		layout->nsegments++;
+	}
+	qsort(layout->segments, layout->nsegments, sizeof(layout->segments[0]),
+			compare_segment_intervals);
+	for (uint32_t i = 1; i < layout->nsegments; i++) {
+		const struct macho_segment_interval *prev = &layout->segments[i - 1];
+		if (prev->size > layout->segments[i].addr - prev->addr) {
+			layout->overlapping = true;
+		}
+	}
+	macho->layout = layout;
+	return MACHO_SUCCESS;
+}
+
+macho_result
+macho_index_layout(struct macho *macho) {
+	return MACHO_SPECIALIZE(macho, macho_index_layout_impl, macho);
+}
+
+/*
+ * macho_layout_segment
+ *
+ * Description:
+ * 	Find the segment interval containing the address.
+ */
+static const struct macho_segment_interval *
+macho_layout_segment(const struct macho_layout *layout, uint64_t addr) {
+	uint32_t lo = 0;
+	uint32_t hi = layout->nsegments;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (layout->segments[mid].addr <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) {
+		return NULL;
+	}
+	const struct macho_segment_interval *seg = &layout->segments[lo - 1];
+	return (addr - seg->addr < seg->size ? seg : NULL);
+}
+
+/*
+ * macho_layout_section
+ *
+ * Description:
+ * 	Find the section interval of the segment containing the address.
+ */
+static const struct macho_section_interval *
+macho_layout_section(const struct macho_layout *layout,
+		const struct macho_segment_interval *segment, uint64_t addr) {
+	const struct macho_section_interval *sections = &layout->sections[segment->first_section];
+	uint32_t lo = 0;
+	uint32_t hi = segment->nsections;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (sections[mid].addr <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) {
+		return NULL;
+	}
+	const struct macho_section_interval *sect = &sections[lo - 1];
+	return (addr - sect->addr < sect->size ? sect : NULL);
+}
+
+MACHO_SPECIALIZED const void *
+macho_section_by_index_impl(const struct macho *macho, uint32_t sect, const bool is_64) {
 	if (sect < 1) {
 		return NULL;
 	}
+	const struct macho_layout *layout = macho->layout;
+	if (layout != NULL) {
+		return (sect <= layout->nsections ? layout->section_by_index[sect - 1] : NULL);
+	}
 	const struct load_command *lc = NULL;
 	uint32_t idx = 1;
 	uintptr_t sectcmd = 0;
 	for (;;) {
-		lc = macho_next_segment(macho, lc);
+		lc = macho_next_segment_impl(macho, lc, is_64);
 		if (lc == NULL) {
 			break;
 		}
-		uint32_t nsects = MACHO_STRUCT_FIELD(macho, struct segment_command, lc, nsects);
+		uint32_t nsects = MACHO_FIELD(is_64, struct segment_command, lc, nsects);
 		if (sect < idx + nsects) {
-			size_t lc_size = MACHO_STRUCT_SIZE(macho, struct segment_command);
+			size_t lc_size = MACHO_SIZE(is_64, struct segment_command);
 			sectcmd = (uintptr_t)lc + lc_size;
-			sectcmd += (sect - idx) * MACHO_STRUCT_SIZE(macho, struct section);
+			sectcmd += (sect - idx) * MACHO_SIZE(is_64, struct section);
 			break;
 		}
 		idx += nsects;
@@ -491,32 +1641,58 @@ macho_section_by_index(const struct macho *macho, uint32_t sect) {
 	return (const void *)sectcmd;
 }
 
-const struct load_command *
-macho_segment_containing_address(const struct macho *macho, uint64_t addr) {
+const void *
+macho_section_by_index(const struct macho *macho, uint32_t sect) {
+	return MACHO_SPECIALIZE(macho, macho_section_by_index_impl, macho, sect);
+}
+
+MACHO_SPECIALIZED const struct load_command *
+macho_segment_containing_address_impl(const struct macho *macho, uint64_t addr, const bool is_64) {
+	const struct macho_layout *layout = macho->layout;
+	if (layout != NULL && !layout->overlapping) {
+		const struct macho_segment_interval *seg = macho_layout_segment(layout, addr);
+		return (seg != NULL ? seg->lc : NULL);
+	}
 	const struct load_command *lc = NULL;
 	for (;;) {
-		lc = macho_next_segment(macho, lc);
+		lc = macho_next_segment_impl(macho, lc, is_64);
 		if (lc == NULL) {
 			return NULL;
 		}
-		uint64_t vmaddr = MACHO_STRUCT_FIELD(macho, struct segment_command, lc, vmaddr);
-		size_t   vmsize = MACHO_STRUCT_FIELD(macho, struct segment_command, lc, vmsize);
+		uint64_t vmaddr = MACHO_FIELD(is_64, struct segment_command, lc, vmaddr);
+		size_t   vmsize = MACHO_FIELD(is_64, struct segment_command, lc, vmsize);
 		if (vmaddr <= addr && addr < vmaddr + vmsize) {
 			return lc;
 		}
 	}
 }
 
-const void *
-macho_section_containing_address(const struct macho *macho, const struct load_command *lc,
-		uint64_t addr) {
-	uint32_t nsects = MACHO_STRUCT_FIELD(macho, struct segment_command, lc, nsects);
-	const size_t lc_size = MACHO_STRUCT_SIZE(macho, struct segment_command);
-	const size_t sect_size = MACHO_STRUCT_SIZE(macho, struct section);
+const struct load_command *
+macho_segment_containing_address(const struct macho *macho, uint64_t addr) {
+	return MACHO_SPECIALIZE(macho, macho_segment_containing_address_impl, macho, addr);
+}
+
+MACHO_SPECIALIZED const void *
+macho_section_containing_address_impl(const struct macho *macho, const struct load_command *lc,
+		uint64_t addr, const bool is_64) {
+	const struct macho_layout *layout = macho->layout;
+	if (layout != NULL) {
+		// Find the segment's interval by its address.
+		uint64_t vmaddr = MACHO_FIELD(is_64, struct segment_command, lc, vmaddr);
+		const struct macho_segment_interval *seg = macho_layout_segment(layout, vmaddr);
+		if (seg != NULL && seg->lc == lc && !seg->overlapping) {
+			const struct macho_section_interval *sect =
+				macho_layout_section(layout, seg, addr);
+			return (sect != NULL ? sect->section : NULL);
+		}
+	}
+	uint32_t nsects = MACHO_FIELD(is_64, struct segment_command, lc, nsects);
+	const size_t lc_size = MACHO_SIZE(is_64, struct segment_command);
+	const size_t sect_size = MACHO_SIZE(is_64, struct section);
 	const void *sect = (const void *)((uintptr_t)lc + lc_size);
 	for (size_t i = 0; i < nsects; i++) {
-		uint64_t sectaddr = MACHO_STRUCT_FIELD(macho, struct section, sect, addr);
-		size_t   sectsize = MACHO_STRUCT_FIELD(macho, struct section, sect, size);
+		uint64_t sectaddr = MACHO_FIELD(is_64, struct section, sect, addr);
+		size_t   sectsize = MACHO_FIELD(is_64, struct section, sect, size);
 		if (sectaddr <= addr && addr < sectaddr + sectsize) {
 			return sect;
 		}
@@ -524,3 +1700,9 @@ macho_section_containing_address(const struct macho *macho, const struct load_co
 	}
 	return NULL;
 }
+
+const void *
+macho_section_containing_address(const struct macho *macho, const struct load_command *lc,
+		uint64_t addr) {
+	return MACHO_SPECIALIZE(macho, macho_section_containing_address_impl, macho, lc, addr);
+}
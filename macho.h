@@ -34,6 +34,15 @@
  *
  * Description:
  * 	A container for a pointer to a Mach-O file and its size.
+ *
+ * 	The file offsets in a Mach-O's load commands are relative to the start of the file that
+ * 	contains it, which is fileoff bytes before the Mach-O header. This is 0 for a standalone
+ * 	Mach-O and nonzero for a fileset entry, whose offsets are relative to the fileset.
+ *
+ * 	symbol_index, name_index, and layout are optional indexes built by macho_index_symbols,
+ * 	macho_index_symbol_names, and macho_index_layout. They must be NULL unless the index has
+ * 	been built, and are released with macho_free_indexes. index_threads is the number of
+ * 	threads the symbol indexes are built with; 0 or 1 builds them on the calling thread.
  */
 struct macho {
 	union {
@@ -42,6 +51,11 @@ struct macho {
 		struct mach_header_64 *mh64;
 	};
 	size_t size;
+	size_t fileoff;
+	struct macho_symbol_index *symbol_index;
+	struct macho_name_index *name_index;
+	struct macho_layout *layout;
+	unsigned index_threads;
 };
 
 /*
@@ -71,6 +85,12 @@ extern void macho_error(const char *fmt, ...);
  * Description:
  * 	Validate that the given file is a Mach-O file.
  *
+ * 	The load commands must exactly fill sizeofcmds, and the segment, section, and symbol
+ * 	table commands must describe file ranges that lie within the file. The routines below
+ * 	only rely on these checks, so they can be used on untrusted images once they have been
+ * 	validated. Only the header and the load commands are read, so a file can be validated as
+ * 	soon as they are available.
+ *
  * Parameters:
  * 		macho			A pointer to the file data.
  * 		size			The size of the data.
@@ -141,6 +161,53 @@ const struct load_command *macho_next_load_command(const struct macho *macho,
 const struct load_command *macho_find_load_command(const struct macho *macho,
 		const struct load_command *lc, uint32_t cmd);
 
+/*
+ * macho_is_fileset
+ *
+ * Description:
+ * 	Returns true if the Mach-O file is an MH_FILESET, whose contents are the Mach-O files
+ * 	described by its LC_FILESET_ENTRY load commands.
+ */
+bool macho_is_fileset(const struct macho *macho);
+
+/*
+ * macho_fileset_entry
+ *
+ * Description:
+ * 	Get a view of the Mach-O file described by a fileset entry. The view points into the
+ * 	fileset's data; nothing is copied. The entry is validated like macho_validate, with its
+ * 	file ranges checked against the whole fileset.
+ *
+ * Parameters:
+ * 		fileset			The macho struct of the fileset.
+ * 		entry			The LC_FILESET_ENTRY load command.
+ * 	out	macho			On return, the macho struct of the entry.
+ * 	out	entry_id		On return, the entry's identifier, such as
+ * 					"com.apple.kernel". May be NULL.
+ *
+ * Returns:
+ * 	MACHO_SUCCESS on success, and MACHO_ERROR if the entry is malformed.
+ */
+macho_result macho_fileset_entry(const struct macho *fileset, const struct load_command *entry,
+		struct macho *macho, const char **entry_id);
+
+/*
+ * macho_find_fileset_entry
+ *
+ * Description:
+ * 	Find the fileset entry with the given identifier.
+ *
+ * Parameters:
+ * 		fileset			The macho struct of the fileset.
+ * 		entry_id		The identifier of the entry.
+ * 	out	macho			On return, the macho struct of the entry.
+ *
+ * Returns:
+ * 	A macho_result status code.
+ */
+macho_result macho_find_fileset_entry(const struct macho *fileset, const char *entry_id,
+		struct macho *macho);
+
 /*
  * macho_next_segment
  *
@@ -191,12 +258,38 @@ const struct load_command *macho_find_segment(const struct macho *macho,
 const void *macho_find_section(const struct macho *macho,
 		const struct load_command *segment, const char *sectname);
 
+/*
+ * macho_next_section
+ *
+ * Description:
+ * 	Iterate over the sections of a segment of the Mach-O.
+ *
+ * Parameters:
+ * 		macho			The macho struct.
+ * 		segment			The segment command.
+ * 		section			The current section. Set this to NULL to return the first
+ * 					section.
+ *
+ * Returns:
+ * 	The next section, or NULL if there are no more sections after section.
+ */
+const void *macho_next_section(const struct macho *macho,
+		const struct load_command *segment, const void *section);
+
+/*
+ * macho_section_flags
+ *
+ * Description:
+ * 	Return the flags field of the section, holding its type and attributes.
+ */
+uint32_t macho_section_flags(const struct macho *macho, const void *section);
+
 /*
  * macho_segment_data
  *
  * Description:
  * 	Return the data contents of the given segment, including the virtual memory address and
- * 	size.
+ * 	size. The size is limited to the segment's contents in the file.
  *
  * Parameters:
  * 		macho			The macho struct.
@@ -214,7 +307,7 @@ void macho_segment_data(const struct macho *macho, const struct load_command *se
  *
  * Description:
  * 	Return the data contents of the given section, including the virtual memory address and
- * 	size.
+ * 	size. A zero-fill section has no contents in the file, so its size is 0.
  *
  * Parameters:
  * 		macho			The macho struct.
@@ -279,6 +372,126 @@ typedef bool (*macho_for_each_symbol_fn)(void *context, const char *symbol, uint
 void macho_for_each_symbol(const struct macho *macho, const struct symtab_command *symtab,
 		macho_for_each_symbol_fn callback, void *context);
 
+/*
+ * struct macho_nlist_entry
+ *
+ * Description:
+ * 	A decoded symbol table entry, as passed to a macho_symbol_chunk_fn. name is NULL if the
+ * 	entry's string index is outside the string table.
+ */
+struct macho_nlist_entry {
+	const char *name;
+	uint64_t address;
+	uint32_t index;
+	uint32_t strx;
+	uint8_t type;
+	uint8_t sect;
+};
+
+/*
+ * macho_symbol_chunk_fn
+ *
+ * Description:
+ * 	A callback function type for macho_for_each_symbol_chunk.
+ *
+ * Parameters:
+ * 		context			Client context.
+ * 		thread			The index of the calling thread, from 0 up to the number
+ * 					of threads.
+ * 		entries			The decoded entries of the chunk, in nlist order.
+ * 		count			The number of entries.
+ */
+typedef void (*macho_symbol_chunk_fn)(void *context, unsigned thread,
+		const struct macho_nlist_entry *entries, size_t count);
+
+/*
+ * macho_for_each_symbol_chunk
+ *
+ * Description:
+ * 	Decode every entry of the symbol table, in chunks of a fixed number of entries, and call the
+ * 	client-supplied callback with each chunk. The chunks are shared out between a pool of
+ * 	threads, so the callback may be invoked concurrently and in any order; each thread decodes
+ * 	into a buffer of its own, so memory use doesn't depend on the size of the symbol table.
+ * 	Unlike macho_for_each_symbol, every entry is passed to the callback, whatever its type.
+ *
+ * Parameters:
+ * 		macho			The macho struct.
+ * 		symtab			The Mach-O symtab command.
+ * 		threads			The maximum number of threads to use, including the calling
+ * 					thread.
+ * 		prefetch		Prefetch the names of the entries a little ahead of the
+ * 					entry being decoded. This helps when the string table is
+ * 					large and the names are used.
+ * 		callback		The client callback.
+ * 		context			Client context for the callback.
+ */
+void macho_for_each_symbol_chunk(const struct macho *macho, const struct symtab_command *symtab,
+		unsigned threads, bool prefetch, macho_symbol_chunk_fn callback, void *context);
+
+/*
+ * macho_index_symbols
+ *
+ * Description:
+ * 	Build an index of the symbol table sorted by address, so that macho_resolve_address,
+ * 	macho_guess_symbol_size, and the size guess of macho_resolve_symbol use a binary search
+ * 	instead of a pass over the whole symbol table. Those functions use the index whenever it
+ * 	has been built for the symtab they are given. Building the index again for the same
+ * 	symtab does nothing. The entries are decoded and sorted on macho->index_threads threads.
+ *
+ * Parameters:
+ * 		macho			The macho struct.
+ * 		symtab			The Mach-O symtab command.
+ *
+ * Returns:
+ * 	A macho_result status code.
+ */
+macho_result macho_index_symbols(struct macho *macho, const struct symtab_command *symtab);
+
+/*
+ * macho_index_symbol_names
+ *
+ * Description:
+ * 	Build a hash table of the names in the symbol table, so that macho_resolve_symbol finds a
+ * 	symbol with a single probe instead of scanning the string table and the symbol table. It
+ * 	is used whenever it has been built for the symtab given to macho_resolve_symbol. Building
+ * 	the index again for the same symtab does nothing. The names are found and hashed on
+ * 	macho->index_threads threads.
+ *
+ * Parameters:
+ * 		macho			The macho struct.
+ * 		symtab			The Mach-O symtab command.
+ *
+ * Returns:
+ * 	A macho_result status code.
+ */
+macho_result macho_index_symbol_names(struct macho *macho, const struct symtab_command *symtab);
+
+/*
+ * macho_index_layout
+ *
+ * Description:
+ * 	Decode the segments and sections of the Mach-O into sorted tables of address intervals,
+ * 	so that macho_segment_containing_address, macho_section_containing_address,
+ * 	macho_section_by_index, and the size guesses of the symbol functions use a binary
+ * 	search or a table lookup instead of walking the load commands. The tables are used
+ * 	whenever they have been built. Building the tables again does nothing.
+ *
+ * Parameters:
+ * 		macho			The macho struct.
+ *
+ * Returns:
+ * 	A macho_result status code.
+ */
+macho_result macho_index_layout(struct macho *macho);
+
+/*
+ * macho_free_indexes
+ *
+ * Description:
+ * 	Free any indexes built for the Mach-O.
+ */
+void macho_free_indexes(struct macho *macho);
+
 /*
  * macho_resolve_symbol
  *
@@ -337,6 +550,43 @@ size_t macho_guess_symbol_size(const struct macho *macho, const struct symtab_co
 macho_result macho_resolve_address(const struct macho *macho, const struct symtab_command *symtab,
 		uint64_t addr, const char **name, size_t *size, size_t *offset);
 
+/*
+ * struct macho_address_symbol
+ *
+ * Description:
+ * 	The symbol containing an address, as found by macho_resolve_addresses. name is NULL if no
+ * 	symbol precedes the address. size is a guess of the size of the symbol, as for
+ * 	macho_resolve_symbol, so an offset at least as large as size is past the end of the
+ * 	symbol.
+ */
+struct macho_address_symbol {
+	const char *name;
+	size_t size;
+	size_t offset;
+};
+
+/*
+ * macho_resolve_addresses
+ *
+ * Description:
+ * 	Resolve a batch of addresses into symbols, just as macho_resolve_address would resolve
+ * 	each one. The addresses are sorted and merged with the symbol index in a single pass, so
+ * 	resolving many addresses costs about as much as resolving one without the index. The
+ * 	symbol index is built if it hasn't been already.
+ *
+ * Parameters:
+ * 		macho			The macho struct.
+ * 		symtab			The Mach-O symtab command.
+ * 		addrs			The addresses to resolve, in any order.
+ * 		count			The number of addresses.
+ * 	out	symbols			The symbol containing each address.
+ *
+ * Returns:
+ * 	A macho_result status code.
+ */
+macho_result macho_resolve_addresses(struct macho *macho, const struct symtab_command *symtab,
+		const uint64_t *addrs, size_t count, struct macho_address_symbol *symbols);
+
 /*
  * macho_search_data
  *
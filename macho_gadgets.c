@@ -1,12 +1,27 @@
+#include "gadget_index.h"
+#include "gadget_set.h"
+#include "kernelcache.h"
 #include "macho.h"
+#include "matcher.h"
+#include "output.h"
+#include "range_list.h"
+#include "rescan.h"
+#include "result_file.h"
+#include "scan.h"
+#include "server.h"
 
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 
 #include <fcntl.h>
+#include <getopt.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 static void _Noreturn verror(const char *fmt, va_list ap) {
@@ -21,15 +36,27 @@ static void _Noreturn error(const char *fmt, ...) {
 	verror(fmt, ap);
 }
 
+// The server reports Mach-O errors to its clients rather than exiting.
+static bool serving;
+
 void macho_error(const char *fmt, ...) {
 	va_list ap;
 	va_start(ap, fmt);
+	if (serving) {
+		range_list_record_macho_error(fmt, ap);
+		va_end(ap);
+		return;
+	}
 	verror(fmt, ap);
 }
 
-void open_macho(struct macho *macho, const char *path) {
+// Map a file. Returns false if the file doesn't exist and must_exist is false.
+static bool map_file(const char *path, bool must_exist, const void **data, size_t *size) {
 	int fd = open(path, O_RDONLY);
 	if (fd < 0) {
+		if (!must_exist) {
+			return false;
+		}
 		error("Could not open '%s'", path);
 	}
 	struct stat st;
@@ -37,161 +64,1663 @@ void open_macho(struct macho *macho, const char *path) {
 	if (err != 0) {
 		error("Could not stat '%s'", path);
 	}
-	macho->size = st.st_size;
-	macho->mh = mmap(NULL, macho->size, PROT_READ, MAP_SHARED, fd, 0);
-	if (macho->mh == MAP_FAILED) {
+	*size = st.st_size;
+	*data = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+	if (*data == MAP_FAILED) {
 		error("Could not mmap '%s'", path);
 	}
 	close(fd);
+	return true;
 }
 
-struct gadget {
-	const char *name;
-	void *data;
-	size_t size;
+// How an image file is brought into memory.
+enum load_mode {
+	// Map the file and advise the kernel of the access pattern.
+	LOAD_MAP,
+	// Also fault in the executable ranges before scanning them.
+	LOAD_POPULATE,
+	// Read the whole file into a buffer aligned for huge pages.
+	LOAD_READ,
+};
+
+// The number of words sampled to choose the anchor words, and the most bytes sampled from a
+// kernelcache that is still being decompressed.
+#define ANCHOR_SAMPLE_WORDS	(1 << 16)
+#define ANCHOR_SAMPLE_STREAMING	(1 << 20)
+
+// Which word of each aligned gadget is looked up during the scan.
+enum anchor_mode {
+	// The word that is rarest in a sample of the first image.
+	ANCHOR_RARE,
+	// The first word.
+	ANCHOR_FIRST,
+};
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static double cpu_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// The wall-clock and CPU time spent in a phase of the run, accumulated over each time the phase
+// is entered. The CPU time is for the whole process.
+struct phase {
+	double wall_ms;
+	double cpu_ms;
+};
+
+static void phase_begin(struct phase *phase) {
+	phase->wall_ms -= now_ms();
+	phase->cpu_ms -= cpu_ms();
+}
+
+static void phase_end(struct phase *phase) {
+	phase->wall_ms += now_ms();
+	phase->cpu_ms += cpu_ms();
+}
+
+// Read a file into an anonymous mapping. On Linux, the mapping is aligned to 2 MB and huge
+// pages are requested for it, so that scanning it takes few TLB misses and no page faults on
+// the file.
+static void read_file(const char *path, const void **data, size_t *size) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		error("Could not open '%s'", path);
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		error("Could not stat '%s'", path);
+	}
+	const size_t huge_page = 2 << 20;
+	*size = st.st_size;
+	size_t mapped_size = (*size + huge_page - 1) & ~(huge_page - 1);
+	uint8_t *map = mmap(NULL, mapped_size + huge_page, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		error("Could not allocate memory for '%s'", path);
+	}
+	// Trim the mapping to an aligned start.
+	uintptr_t aligned = ((uintptr_t)map + huge_page - 1) & ~(uintptr_t)(huge_page - 1);
+	uint8_t *buffer = (uint8_t *)aligned;
+	if (buffer > map) {
+		munmap(map, buffer - map);
+	}
+	munmap(buffer + mapped_size, map + huge_page - buffer);
+#ifdef MADV_HUGEPAGE
+	madvise(buffer, mapped_size, MADV_HUGEPAGE);
+#endif
+	for (size_t off = 0; off < *size;) {
+		ssize_t n = read(fd, buffer + off, *size - off);
+		if (n <= 0) {
+			error("Could not read '%s'", path);
+		}
+		off += n;
+	}
+	close(fd);
+	*data = buffer;
+}
+
+struct image {
+	const char *path;
+	struct macho macho;
+	// For compressed kernelcaches, the image being decompressed, and the path to save it to
+	// once it is complete.
+	struct kernelcache *kc;
+	char *cache_path;
+	const struct matcher *matcher;
+	uint64_t *addresses;
+	// With --timing, the time spent loading the image, the time spent faulting in its
+	// executable ranges and the page faults taken, and the time spent matching them.
+	struct phase load;
+	struct phase fault;
+	struct phase scan;
+	long minor_faults;
+	long major_faults;
+	// With --stats, the time spent finding the executable segments, the scan counters, and
+	// the segments with the number of bytes scanned in each.
+	struct phase segments;
+	struct matcher_stats stats;
+	struct scan_range *ranges;
+	const char **range_names;
+	uint64_t *range_scanned;
+	size_t nranges;
+	// With --symbolicate in all-matches mode, the matches, which are printed once the symbol
+	// tables are available.
+	struct gadget_hit *hits;
+	size_t nhits;
+	size_t hits_capacity;
+};
+
+struct gadget_hit {
+	size_t gadget;
 	uint64_t address;
 };
 
-static int hexdigit(int ch) {
-	if ('0' <= ch && ch <= '9') {
-		return ch - '0';
-	} else if ('A' <= ch && ch <= 'F') {
-		return ch - 'A' + 0xa;
-	} else if ('a' <= ch && ch <= 'f') {
-		return ch - 'a' + 0xa;
+// Wait until the first size bytes of the image are available.
+static void image_wait(struct image *image, size_t size) {
+	struct kernelcache *kc = image->kc;
+	if (kc != NULL && !kernelcache_wait(kc, size)) {
+		if (kc->failed) {
+			error("Could not decompress '%s': %s", image->path, kc->error);
+		}
+		error("Decompressed kernelcache '%s' is %zu bytes, but its load commands need %zu",
+				image->path, kc->size, size);
+	}
+}
+
+static void wait_range(void *context, const void *data, size_t size) {
+	struct image *image = context;
+	image_wait(image, (const uint8_t *)data + size - (const uint8_t *)image->macho.mh);
+}
+
+// Check that the image's load commands and the file ranges they describe are sound, so that the
+// scan and the symbol lookups can trust them.
+static void validate_image(struct image *image) {
+	if (macho_validate(image->macho.mh, image->macho.size) != MACHO_SUCCESS) {
+		error("'%s' is not a valid Mach-O file", image->path);
+	}
+}
+
+// Wait until the image's Mach-O header and load commands at the given offset are available. A
+// header that doesn't fit in the image is left for validation to reject.
+static void image_wait_header(struct image *image, size_t offset) {
+	if (offset > image->macho.size
+			|| image->macho.size - offset < sizeof(struct mach_header_64)) {
+		return;
+	}
+	image_wait(image, offset + sizeof(struct mach_header_64));
+	const struct mach_header *mh = (const struct mach_header *)
+		((const uint8_t *)image->macho.mh + offset);
+	image_wait(image, offset + sizeof(struct mach_header_64) + mh->sizeofcmds);
+}
+
+static uint64_t hash_file(const void *data, size_t size) {
+	const uint8_t *p = data;
+	uint64_t hash = 0xcbf29ce484222325 ^ size;
+	for (; size >= 8; p += 8, size -= 8) {
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3;
+		hash ^= hash >> 29;
+	}
+	for (; size > 0; p++, size--) {
+		hash = (hash ^ *p) * 0x100000001b3;
+	}
+	return hash;
+}
+
+// Open a Mach-O file. Compressed kernelcaches are decompressed on a background thread, or
+// loaded from the cache directory if they have been decompressed before.
+static void open_image(struct image *image, const char *cache_dir, enum load_mode load) {
+	const void *file;
+	size_t size;
+	phase_begin(&image->load);
+	if (load == LOAD_READ) {
+		read_file(image->path, &file, &size);
 	} else {
-		return -1;
-	}
-}
-
-/* Gadget string format:
- *
- * 	<GADGET_STRING> = <GADGET_NAME>:<GADGET_DATA>
- * 	<GADGET_DATA> = <GADGET_BYTES>{,<GADGET_BYTES>}*
- * 	<GADGET_BYTES> = <BIG_ENDIAN_HEX>|0x<LITTLE_ENDIAN_HEX>
- * 	<GADGET_NAME> = [identifier]
- * 	<BIG_ENDIAN_HEX> = [hexadecimal;big endian]
- * 	<LITTLE_ENDIAN_HEX> = [hexadecimal;little endian]
- */
-
-void decode_gadget(struct gadget *gadget, const char *string) {
-	char *colon = strchr(string, ':');
-	if (colon == NULL) {
-		error("Bad format gadget string '%s'", string);
-	}
-	gadget->name = strndup(string, colon - string);
-	string = colon + 1;
-	size_t len = strlen(string);
-	if (len == 0) {
-		error("Missing gadget data for gadget '%s'", gadget->name);
-	}
-	size_t alloc_size = len / 2; // A rough guess, guaranteed to be an overestimate.
-	uint8_t *data = malloc(alloc_size);
-	gadget->data = data;
-	const char *chr = string;
-	size_t size = 0;
+		map_file(image->path, true, &file, &size);
+	}
+	phase_end(&image->load);
+	image->macho.mh = (void *)file;
+	image->macho.size = size;
+	image->macho.fileoff = 0;
+	uint32_t magic = (size >= sizeof(magic) ? *(const uint32_t *)file : 0);
+	if (magic == MH_MAGIC || magic == MH_MAGIC_64
+			|| kernelcache_format(file, size) == KERNELCACHE_NONE) {
+		validate_image(image);
+		return;
+	}
+	if (cache_dir != NULL) {
+		size_t path_size = strlen(cache_dir) + 32;
+		image->cache_path = malloc(path_size);
+		if (image->cache_path == NULL) {
+			error("Could not allocate cache path");
+		}
+		snprintf(image->cache_path, path_size, "%s/%016llx.macho", cache_dir,
+				(unsigned long long)hash_file(file, size));
+		const void *cached;
+		size_t cached_size;
+		if (map_file(image->cache_path, false, &cached, &cached_size)) {
+			munmap((void *)file, size);
+			image->macho.mh = (void *)cached;
+			image->macho.size = cached_size;
+			free(image->cache_path);
+			image->cache_path = NULL;
+			validate_image(image);
+			return;
+		}
+	}
+	image->kc = malloc(sizeof(*image->kc));
+	if (image->kc == NULL) {
+		error("Could not allocate kernelcache");
+	}
+	if (!kernelcache_open(image->kc, file, size)) {
+		error("Could not decompress '%s': %s", image->path, image->kc->error);
+	}
+	image->macho.mh = image->kc->data;
+	image->macho.size = image->kc->capacity;
+	image_wait_header(image, 0);
+	magic = *(const uint32_t *)image->macho.mh;
+	if (magic != MH_MAGIC && magic != MH_MAGIC_64) {
+		error("Decompressed kernelcache '%s' is not a Mach-O file", image->path);
+	}
+	validate_image(image);
+}
+
+// Wait for a compressed image to be fully decompressed, and save it to the cache if one was
+// requested.
+static void finish_image(struct image *image) {
+	struct kernelcache *kc = image->kc;
+	if (kc == NULL) {
+		return;
+	}
+	if (!kernelcache_finish(kc)) {
+		error("Could not decompress '%s': %s", image->path, kc->error);
+	}
+	// The image was validated against the space reserved for it, which for LZFSE may be more
+	// than it decompressed to.
+	image->macho.size = kc->size;
+	validate_image(image);
+	if (image->cache_path == NULL) {
+		return;
+	}
+	size_t tmp_size = strlen(image->cache_path) + 32;
+	char *tmp = malloc(tmp_size);
+	if (tmp == NULL) {
+		error("Could not allocate cache path");
+	}
+	snprintf(tmp, tmp_size, "%s.%ld.tmp", image->cache_path, (long)getpid());
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool success = (fd >= 0);
+	for (size_t off = 0; success && off < kc->size;) {
+		ssize_t n = write(fd, kc->data + off, kc->size - off);
+		success = (n > 0);
+		off += (success ? n : 0);
+	}
+	success = (fd >= 0 && close(fd) == 0) && success;
+	if (!success || rename(tmp, image->cache_path) != 0) {
+		unlink(tmp);
+		error("Could not write decompressed kernelcache '%s'", image->cache_path);
+	}
+	free(tmp);
+}
+
+static void add_gadget(struct gadget_set *set, const char *string) {
+	if (!gadget_set_add(set, string)) {
+		error("%s", set->error);
+	}
+}
+
+// Read gadget strings from a file, one per line, or from stdin if path is "-". Blank lines and
+// lines starting with '#' are ignored.
+static void read_gadget_file(struct gadget_set *set, const char *path) {
+	FILE *file = stdin;
+	if (strcmp(path, "-") != 0) {
+		file = fopen(path, "r");
+		if (file == NULL) {
+			error("Could not open '%s'", path);
+		}
+	}
+	char *line = NULL;
+	size_t line_capacity = 0;
 	for (;;) {
-		bool little_endian = (strncmp(chr, "0x", 2) == 0);
-		if (little_endian) {
-			chr += 2;
+		ssize_t len = getline(&line, &line_capacity, file);
+		if (len < 0) {
+			break;
 		}
-		uint8_t *start = data;
-		for (;;) {
-			if (*chr == 0 || *chr == ',') {
-				break;
-			}
-			int b_hi = hexdigit(*chr++);
-			if (*chr == 0 || *chr == ',') {
-				error("Odd-length hex in gadget data '%s' for gadget '%s'", string, gadget->name);
-			}
-			int b_lo = hexdigit(*chr++);
-			if (b_hi < 0 || b_lo < 0) {
-				error("Invalid hex in gadget data '%s' for gadget '%s'", string, gadget->name);
-			}
-			*data++ = (b_hi << 4) | b_lo;
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'
+					|| line[len - 1] == ' ' || line[len - 1] == '\t')) {
+			line[--len] = 0;
 		}
-		size_t length = data - start;
-		if (length == 0) {
-			error("Zero-length component in gadget data '%s' for gadget '%s'", string, gadget->name);
+		const char *string = line;
+		while (*string == ' ' || *string == '\t') {
+			string++;
 		}
-		if (little_endian) {
-			for (size_t i = 0; i < length / 2; i++) {
-				uint8_t byte_i = start[i];
-				start[i] = start[length - i - 1];
-				start[length - i - 1] = byte_i;
-			}
+		if (*string == 0 || *string == '#') {
+			continue;
 		}
-		size += length;
-		if (*chr == ',') {
-			chr++;
-		} else {
-			break;
+		add_gadget(set, string);
+	}
+	if (ferror(file)) {
+		error("Could not read '%s'", path);
+	}
+	free(line);
+	if (file != stdin) {
+		fclose(file);
+	}
+}
+
+enum table_format {
+	TABLE_NONE,
+	TABLE_CSV,
+	TABLE_JSON,
+};
+
+enum output_format {
+	FORMAT_TEXT,
+	FORMAT_BIN,
+	FORMAT_JSON,
+	FORMAT_C_HEADER,
+};
+
+enum stats_format {
+	STATS_NONE,
+	STATS_TEXT,
+	STATS_JSON,
+};
+
+struct options {
+	enum load_mode load;
+	bool timing;
+	enum stats_format stats;
+	unsigned align;
+	bool simd;
+	enum anchor_mode anchor;
+	unsigned threads;
+	bool all;
+	size_t max_hits;
+	const char *index_dir;
+	const struct gadget_index *base;
+	enum table_format table;
+	enum output_format format;
+	const char **kexts;
+	size_t nkexts;
+	struct range_filter filter;
+	const char *cache_dir;
+	const char *serve;
+	bool symbolicate;
+};
+
+// Where matches go in all-matches mode. If image is not NULL, they are saved in the image to be
+// printed later.
+struct hit_context {
+	const struct gadget *gadgets;
+	struct output *out;
+	struct image *image;
+};
+
+static void print_hit(void *context, size_t gadget, uint64_t address) {
+	struct hit_context *hc = context;
+	struct image *image = hc->image;
+	if (image == NULL) {
+		output_printf(hc->out, "%-32s = 0x%llx\n", hc->gadgets[gadget].name,
+				(unsigned long long)address);
+		return;
+	}
+	if (image->nhits == image->hits_capacity) {
+		image->hits_capacity = (image->hits_capacity == 0 ? 256 : 2 * image->hits_capacity);
+		image->hits = realloc(image->hits, image->hits_capacity * sizeof(*image->hits));
+		if (image->hits == NULL) {
+			error("Could not allocate matches");
 		}
 	}
-	gadget->size = size;
+	image->hits[image->nhits].gadget = gadget;
+	image->hits[image->nhits++].address = address;
 }
 
-void find_gadgets_in_data(const void *data, uint64_t address, size_t size,
-		struct gadget *gadgets, size_t count) {
-	const uint8_t *ins = data;
-	const uint8_t *end = ins + size;
-	for (; ins < end; ins++) {
+// A symbol table of an image or of one of its fileset entries.
+struct symbol_table {
+	struct macho macho;
+	const struct symtab_command *symtab;
+};
+
+static void add_symbol_table(struct symbol_table **tables, size_t *count,
+		const struct macho *macho, const char *path) {
+	const struct symtab_command *symtab = (const struct symtab_command *)
+		macho_find_load_command(macho, NULL, LC_SYMTAB);
+	if (symtab == NULL) {
+		return;
+	}
+	*tables = realloc(*tables, (*count + 1) * sizeof(**tables));
+	if (*tables == NULL) {
+		error("Could not allocate symbol tables");
+	}
+	struct symbol_table *table = &(*tables)[(*count)++];
+	table->macho = *macho;
+	table->macho.symbol_index = NULL;
+	table->macho.name_index = NULL;
+	table->macho.layout = NULL;
+	table->symtab = symtab;
+	if (macho_index_layout(&table->macho) != MACHO_SUCCESS) {
+		error("Could not index the segments of '%s'", path);
+	}
+}
+
+// Find the symbol containing each address, taking the nearest preceding symbol in the symbol
+// tables of the image and each of its fileset entries. Each table is resolved in one pass
+// over the sorted addresses, so this costs about one pass over each symbol table.
+static void symbolicate(struct image *image, const uint64_t *addresses, size_t count,
+		struct macho_address_symbol *symbols) {
+	struct symbol_table *tables = NULL;
+	size_t ntables = 0;
+	add_symbol_table(&tables, &ntables, &image->macho, image->path);
+	const struct load_command *lc = NULL;
+	while (macho_is_fileset(&image->macho)) {
+		lc = macho_find_load_command(&image->macho, lc, LC_FILESET_ENTRY);
+		if (lc == NULL) {
+			break;
+		}
+		struct macho entry;
+		if (macho_fileset_entry(&image->macho, lc, &entry, NULL) != MACHO_SUCCESS) {
+			error("Malformed fileset entry in '%s'", image->path);
+		}
+		add_symbol_table(&tables, &ntables, &entry, image->path);
+	}
+	struct macho_address_symbol *found = malloc(count * sizeof(*found) + 1);
+	if (found == NULL) {
+		error("Could not allocate symbols");
+	}
+	memset(symbols, 0, count * sizeof(*symbols));
+	for (size_t t = 0; t < ntables; t++) {
+		struct symbol_table *table = &tables[t];
+		if (macho_resolve_addresses(&table->macho, table->symtab, addresses, count, found)
+				!= MACHO_SUCCESS) {
+			error("Could not resolve symbols in '%s'", image->path);
+		}
 		for (size_t i = 0; i < count; i++) {
-			struct gadget *g = &gadgets[i];
-			// Skip this gadget if we've already found it or if there's not enough
-			// space left for the gadget.
-			if (g->address != 0 || (end - ins) < g->size) {
-				continue;
-			}
-			// Skip this gadget if it's not a match.
-			if (memcmp(g->data, ins, g->size) != 0) {
-				continue;
+			if (found[i].name != NULL && (symbols[i].name == NULL
+						|| found[i].offset < symbols[i].offset)) {
+				symbols[i] = found[i];
 			}
-			// Found a gadget! Set the address.
-			g->address = address + (ins - (uint8_t *)data);
 		}
+		macho_free_indexes(&table->macho);
+	}
+	free(found);
+	free(tables);
+}
+
+// Print a match followed by the symbol containing it, flagging matches that are past the end of
+// the symbol.
+static void print_symbolicated(struct output *out, const char *name, uint64_t address,
+		const struct macho_address_symbol *symbol) {
+	output_printf(out, "%-32s = 0x%llx", name, (unsigned long long)address);
+	if (symbol->name != NULL) {
+		output_printf(out, " (%s+0x%zx%s)", symbol->name, symbol->offset,
+				(symbol->offset >= symbol->size ? ", past end" : ""));
 	}
+	output_printf(out, "\n");
 }
 
-void find_gadgets(const struct macho *macho, struct gadget *gadgets, size_t count) {
+// Add the executable segments of the selected fileset entries to the list, or of all entries
+// if none are selected. A compressed kernelcache's entries are waited for first.
+static void add_fileset_ranges(struct range_list *list, struct image *image,
+		const char **kexts, size_t nkexts) {
+	const struct macho *fileset = &image->macho;
 	const struct load_command *lc = NULL;
 	for (;;) {
-		lc = macho_next_segment(macho, lc);
+		lc = macho_find_load_command(fileset, lc, LC_FILESET_ENTRY);
 		if (lc == NULL) {
 			break;
 		}
-		const int prot = VM_PROT_READ | VM_PROT_EXECUTE;
-		const struct segment_command_64 *sc = (const struct segment_command_64 *)lc;
-		if ((sc->initprot & prot) != prot || (sc->maxprot & prot) != prot) {
-			continue;
+		image_wait_header(image, ((const struct fileset_entry_command *)lc)->fileoff);
+	}
+	if (!range_list_add_fileset(list, fileset, kexts, nkexts)) {
+		error("%s", list->error);
+	}
+}
+
+// Answer the search from the image's index in the index directory, building the index first if
+// there isn't one yet. The images are searched concurrently, so several indexes may be built at
+// once; two images with the same UUID both build it, and either copy is complete. The index
+// covers every executable segment of the image, but only the matches in the given ranges are
+// reported.
+static void find_gadgets_indexed(struct image *image, const struct matcher *matcher,
+		struct matcher_state *state, const struct scan_range *ranges, size_t nranges,
+		const char *index_dir) {
+	const struct macho *macho = &image->macho;
+	if (matcher->align != 4) {
+		error("The gadget index requires --align=4");
+	}
+	const struct uuid_command *uc = (const struct uuid_command *)
+		macho_find_load_command(macho, NULL, LC_UUID);
+	if (uc == NULL) {
+		error("Mach-O file has no LC_UUID to key the gadget index");
+	}
+	const uint8_t *u = uc->uuid;
+	char path[4096];
+	if (!gadget_index_path(path, sizeof(path), index_dir, u)) {
+		error("Index directory path is too long");
+	}
+	struct gadget_index index;
+	if (!gadget_index_open(&index, path, u)) {
+		struct range_list all;
+		range_list_init(&all);
+		if (macho_is_fileset(macho)) {
+			add_fileset_ranges(&all, image, NULL, 0);
+		} else if (!range_list_add_macho(&all, macho)) {
+			error("%s", all.error);
+		}
+		for (size_t i = 0; i < all.count; i++) {
+			wait_range(image, all.ranges[i].data, all.ranges[i].size);
+		}
+		if (!gadget_index_build(all.ranges, all.count, u, path)) {
+			error("Could not build gadget index '%s'", path);
+		}
+		range_list_free(&all);
+		if (!gadget_index_open(&index, path, u)) {
+			error("Could not open gadget index '%s'", path);
+		}
+	}
+	// A NULL range array would search the whole index.
+	if (nranges > 0 && !gadget_index_scan(&index, matcher, state, ranges, nranges)) {
+		error("Could not allocate index matches");
+	}
+	gadget_index_close(&index);
+}
+
+// Scan only the blocks of the image that differ from the base, the index of an earlier build,
+// and take the other matches from the base.
+static void find_gadgets_rescan(struct image *image, const struct matcher *matcher,
+		struct matcher_state *state, const struct scan_range *ranges, size_t nranges,
+		const struct gadget_index *base, unsigned threads) {
+	if (matcher->align != 4) {
+		error("--base requires --align=4");
+	}
+	// Every block is compared with the base before anything is scanned.
+	for (size_t i = 0; i < nranges; i++) {
+		wait_range(image, ranges[i].data, ranges[i].size);
+	}
+	struct rescan rescan;
+	if (!rescan_init(&rescan, base, matcher, ranges, nranges)) {
+		error("Could not allocate rescan plan");
+	}
+	uint64_t *scanned = NULL;
+	if (image->range_scanned != NULL) {
+		scanned = calloc(rescan.nranges + 1, sizeof(*scanned));
+		if (scanned == NULL) {
+			error("Could not allocate scan stats");
 		}
+	}
+	if (!scan_ranges(matcher, state, rescan.ranges, rescan.nranges, threads, NULL, NULL,
+				scanned)) {
+		error("Could not allocate scan state");
+	}
+	if (!rescan_reuse(&rescan, matcher, state)) {
+		error("Could not allocate base matches");
+	}
+	for (size_t i = 0; scanned != NULL && i < rescan.nranges; i++) {
+		size_t range = rescan.segments[rescan.range_segment[i]].range;
+		image->range_scanned[range] += scanned[i];
+	}
+	free(scanned);
+	rescan_free(&rescan);
+}
+
+// Fault in the pages from start, which is page-aligned, up to start + size.
+static void populate_pages(uintptr_t start, size_t size, uintptr_t page_mask) {
+#ifdef MADV_POPULATE_READ
+	if (madvise((void *)start, size, MADV_POPULATE_READ) == 0) {
+		return;
+	}
+#endif
+	// Touch each page instead.
+	for (size_t off = 0; off < size; off += page_mask + 1) {
+		(void)*(volatile const uint8_t *)(start + off);
+	}
+}
+
+// Give the kernel advice about how a file-backed image will be accessed: the executable ranges
+// are read once front to back, while __LINKEDIT is only looked at here and there. With
+// LOAD_POPULATE, the executable ranges are also faulted in now, so that the scan doesn't stop
+// for page faults.
+static void advise_image(struct image *image, const struct scan_range *ranges, size_t nranges,
+		enum load_mode load) {
+	if (image->kc != NULL || load == LOAD_READ) {
+		return;
+	}
+	const uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+	for (size_t i = 0; i < nranges; i++) {
+		uintptr_t start = (uintptr_t)ranges[i].data & ~page_mask;
+		size_t size = (uintptr_t)ranges[i].data + ranges[i].size - start;
+		madvise((void *)start, size, MADV_SEQUENTIAL);
+		madvise((void *)start, size, MADV_WILLNEED);
+		if (load == LOAD_POPULATE) {
+			populate_pages(start, size, page_mask);
+		}
+	}
+	const struct load_command *linkedit = macho_find_segment(&image->macho, "__LINKEDIT");
+	if (linkedit != NULL) {
 		const void *data;
 		uint64_t address;
 		size_t size;
-		macho_segment_data(macho, lc, &data, &address, &size);
-		find_gadgets_in_data(data, address, size, gadgets, count);
+		macho_segment_data(&image->macho, linkedit, &data, &address, &size);
+		if (size > 0) {
+			uintptr_t start = (uintptr_t)data & ~page_mask;
+			madvise((void *)start, (uintptr_t)data + size - start, MADV_RANDOM);
+		}
 	}
 }
 
-int main(int argc, const char *argv[]) {
-	if (argc < 2 || argc > 256) {
-		error("Bad argument count. Run: %s /path/to/mach-o $(cat /path/to/gadgets-file)", argv[0]);
+// Fault counts for just this thread where the system keeps them.
+#ifdef RUSAGE_THREAD
+#define RUSAGE_FAULTS RUSAGE_THREAD
+#else
+#define RUSAGE_FAULTS RUSAGE_SELF
+#endif
+
+// For --timing, fault in the executable ranges of the image before they are scanned, counting
+// the time and page faults taken, so that the scan itself only measures matching. A
+// kernelcache is first waited for until the ranges are decompressed.
+static void fault_in_image(struct image *image, const struct scan_range *ranges,
+		size_t nranges) {
+	const uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+	struct rusage usage;
+	phase_begin(&image->fault);
+	getrusage(RUSAGE_FAULTS, &usage);
+	image->minor_faults = -usage.ru_minflt;
+	image->major_faults = -usage.ru_majflt;
+	for (size_t i = 0; i < nranges; i++) {
+		if (image->kc != NULL) {
+			wait_range(image, ranges[i].data, ranges[i].size);
+		}
+		uintptr_t start = (uintptr_t)ranges[i].data & ~page_mask;
+		populate_pages(start, (uintptr_t)ranges[i].data + ranges[i].size - start,
+				page_mask);
 	}
-	struct macho macho;
-	open_macho(&macho, argv[1]);
-	size_t count = argc - 2;
-	struct gadget gadgets[count];
+	getrusage(RUSAGE_FAULTS, &usage);
+	image->minor_faults += usage.ru_minflt;
+	image->major_faults += usage.ru_majflt;
+	phase_end(&image->fault);
+}
+
+// Find the ranges of the image to scan.
+static void find_ranges(struct range_list *ranges, struct image *image,
+		const struct options *options) {
+	range_list_init(ranges);
+	ranges->filter = &options->filter;
+	if (macho_is_fileset(&image->macho)) {
+		add_fileset_ranges(ranges, image, options->kexts, options->nkexts);
+	} else if (options->nkexts > 0) {
+		error("--kext requires an MH_FILESET Mach-O");
+	} else if (!range_list_add_macho(ranges, &image->macho)) {
+		error("%s", ranges->error);
+	}
+}
+
+// Compile the gadgets for alignment 4, dispatching each one on its rarest word in a sample of
+// the image's ranges. A kernelcache that is still being decompressed is only sampled at the
+// start of its lowest range, so that the scan doesn't wait for the rest.
+static void compile_sampled(struct gadget_set *set, struct image *image,
+		const struct options *options) {
+	struct range_list ranges;
+	find_ranges(&ranges, image, options);
+	struct scan_range *sampled = ranges.ranges;
+	size_t count = ranges.count;
+	if (image->kc != NULL && count > 0) {
+		for (size_t i = 1; i < ranges.count; i++) {
+			if (ranges.ranges[i].data < sampled->data) {
+				sampled = &ranges.ranges[i];
+			}
+		}
+		count = 1;
+		if (sampled->size > ANCHOR_SAMPLE_STREAMING) {
+			sampled->size = ANCHOR_SAMPLE_STREAMING;
+		}
+		wait_range(image, sampled->data, sampled->size);
+	}
+	uint32_t *sample = malloc(ANCHOR_SAMPLE_WORDS * sizeof(*sample));
+	if (sample == NULL) {
+		error("Could not allocate sample");
+	}
+	size_t nsample = scan_sample(sampled, count, sample, ANCHOR_SAMPLE_WORDS);
+	if (!gadget_set_compile_sampled(set, 4, sample, nsample)) {
+		error("%s", set->error);
+	}
+	free(sample);
+	range_list_free(&ranges);
+}
+
+// Find the gadgets in the image's executable segments, storing the lowest address of each gadget
+// in addresses. In all-matches mode, every match is printed to out as it is found.
+void find_gadgets(struct image *image, const struct options *options, unsigned threads,
+		struct output *out) {
+	const struct matcher *matcher = image->matcher;
+	struct range_list ranges;
+	phase_begin(&image->segments);
+	find_ranges(&ranges, image, options);
+	phase_end(&image->segments);
+	struct matcher_state state;
+	if (!matcher_state_init(&state, matcher)) {
+		error("Could not allocate scan state");
+	}
+	struct hit_context hit_context = { matcher->gadgets, out,
+		(options->symbolicate || options->format != FORMAT_TEXT ? image : NULL) };
+	if (options->all) {
+		matcher_state_report_all(&state, print_hit, &hit_context, options->max_hits);
+	}
+	if (options->stats != STATS_NONE) {
+		image->range_scanned = calloc(ranges.count + 1, sizeof(*image->range_scanned));
+		if (image->range_scanned == NULL) {
+			error("Could not allocate scan stats");
+		}
+		matcher_state_collect_stats(&state, &image->stats);
+	}
+	phase_begin(&image->load);
+	advise_image(image, ranges.ranges, ranges.count, options->load);
+	phase_end(&image->load);
+	if (options->timing) {
+		fault_in_image(image, ranges.ranges, ranges.count);
+	}
+	phase_begin(&image->scan);
+	if (options->index_dir != NULL) {
+		find_gadgets_indexed(image, matcher, &state, ranges.ranges, ranges.count,
+				options->index_dir);
+	} else if (options->base != NULL) {
+		find_gadgets_rescan(image, matcher, &state, ranges.ranges, ranges.count,
+				options->base, threads);
+	} else if (!scan_ranges(matcher, &state, ranges.ranges, ranges.count, threads,
+				(image->kc != NULL ? wait_range : NULL), image,
+				image->range_scanned)) {
+		error("Could not allocate scan state");
+	}
+	phase_end(&image->scan);
+	memcpy(image->addresses, state.addresses, matcher->count * sizeof(*image->addresses));
+	matcher_state_deinit(&state);
+	// Keep the ranges for the stats report.
+	if (options->stats != STATS_NONE) {
+		image->ranges = ranges.ranges;
+		image->range_names = ranges.names;
+		image->nranges = ranges.count;
+	} else {
+		range_list_free(&ranges);
+	}
+}
+
+// Print the matches saved in all-matches mode, each with the symbol containing it.
+static void print_symbolicated_hits(struct output *out, struct image *image,
+		const struct gadget *gadgets) {
+	uint64_t *addresses = malloc(image->nhits * sizeof(*addresses) + 1);
+	struct macho_address_symbol *symbols = malloc(image->nhits * sizeof(*symbols) + 1);
+	if (addresses == NULL || symbols == NULL) {
+		error("Could not allocate matches");
+	}
+	for (size_t i = 0; i < image->nhits; i++) {
+		addresses[i] = image->hits[i].address;
+	}
+	symbolicate(image, addresses, image->nhits, symbols);
+	for (size_t i = 0; i < image->nhits; i++) {
+		print_symbolicated(out, gadgets[image->hits[i].gadget].name, addresses[i],
+				&symbols[i]);
+	}
+	free(symbols);
+	free(addresses);
+}
+
+// Images are handed out to the threads one at a time, so that faulting in one image overlaps
+// with scanning the others.
+struct image_pool {
+	struct image *images;
+	size_t count;
+	atomic_size_t next;
+	const struct options *options;
+	unsigned threads;
+};
+
+static void *image_worker_main(void *arg) {
+	struct image_pool *pool = arg;
+	for (;;) {
+		size_t i = atomic_fetch_add(&pool->next, 1);
+		if (i >= pool->count) {
+			break;
+		}
+		struct image *image = &pool->images[i];
+		find_gadgets(image, pool->options, pool->threads, NULL);
+	}
+	return NULL;
+}
+
+// Scan the images concurrently, splitting the threads between them.
+static void find_gadgets_in_images(struct image *images, size_t count,
+		const struct options *options) {
+	unsigned nworkers = (count < options->threads ? count : options->threads);
+	struct image_pool pool = { images, count, 0, options, options->threads / nworkers };
+	pthread_t threads[nworkers];
+	bool started[nworkers];
+	for (unsigned i = 1; i < nworkers; i++) {
+		started[i] = (pthread_create(&threads[i], NULL, image_worker_main, &pool) == 0);
+	}
+	image_worker_main(&pool);
+	for (unsigned i = 1; i < nworkers; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+}
+
+static void print_csv_field(struct output *out, const char *field) {
+	if (strpbrk(field, ",\"\r\n") == NULL) {
+		output_printf(out, "%s", field);
+		return;
+	}
+	output_printf(out, "\"");
+	for (const char *p = field; *p != 0; p++) {
+		output_printf(out, (*p == '"' ? "\"\"" : "%c"), *p);
+	}
+	output_printf(out, "\"");
+}
+
+static void print_json_string(struct output *out, const char *string) {
+	output_printf(out, "\"");
+	for (const unsigned char *p = (const unsigned char *)string; *p != 0; p++) {
+		if (*p == '"' || *p == '\\') {
+			output_printf(out, "\\%c", *p);
+		} else if (*p < 0x20) {
+			output_printf(out, "\\u%04x", *p);
+		} else {
+			output_printf(out, "%c", *p);
+		}
+	}
+	output_printf(out, "\"");
+}
+
+// Print a table of the address of each gadget in each image, with 0 (or null in JSON) for
+// gadgets that weren't found.
+static void print_table(struct output *out, enum table_format format,
+		const struct gadget *gadgets, size_t count, const struct image *images,
+		size_t nimages) {
+	if (format == TABLE_CSV) {
+		output_printf(out, "gadget");
+		for (size_t j = 0; j < nimages; j++) {
+			output_printf(out, ",");
+			print_csv_field(out, images[j].path);
+		}
+		output_printf(out, "\n");
+		for (size_t i = 0; i < count; i++) {
+			print_csv_field(out, gadgets[i].name);
+			for (size_t j = 0; j < nimages; j++) {
+				uint64_t address = images[j].addresses[i];
+				if (address == 0) {
+					output_printf(out, ",0");
+				} else {
+					output_printf(out, ",0x%llx", (unsigned long long)address);
+				}
+			}
+			output_printf(out, "\n");
+		}
+		return;
+	}
+	// Addresses are strings since they don't fit in a JSON number.
+	output_printf(out, "{\n  \"images\": [");
+	for (size_t j = 0; j < nimages; j++) {
+		output_printf(out, (j == 0 ? "\n    " : ",\n    "));
+		print_json_string(out, images[j].path);
+	}
+	output_printf(out, "\n  ],\n  \"gadgets\": [");
 	for (size_t i = 0; i < count; i++) {
-		gadgets[i].address = 0;
-		decode_gadget(&gadgets[i], argv[2 + i]);
+		output_printf(out, (i == 0 ? "\n    { \"name\": " : ",\n    { \"name\": "));
+		print_json_string(out, gadgets[i].name);
+		output_printf(out, ", \"addresses\": [");
+		for (size_t j = 0; j < nimages; j++) {
+			uint64_t address = images[j].addresses[i];
+			output_printf(out, (j == 0 ? "" : ", "));
+			if (address == 0) {
+				output_printf(out, "null");
+			} else {
+				output_printf(out, "\"0x%llx\"", (unsigned long long)address);
+			}
+		}
+		output_printf(out, "] }");
+	}
+	output_printf(out, "\n  ]\n}\n");
+}
+
+// Print a C identifier made from the gadget's name.
+static void print_c_name(struct output *out, const char *name) {
+	if (*name >= '0' && *name <= '9') {
+		output_printf(out, "_");
+	}
+	for (const char *p = name; *p != 0; p++) {
+		bool valid = ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')
+				|| (*p >= '0' && *p <= '9') || *p == '_');
+		output_printf(out, "%c", (valid ? *p : '_'));
+	}
+}
+
+static int compare_hits(const void *a, const void *b) {
+	const struct gadget_hit *ha = a, *hb = b;
+	if (ha->address != hb->address) {
+		return (ha->address > hb->address) - (ha->address < hb->address);
+	}
+	return (ha->gadget > hb->gadget) - (ha->gadget < hb->gadget);
+}
+
+// Print the results of a single image in a format meant for other programs. In all-matches
+// mode, the matches have been saved in the image.
+static void print_results(struct output *out, enum output_format format, struct image *image,
+		const struct gadget *gadgets, size_t count, bool all) {
+	// The index reports matches one gadget at a time, so put them in address order.
+	size_t nhits = (all ? image->nhits : 0);
+	if (nhits > 1) {
+		qsort(image->hits, nhits, sizeof(*image->hits), compare_hits);
+	}
+	// Group the matches by gadget, keeping each gadget's matches in address order.
+	size_t *first = calloc(count + 1, sizeof(*first));
+	uint64_t *addresses = malloc(nhits * sizeof(*addresses) + 1);
+	if (first == NULL || addresses == NULL) {
+		error("Could not allocate results");
+	}
+	for (size_t i = 0; i < nhits; i++) {
+		first[image->hits[i].gadget + 1]++;
 	}
-	find_gadgets(&macho, gadgets, count);
 	for (size_t i = 0; i < count; i++) {
-		if (gadgets[i].address == 0) {
-			printf("%-32s = 0\n", gadgets[i].name);
+		if (!all) {
+			first[i + 1] = (image->addresses[i] != 0);
+		}
+		first[i + 1] += first[i];
+	}
+	size_t *next = malloc(count * sizeof(*next) + 1);
+	if (next == NULL) {
+		error("Could not allocate results");
+	}
+	memcpy(next, first, count * sizeof(*next));
+	for (size_t i = 0; i < nhits; i++) {
+		addresses[next[image->hits[i].gadget]++] = image->hits[i].address;
+	}
+	free(next);
+	if (format == FORMAT_BIN) {
+		// One record per match, in address order, then one for each gadget not found.
+		size_t nrecords = (all ? nhits : 0);
+		for (size_t i = 0; i < count; i++) {
+			nrecords += (all ? first[i] == first[i + 1] : 1);
+		}
+		struct result_file_record *records = malloc(nrecords * sizeof(*records) + 1);
+		if (records == NULL) {
+			error("Could not allocate results");
+		}
+		size_t n = 0;
+		for (size_t i = 0; i < nhits; i++) {
+			size_t gadget = image->hits[i].gadget;
+			records[n++] = (struct result_file_record) { 0, gadget,
+				image->hits[i].address, first[gadget + 1] - first[gadget] };
+		}
+		for (size_t i = 0; i < count; i++) {
+			size_t matches = first[i + 1] - first[i];
+			if (!all || matches == 0) {
+				records[n++] = (struct result_file_record) { 0, i,
+					image->addresses[i], matches };
+			}
+		}
+		if (!result_file_write(out, image->path, gadgets, count, records, nrecords)) {
+			error("Could not write results");
+		}
+		free(records);
+	} else if (format == FORMAT_JSON) {
+		// Addresses are strings since they don't fit in a JSON number.
+		output_printf(out, "{\n  \"image\": ");
+		print_json_string(out, image->path);
+		output_printf(out, ",\n  \"gadgets\": [");
+		for (size_t i = 0; i < count; i++) {
+			output_printf(out, (i == 0 ? "\n    { \"name\": " : ",\n    { \"name\": "));
+			print_json_string(out, gadgets[i].name);
+			uint64_t address = image->addresses[i];
+			if (address == 0) {
+				output_printf(out, ", \"address\": null");
+			} else {
+				output_printf(out, ", \"address\": \"0x%llx\"",
+						(unsigned long long)address);
+			}
+			output_printf(out, ", \"matches\": %zu", first[i + 1] - first[i]);
+			if (all) {
+				output_printf(out, ", \"addresses\": [");
+				for (size_t j = first[i]; j < first[i + 1]; j++) {
+					output_printf(out, "%s\"0x%llx\"",
+							(j == first[i] ? "" : ", "),
+							(unsigned long long)addresses[j]);
+				}
+				output_printf(out, "]");
+			}
+			output_printf(out, " }");
+		}
+		output_printf(out, "\n  ]\n}\n");
+	} else {
+		output_printf(out, "// Gadget addresses in ");
+		for (const char *p = image->path; *p != 0; p++) {
+			output_printf(out, "%c", (*p == '\n' ? ' ' : *p));
+		}
+		output_printf(out, ", generated by macho_gadgets.\n\n");
+		for (size_t i = 0; i < count; i++) {
+			output_printf(out, "#define ");
+			print_c_name(out, gadgets[i].name);
+			if (image->addresses[i] == 0) {
+				output_printf(out, " 0\n");
+			} else {
+				output_printf(out, " 0x%llxULL\n",
+						(unsigned long long)image->addresses[i]);
+			}
+		}
+	}
+	free(addresses);
+	free(first);
+}
+
+// The phases of the run that aren't specific to an image.
+enum run_phase {
+	PHASE_DECODE,
+	PHASE_COMPILE,
+	PHASE_OUTPUT,
+	PHASE_COUNT,
+};
+
+static const char *run_phase_names[PHASE_COUNT] = { "decode", "compile", "output" };
+
+static void print_phases(struct output *out, enum stats_format format, const char *indent,
+		const char **names, const struct phase *const *phases, size_t count) {
+	for (size_t k = 0; k < count; k++) {
+		if (format == STATS_TEXT) {
+			output_printf(out, "%s%-10s %10.3f ms wall, %10.3f ms cpu\n", indent,
+					names[k], phases[k]->wall_ms, phases[k]->cpu_ms);
+		} else {
+			output_printf(out, "%s\"%s\": { \"wall_ms\": %.3f, \"cpu_ms\": %.3f }",
+					(k == 0 ? "" : ", "), names[k], phases[k]->wall_ms,
+					phases[k]->cpu_ms);
+		}
+	}
+}
+
+// Print the time spent in each phase of the run, and the segments scanned and the scan counters
+// of each image.
+static void print_stats(struct output *out, enum stats_format format,
+		const struct phase *run_phases, const struct image *images, size_t nimages) {
+	static const char *image_phase_names[] = { "load", "segments", "scan" };
+	static const char *counter_names[] = { "bytes", "prefiltered", "prefilter_hits",
+		"positions", "compares", "matches" };
+	const struct phase *phases[PHASE_COUNT];
+	for (size_t k = 0; k < PHASE_COUNT; k++) {
+		phases[k] = &run_phases[k];
+	}
+	if (format == STATS_TEXT) {
+		print_phases(out, format, "", run_phase_names, phases, PHASE_COUNT);
+	} else {
+		output_printf(out, "{\n  \"phases\": { ");
+		print_phases(out, format, "", run_phase_names, phases, PHASE_COUNT);
+		output_printf(out, " },\n  \"images\": [");
+	}
+	for (size_t j = 0; j < nimages; j++) {
+		const struct image *image = &images[j];
+		const struct phase *image_phases[] = {
+			&image->load, &image->segments, &image->scan,
+		};
+		const struct matcher_stats *st = &image->stats;
+		uint64_t counters[] = {
+			st->bytes, st->prefiltered, st->prefilter_hits, st->positions,
+			st->compares, st->matches,
+		};
+		if (format == STATS_TEXT) {
+			output_printf(out, "%s:\n", image->path);
+			print_phases(out, format, "  ", image_phase_names, image_phases, 3);
+			for (size_t i = 0; i < image->nranges; i++) {
+				output_printf(out, "  segment %-16.16s 0x%016llx %12zu bytes, "
+						"%12llu scanned\n", image->range_names[i],
+						(unsigned long long)image->ranges[i].address,
+						image->ranges[i].size,
+						(unsigned long long)image->range_scanned[i]);
+			}
+			for (size_t k = 0; k < 6; k++) {
+				output_printf(out, "  %-14s %16llu\n", counter_names[k],
+						(unsigned long long)counters[k]);
+			}
+			if (st->prefiltered != 0) {
+				output_printf(out, "  %-14s %16.4f\n", "prefilter_rate",
+						(double)st->prefilter_hits / st->prefiltered);
+			}
+			continue;
+		}
+		output_printf(out, (j == 0 ? "\n    { \"path\": " : ",\n    { \"path\": "));
+		print_json_string(out, image->path);
+		output_printf(out, ",\n      \"phases\": { ");
+		print_phases(out, format, "", image_phase_names, image_phases, 3);
+		output_printf(out, " },\n      \"segments\": [");
+		for (size_t i = 0; i < image->nranges; i++) {
+			char name[17] = {};
+			strncpy(name, image->range_names[i], 16);
+			output_printf(out, (i == 0 ? "\n        { \"name\": "
+						: ",\n        { \"name\": "));
+			print_json_string(out, name);
+			output_printf(out, ", \"address\": \"0x%llx\", \"bytes\": %zu, "
+					"\"scanned\": %llu }",
+					(unsigned long long)image->ranges[i].address,
+					image->ranges[i].size,
+					(unsigned long long)image->range_scanned[i]);
+		}
+		output_printf(out, "\n      ],\n      \"counters\": { ");
+		for (size_t k = 0; k < 6; k++) {
+			output_printf(out, "%s\"%s\": %llu", (k == 0 ? "" : ", "), counter_names[k],
+					(unsigned long long)counters[k]);
+		}
+		if (st->prefiltered != 0) {
+			output_printf(out, ", \"prefilter_rate\": %.4f",
+					(double)st->prefilter_hits / st->prefiltered);
+		}
+		output_printf(out, " } }");
+	}
+	if (format == STATS_JSON) {
+		output_printf(out, "\n  ]\n}\n");
+	}
+}
+
+static size_t parse_count(const char *str, const char *what, size_t max) {
+	char *end;
+	unsigned long long value = strtoull(str, &end, 10);
+	if (*str == 0 || *end != 0 || value > max) {
+		error("Invalid %s '%s'", what, str);
+	}
+	return value;
+}
+
+// Check a --section or --exclude-section name, SEGMENT or SEGMENT,SECTION.
+static const char *parse_section_name(const char *str) {
+	const char *comma = strchr(str, ',');
+	size_t seglen = (comma == NULL ? strlen(str) : (size_t)(comma - str));
+	size_t sectlen = (comma == NULL ? 1 : strlen(comma + 1));
+	if (seglen == 0 || seglen > 16 || sectlen == 0 || sectlen > 16
+			|| (comma != NULL && strchr(comma + 1, ',') != NULL)) {
+		error("Invalid section name '%s': must be SEGMENT or SEGMENT,SECTION", str);
+	}
+	return str;
+}
+
+// Parse a --address range, START-END.
+static struct address_range parse_address_range(const char *str) {
+	struct address_range range;
+	char *end;
+	range.start = strtoull(str, &end, 0);
+	if (end == str || *end != '-') {
+		error("Invalid address range '%s': must be START-END", str);
+	}
+	const char *stop = end + 1;
+	range.end = strtoull(stop, &end, 0);
+	if (end == stop || *end != 0 || range.end <= range.start) {
+		error("Invalid address range '%s': must be START-END", str);
+	}
+	return range;
+}
+
+static int compare_address_ranges(const void *a, const void *b) {
+	const struct address_range *ra = a;
+	const struct address_range *rb = b;
+	return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+// Sort the address ranges and merge the ones that overlap, as range_list requires.
+static size_t merge_address_ranges(struct address_range *ranges, size_t count) {
+	if (count == 0) {
+		return 0;
+	}
+	qsort(ranges, count, sizeof(*ranges), compare_address_ranges);
+	size_t merged = 1;
+	for (size_t i = 1; i < count; i++) {
+		struct address_range *last = &ranges[merged - 1];
+		if (ranges[i].start <= last->end) {
+			if (ranges[i].end > last->end) {
+				last->end = ranges[i].end;
+			}
 		} else {
-			printf("%-32s = 0x%llx\n", gadgets[i].name, gadgets[i].address);
+			ranges[merged++] = ranges[i];
+		}
+	}
+	return merged;
+}
+
+// Append an argument to a list of arguments.
+static void append_arg(const char ***list, size_t *count, const char *arg) {
+	*list = realloc(*list, (*count + 1) * sizeof(**list));
+	if (*list == NULL) {
+		error("Could not allocate argument list");
+	}
+	(*list)[(*count)++] = arg;
+}
+
+static void _Noreturn usage(const char *argv0) {
+	error("Usage: %s [options] /path/to/mach-o... [gadget-description...]\n"
+	      "\n"
+	      "  -f FILE               Read gadget descriptions from FILE, one per line, or from\n"
+	      "                        stdin if FILE is -. May be given more than once.\n"
+	      "  --align=N             Only report gadgets at addresses that are a multiple of N\n"
+	      "                        (1 or 4). The default is 4 for arm64 Mach-O files and 1\n"
+	      "                        otherwise.\n"
+	      "  --no-simd             Don't use the SIMD prefilter for aligned scans.\n"
+	      "  --anchor=MODE         Which word of each gadget aligned scans look up: rare (the\n"
+	      "                        default) for the rarest word in a sample of the first\n"
+	      "                        image, or first for the first word.\n"
+	      "  -j N                  Scan with N threads. 0 means one per CPU. The default is 1.\n"
+	      "  --all                 Report every match of each gadget, not just the first.\n"
+	      "  --max-per-gadget=N    With --all, report at most N matches of each gadget.\n"
+	      "  --index-dir=DIR       Look up gadgets in an index of the image kept in DIR, keyed\n"
+	      "                        by the image's LC_UUID. The index is built on first use.\n"
+	      "                        Requires --align=4.\n"
+	      "  --base=INDEX          Scan only the blocks of the image's executable segments\n"
+	      "                        that differ from an earlier build, whose gadget index is\n"
+	      "                        INDEX, and take the other matches from the index.\n"
+	      "                        Requires --align=4.\n"
+	      "  --symbolicate         Print the symbol containing each match as symbol+offset,\n"
+	      "                        flagging matches past the end of the symbol.\n"
+	      "  --format=FORMAT       Print the results of a single image as text (the default),\n"
+	      "                        bin for a table of fixed-size records that can be mapped\n"
+	      "                        directly, json, or c-header for a #define per gadget.\n"
+	      "  --table=FORMAT        Print a table of the address of each gadget in each image\n"
+	      "                        as csv or json. This is the default, in csv, when more\n"
+	      "                        than one Mach-O file is given.\n"
+	      "  --kext=ID             In an MH_FILESET kernelcache, only scan the fileset entry\n"
+	      "                        ID, such as com.apple.kernel. May be given more than once.\n"
+	      "                        By default all entries are scanned.\n"
+	      "  --section=NAME        Only scan the sections named NAME, as SEGMENT or\n"
+	      "                        SEGMENT,SECTION, of the executable segments, whatever\n"
+	      "                        their attributes. May be given more than once.\n"
+	      "  --exclude-section=NAME\n"
+	      "                        Don't scan the sections named NAME.\n"
+	      "  --any-section         Scan every section of the executable segments, not just\n"
+	      "                        those marked as containing instructions.\n"
+	      "  --whole-segments      Scan the whole executable segments, including the padding\n"
+	      "                        between their sections.\n"
+	      "  --address=START-END   Only scan the addresses from START up to END. May be given\n"
+	      "                        more than once.\n"
+	      "  --cache-dir=DIR       Save decompressed kernelcaches in DIR, keyed by a hash of\n"
+	      "                        the compressed file, and reuse them on later runs.\n"
+	      "  --load=MODE           How to load the Mach-O files: map (the default), populate\n"
+	      "                        to also fault in the executable segments before scanning,\n"
+	      "                        or read to read each file into a huge-page buffer.\n"
+	      "  --timing              Print the time spent loading each image, faulting in its\n"
+	      "                        executable ranges, and matching them, to stderr.\n"
+	      "  --stats[=FORMAT]      Print the time spent in each phase, the bytes scanned in\n"
+	      "                        each segment, and the scan counters to stderr, as text\n"
+	      "                        (the default) or json.\n"
+	      "  --serve=SOCKET        Answer gadget and symbol queries on the UNIX socket SOCKET,\n"
+	      "                        keeping the images open between queries. Any Mach-O files\n"
+	      "                        given are opened at startup. -j sets the number of worker\n"
+	      "                        threads, one per CPU by default.",
+	      argv0);
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option longopts[] = {
+		{ "align",          required_argument, NULL, 'a' },
+		{ "no-simd",        no_argument,       NULL, 'S' },
+		{ "anchor",         required_argument, NULL, 'w' },
+		{ "all",            no_argument,       NULL, 'A' },
+		{ "max-per-gadget", required_argument, NULL, 'm' },
+		{ "index-dir",      required_argument, NULL, 'i' },
+		{ "base",           required_argument, NULL, 'B' },
+		{ "symbolicate",    no_argument,       NULL, 'y' },
+		{ "table",          required_argument, NULL, 't' },
+		{ "format",         required_argument, NULL, 'o' },
+		{ "kext",           required_argument, NULL, 'k' },
+		{ "section",        required_argument, NULL, 'n' },
+		{ "exclude-section", required_argument, NULL, 'x' },
+		{ "whole-segments", no_argument,       NULL, 'W' },
+		{ "any-section",    no_argument,       NULL, 'E' },
+		{ "address",        required_argument, NULL, 'r' },
+		{ "cache-dir",      required_argument, NULL, 'c' },
+		{ "load",           required_argument, NULL, 'l' },
+		{ "timing",         no_argument,       NULL, 'T' },
+		{ "stats",          optional_argument, NULL, 's' },
+		{ "serve",          required_argument, NULL, 'D' },
+		{ NULL,             0,                 NULL, 0   },
+	};
+	struct options options = { .simd = true, .threads = 1 };
+	bool threads_given = false;
+	const char *base_path = NULL;
+	bool whole_segments = false;
+	struct address_range *address_ranges = NULL;
+	size_t naddress_ranges = 0;
+	struct phase phases[PHASE_COUNT] = {};
+	phase_begin(&phases[PHASE_DECODE]);
+	struct gadget_set set;
+	gadget_set_init(&set);
+	for (;;) {
+		int opt = getopt_long(argc, argv, "f:j:", longopts, NULL);
+		if (opt == -1) {
+			break;
+		}
+		switch (opt) {
+			case 'a':
+				if (strcmp(optarg, "1") == 0) {
+					options.align = 1;
+				} else if (strcmp(optarg, "4") == 0) {
+					options.align = 4;
+				} else {
+					error("Invalid alignment '%s': must be 1 or 4", optarg);
+				}
+				break;
+			case 'S':
+				options.simd = false;
+				break;
+			case 'w':
+				if (strcmp(optarg, "rare") == 0) {
+					options.anchor = ANCHOR_RARE;
+				} else if (strcmp(optarg, "first") == 0) {
+					options.anchor = ANCHOR_FIRST;
+				} else {
+					error("Invalid anchor mode '%s': must be rare or first",
+							optarg);
+				}
+				break;
+			case 'f':
+				read_gadget_file(&set, optarg);
+				break;
+			case 'j':
+				options.threads = parse_count(optarg, "thread count", 4096);
+				threads_given = true;
+				if (options.threads == 0) {
+					long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+					options.threads = (ncpus > 0 ? ncpus : 1);
+				}
+				break;
+			case 'A':
+				options.all = true;
+				break;
+			case 'm':
+				options.all = true;
+				options.max_hits = parse_count(optarg, "match limit", SIZE_MAX);
+				if (options.max_hits == 0) {
+					error("Invalid match limit '%s'", optarg);
+				}
+				break;
+			case 'i':
+				options.index_dir = optarg;
+				break;
+			case 'B':
+				base_path = optarg;
+				break;
+			case 'k':
+				append_arg(&options.kexts, &options.nkexts, optarg);
+				break;
+			case 'n':
+				append_arg(&options.filter.include, &options.filter.ninclude,
+						parse_section_name(optarg));
+				options.filter.sections = true;
+				break;
+			case 'x':
+				append_arg(&options.filter.exclude, &options.filter.nexclude,
+						parse_section_name(optarg));
+				options.filter.sections = true;
+				break;
+			case 'W':
+				whole_segments = true;
+				break;
+			case 'E':
+				options.filter.any_section = true;
+				options.filter.sections = true;
+				break;
+			case 'r':
+				address_ranges = realloc(address_ranges,
+						(naddress_ranges + 1) * sizeof(*address_ranges));
+				if (address_ranges == NULL) {
+					error("Could not allocate address ranges");
+				}
+				address_ranges[naddress_ranges++] = parse_address_range(optarg);
+				break;
+			case 'c':
+				options.cache_dir = optarg;
+				break;
+			case 'D':
+				options.serve = optarg;
+				break;
+			case 'l':
+				if (strcmp(optarg, "map") == 0) {
+					options.load = LOAD_MAP;
+				} else if (strcmp(optarg, "populate") == 0) {
+					options.load = LOAD_POPULATE;
+				} else if (strcmp(optarg, "read") == 0) {
+					options.load = LOAD_READ;
+				} else {
+					error("Invalid load mode '%s': must be map, populate, or read",
+							optarg);
+				}
+				break;
+			case 'T':
+				options.timing = true;
+				break;
+			case 'y':
+				options.symbolicate = true;
+				break;
+			case 's':
+				if (!MATCHER_STATS) {
+					error("--stats is not supported when built with "
+							"MATCHER_STATS=0");
+				}
+				if (optarg == NULL || strcmp(optarg, "text") == 0) {
+					options.stats = STATS_TEXT;
+				} else if (strcmp(optarg, "json") == 0) {
+					options.stats = STATS_JSON;
+				} else {
+					error("Invalid stats format '%s': must be text or json",
+							optarg);
+				}
+				break;
+			case 't':
+				if (strcmp(optarg, "csv") == 0) {
+					options.table = TABLE_CSV;
+				} else if (strcmp(optarg, "json") == 0) {
+					options.table = TABLE_JSON;
+				} else {
+					error("Invalid table format '%s': must be csv or json", optarg);
+				}
+				break;
+			case 'o':
+				if (strcmp(optarg, "text") == 0) {
+					options.format = FORMAT_TEXT;
+				} else if (strcmp(optarg, "bin") == 0) {
+					options.format = FORMAT_BIN;
+				} else if (strcmp(optarg, "json") == 0) {
+					options.format = FORMAT_JSON;
+				} else if (strcmp(optarg, "c-header") == 0) {
+					options.format = FORMAT_C_HEADER;
+				} else {
+					error("Invalid format '%s': must be text, bin, json, or "
+							"c-header", optarg);
+				}
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (options.serve != NULL) {
+		for (int i = 0; i < argc; i++) {
+			if (strchr(argv[i], ':') != NULL) {
+				error("Gadgets can't be given to --serve");
+			}
+		}
+		if (!threads_given) {
+			long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+			options.threads = (ncpus > 0 ? ncpus : 1);
+		}
+		struct server_options server_options = { options.serve, options.index_dir,
+			options.threads, options.simd, (const char **)argv, argc };
+		char message[256];
+		serving = true;
+		server_run(&server_options, message, sizeof(message));
+		error("%s", message);
+	}
+	if (argc < 1) {
+		usage(argv[-optind]);
+	}
+	// The leading arguments without a ':' are Mach-O files and the rest are gadgets.
+	size_t nimages = 1;
+	while (nimages < (size_t)argc && strchr(argv[nimages], ':') == NULL) {
+		nimages++;
+	}
+	for (int i = nimages; i < argc; i++) {
+		add_gadget(&set, argv[i]);
+	}
+	if (!gadget_set_finish(&set)) {
+		error("%s", set.error);
+	}
+	phase_end(&phases[PHASE_DECODE]);
+	struct gadget *gadgets = set.gadgets;
+	size_t count = set.count;
+	if (nimages > 1 && options.table == TABLE_NONE) {
+		options.table = TABLE_CSV;
+	}
+	if (options.all && options.table != TABLE_NONE) {
+		error("--all can't be combined with a table");
+	}
+	if (options.symbolicate && options.table != TABLE_NONE) {
+		error("--symbolicate can't be combined with a table");
+	}
+	if (options.format != FORMAT_TEXT && options.table != TABLE_NONE) {
+		error("--format can't be combined with a table");
+	}
+	if (options.format != FORMAT_TEXT && options.symbolicate) {
+		error("--format can't be combined with --symbolicate");
+	}
+	if (options.format == FORMAT_C_HEADER && options.all) {
+		error("--format=c-header can't be combined with --all");
+	}
+	if (whole_segments && options.filter.sections) {
+		error("--whole-segments can't be combined with the section options");
+	}
+	options.filter.addresses = address_ranges;
+	options.filter.naddresses = merge_address_ranges(address_ranges, naddress_ranges);
+	// The base's segments are paired with the image's.
+	if (base_path != NULL && (options.filter.sections || options.filter.naddresses > 0)) {
+		error("--base can't be combined with section or address filters");
+	}
+	// Only the code sections are scanned by default, but a base covers whole segments.
+	if (!whole_segments && base_path == NULL) {
+		options.filter.sections = true;
+	}
+	// Only the lowest match of each gadget is taken from the base.
+	struct gadget_index base;
+	if (base_path != NULL) {
+		if (options.all) {
+			error("--base can't be combined with --all");
+		}
+		if (options.index_dir != NULL) {
+			error("--base can't be combined with --index-dir");
+		}
+		if (!gadget_index_open(&base, base_path, NULL)) {
+			error("Could not open gadget index '%s'", base_path);
 		}
+		options.base = &base;
+	}
+	// The gadgets are compiled once for each alignment in use and shared by all the images.
+	struct image *images = calloc(nimages, sizeof(*images));
+	uint64_t *addresses = calloc(nimages * count + 1, sizeof(*addresses));
+	if (images == NULL || addresses == NULL) {
+		error("Could not allocate images");
+	}
+	for (size_t j = 0; j < nimages; j++) {
+		struct image *image = &images[j];
+		image->path = argv[j];
+		image->addresses = &addresses[j * count];
+		open_image(image, options.cache_dir, options.load);
+		image->macho.index_threads = options.threads;
+		unsigned align = options.align;
+		if (align == 0) {
+			align = (image->macho.mh32->cputype == CPU_TYPE_ARM64 ? 4 : 1);
+		}
+		struct matcher *matcher = &set.matchers[align == 4];
+		if (!set.compiled[align == 4]) {
+			phase_begin(&phases[PHASE_COMPILE]);
+			// The index and the rescan don't scan the image with the matcher, so
+			// there is nothing to gain from sampling it.
+			if (align == 4 && options.anchor == ANCHOR_RARE
+					&& options.index_dir == NULL && options.base == NULL) {
+				compile_sampled(&set, image, &options);
+			} else if (!gadget_set_compile(&set, align)) {
+				error("%s", set.error);
+			}
+			phase_end(&phases[PHASE_COMPILE]);
+			if (!options.simd) {
+				matcher->kernel = MATCHER_KERNEL_SCALAR;
+			}
+		}
+		image->matcher = matcher;
+	}
+	struct output out;
+	if (!output_init(&out, STDOUT_FILENO, 1 << 16)) {
+		error("Could not allocate output buffer");
+	}
+	if (options.table != TABLE_NONE) {
+		find_gadgets_in_images(images, nimages, &options);
+		for (size_t j = 0; j < nimages; j++) {
+			finish_image(&images[j]);
+		}
+		phase_begin(&phases[PHASE_OUTPUT]);
+		print_table(&out, options.table, gadgets, count, images, nimages);
+	} else {
+		struct image *image = &images[0];
+		find_gadgets(image, &options, options.threads, &out);
+		finish_image(image);
+		phase_begin(&phases[PHASE_OUTPUT]);
+		struct macho_address_symbol *symbols = NULL;
+		if (options.format != FORMAT_TEXT) {
+			print_results(&out, options.format, image, gadgets, count, options.all);
+		} else if (options.symbolicate && options.all) {
+			print_symbolicated_hits(&out, image, gadgets);
+		} else if (options.symbolicate) {
+			symbols = malloc(count * sizeof(*symbols) + 1);
+			if (symbols == NULL) {
+				error("Could not allocate symbols");
+			}
+			symbolicate(image, image->addresses, count, symbols);
+		}
+		// In all-matches mode the matches have already been printed, so only the gadgets
+		// that weren't found are left.
+		for (size_t i = 0; options.format == FORMAT_TEXT && i < count; i++) {
+			uint64_t address = image->addresses[i];
+			if (address == 0) {
+				output_printf(&out, "%-32s = 0\n", gadgets[i].name);
+			} else if (options.all) {
+				continue;
+			} else if (symbols != NULL) {
+				print_symbolicated(&out, gadgets[i].name, address, &symbols[i]);
+			} else {
+				output_printf(&out, "%-32s = 0x%llx\n", gadgets[i].name,
+						(unsigned long long)address);
+			}
+		}
+		free(symbols);
+	}
+	if (!output_deinit(&out)) {
+		error("Could not write output");
+	}
+	phase_end(&phases[PHASE_OUTPUT]);
+	for (size_t j = 0; options.timing && j < nimages; j++) {
+		const struct image *image = &images[j];
+		fprintf(stderr, "%s: load %.1f ms, faults %.1f ms (%ld page faults, %ld major), "
+				"scan %.1f ms\n", image->path, image->load.wall_ms,
+				image->fault.wall_ms, image->minor_faults + image->major_faults,
+				image->major_faults, image->scan.wall_ms);
+	}
+	if (options.stats != STATS_NONE) {
+		struct output err;
+		if (!output_init(&err, STDERR_FILENO, 1 << 12)) {
+			error("Could not allocate output buffer");
+		}
+		print_stats(&err, options.stats, phases, images, nimages);
+		if (!output_deinit(&err)) {
+			error("Could not write stats");
+		}
+	}
+	for (size_t j = 0; j < nimages; j++) {
+		if (images[j].kc != NULL) {
+			kernelcache_close(images[j].kc);
+			free(images[j].kc);
+		}
+		free(images[j].cache_path);
+		free(images[j].ranges);
+		free(images[j].range_names);
+		free(images[j].range_scanned);
+		free(images[j].hits);
+	}
+	if (options.base != NULL) {
+		gadget_index_close(&base);
 	}
+	free(options.kexts);
+	free(options.filter.include);
+	free(options.filter.exclude);
+	free(address_ranges);
+	free(addresses);
+	free(images);
+	gadget_set_free(&set);
 	return 0;
 }
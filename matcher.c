@@ -0,0 +1,1052 @@
+#include "matcher.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define MATCHER_HAVE_NEON 1
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define MATCHER_HAVE_AVX2 1
+#endif
+
+/*
+ * The scan loops are MATCHER_SPECIALIZED functions taking a constant stats parameter, which
+ * count their work with MATCHER_COUNT. matcher_scan checks once whether the state collects
+ * stats and calls a copy of the loops with or without the counting code, so scans without
+ * stats pay nothing for it.
+ */
+#define MATCHER_SPECIALIZED static inline __attribute__((always_inline))
+
+#define MATCHER_COUNT(stats, state, counter, n)					\
+	do {									\
+		if (MATCHER_STATS && (stats)) {					\
+			(state)->stats->counter += (n);				\
+		}								\
+	} while (0)
+
+static uint32_t load_word(const void *p) {
+	uint32_t word;
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+// Unmasked words hash the same as they would with no masks at all.
+static uint32_t hash_word(const struct matcher *m, uint32_t word, uint32_t mask) {
+	return ((word ^ (~mask * 0x85ebca6b)) * 0x9e3779b1) >> m->bucket_shift;
+}
+
+// Find the bucket for the given word under the given dispatch mask, or the empty slot where it
+// would go. The word must already be masked.
+static struct matcher_bucket *find_bucket(const struct matcher *m, uint32_t word,
+		uint32_t mask) {
+	uint32_t i = hash_word(m, word, mask);
+	for (;;) {
+		struct matcher_bucket *b = &m->buckets[i];
+		if (b->count == 0 || (b->word == word && b->mask == mask)) {
+			return b;
+		}
+		i = (i + 1) & m->bucket_mask;
+	}
+}
+
+// Find the bucket of the gadget's first word. Every gadget was inserted when the matcher was
+// built, so this always finds the bucket.
+static uint32_t gadget_bucket_index(const struct matcher *m, uint32_t word, uint32_t mask) {
+	uint32_t i = hash_word(m, word, mask);
+	while (m->buckets[i].word != word || m->buckets[i].mask != mask) {
+		i = (i + 1) & m->bucket_mask;
+	}
+	return i;
+}
+
+static int popcount(uint32_t x) {
+	return __builtin_popcount(x);
+}
+
+// Choose the dispatch mask for a gadget whose first word has the given mask. See struct
+// matcher.
+static uint32_t choose_dispatch_mask(struct matcher *m, uint32_t mask) {
+	for (unsigned i = 0; i < m->ndispatch_masks; i++) {
+		if (m->dispatch_masks[i] == mask) {
+			return mask;
+		}
+	}
+	// Keep the last slot for mask 0.
+	if (m->ndispatch_masks < MATCHER_MAX_MASKS - 1) {
+		m->dispatch_masks[m->ndispatch_masks++] = mask;
+		return mask;
+	}
+	uint32_t best = 0;
+	bool found = false;
+	for (unsigned i = 0; i < m->ndispatch_masks; i++) {
+		uint32_t d = m->dispatch_masks[i];
+		if ((d & ~mask) == 0 && (!found || popcount(d) > popcount(best))) {
+			best = d;
+			found = true;
+		}
+	}
+	if (!found) {
+		m->dispatch_masks[m->ndispatch_masks++] = 0;
+	}
+	return best;
+}
+
+// Returns true if the gadget matches the byte b at its first position.
+static bool short_gadget_matches(const struct gadget *g, uint8_t b) {
+	uint8_t value = ((const uint8_t *)g->data)[0];
+	uint8_t mask = (g->mask != NULL ? ((const uint8_t *)g->mask)[0] : 0xff);
+	return ((b ^ value) & mask) == 0;
+}
+
+// The parent of a trie root.
+#define NO_NODE UINT32_MAX
+
+// Returns the value and mask of word w of the gadget. The value is masked.
+static uint32_t gadget_word(const struct gadget *g, size_t w, uint32_t *mask) {
+	*mask = (g->mask != NULL ? load_word((const uint8_t *)g->mask + w * sizeof(uint32_t))
+			: 0xffffffff);
+	return load_word((const uint8_t *)g->data + w * sizeof(uint32_t)) & *mask;
+}
+
+// Returns the value and mask of byte k of the gadget.
+static uint8_t gadget_byte(const struct gadget *g, size_t k, uint8_t *mask) {
+	*mask = (g->mask != NULL ? ((const uint8_t *)g->mask)[k] : 0xff);
+	return ((const uint8_t *)g->data)[k] & *mask;
+}
+
+// A gadget to be added to the trie of its bucket, with the index of its anchor word.
+struct trie_entry {
+	const struct gadget *gadgets;
+	uint32_t gadget;
+	uint32_t bucket;
+	uint32_t anchor;
+};
+
+// Returns the index of the word at position j of the entry's path through the trie: the
+// anchor word, then the words before it backwards, then the words after it.
+static size_t entry_word_index(const struct trie_entry *e, size_t j) {
+	return (j <= e->anchor ? e->anchor - j : j);
+}
+
+// Returns the value, mask, and offset from the anchor of the word at position j of the
+// entry's path.
+static uint32_t entry_key(const struct trie_entry *e, size_t j, uint32_t *mask,
+		int32_t *offset) {
+	size_t w = entry_word_index(e, j);
+	*offset = ((int32_t)w - (int32_t)e->anchor) * (int32_t)sizeof(uint32_t);
+	return gadget_word(&e->gadgets[e->gadget], w, mask);
+}
+
+// Compare the keys at position j of two paths by offset, then word, then mask.
+static int compare_keys(const struct trie_entry *a, const struct trie_entry *b, size_t j) {
+	uint32_t mask_a, mask_b;
+	int32_t offset_a, offset_b;
+	uint32_t word_a = entry_key(a, j, &mask_a, &offset_a);
+	uint32_t word_b = entry_key(b, j, &mask_b, &offset_b);
+	if (offset_a != offset_b) {
+		return (offset_a > offset_b) - (offset_a < offset_b);
+	}
+	if (word_a != word_b) {
+		return (word_a > word_b) - (word_a < word_b);
+	}
+	return (mask_a > mask_b) - (mask_a < mask_b);
+}
+
+// Returns the number of leading keys that the two paths share.
+static size_t common_keys(const struct trie_entry *a, const struct trie_entry *b) {
+	size_t na = a->gadgets[a->gadget].size / sizeof(uint32_t);
+	size_t nb = b->gadgets[b->gadget].size / sizeof(uint32_t);
+	size_t n = (na < nb ? na : nb);
+	for (size_t j = 0; j < n; j++) {
+		if (compare_keys(a, b, j) != 0) {
+			return j;
+		}
+	}
+	return n;
+}
+
+// Order entries by their paths and then by their length and remaining bytes, so that entries
+// sharing a prefix are adjacent and identical gadgets compare equal.
+static int compare_paths(const struct trie_entry *ea, const struct trie_entry *eb) {
+	const struct gadget *a = &ea->gadgets[ea->gadget];
+	const struct gadget *b = &eb->gadgets[eb->gadget];
+	size_t shared = common_keys(ea, eb);
+	size_t na = a->size / sizeof(uint32_t);
+	size_t nb = b->size / sizeof(uint32_t);
+	if (shared < na && shared < nb) {
+		return compare_keys(ea, eb, shared);
+	}
+	if (a->size != b->size) {
+		return (a->size > b->size) - (a->size < b->size);
+	}
+	for (size_t k = na * sizeof(uint32_t); k < a->size; k++) {
+		uint8_t mask_a, mask_b;
+		uint8_t byte_a = gadget_byte(a, k, &mask_a);
+		uint8_t byte_b = gadget_byte(b, k, &mask_b);
+		if (byte_a != byte_b || mask_a != mask_b) {
+			return (byte_a != byte_b ? byte_a - byte_b : mask_a - mask_b);
+		}
+	}
+	return 0;
+}
+
+static int compare_trie_entries(const void *a, const void *b) {
+	const struct trie_entry *ea = a;
+	const struct trie_entry *eb = b;
+	if (ea->bucket != eb->bucket) {
+		return (ea->bucket > eb->bucket) - (ea->bucket < eb->bucket);
+	}
+	int cmp = compare_paths(ea, eb);
+	if (cmp != 0) {
+		return cmp;
+	}
+	return (ea->gadget > eb->gadget) - (ea->gadget < eb->gadget);
+}
+
+// Close the open nodes on the path deeper than depth, whose subtrees are now complete.
+static void close_nodes(struct matcher *m, const uint32_t *path, uint32_t *open, size_t depth) {
+	while (*open > depth) {
+		m->nodes[path[--*open]].next = m->nnodes;
+	}
+}
+
+// Set group_end for the siblings from first up to end.
+static void group_siblings(struct matcher *m, uint32_t first, uint32_t end) {
+	for (uint32_t n = first; n < end;) {
+		uint32_t group = n;
+		while (group < end && m->nodes[group].offset == m->nodes[n].offset) {
+			group = m->nodes[group].next;
+		}
+		for (; n != group; n = m->nodes[n].next) {
+			m->nodes[n].group_end = group;
+		}
+	}
+}
+
+// Build the trie of each bucket from the gadgets of at least 4 bytes, whose bucket indexes
+// are in gadget_bucket. The gadgets are sorted so that the gadgets of a bucket are adjacent and
+// in the order of their paths; each one then shares the open nodes of its common prefix with
+// the one before and adds nodes for the rest of its words, which keeps the nodes in preorder.
+static bool build_tries(struct matcher *m, const uint32_t *anchors, size_t nlong,
+		size_t nwords) {
+	const size_t count = m->count;
+	struct trie_entry *entries = malloc(nlong * sizeof(*entries) + 1);
+	uint32_t *path = malloc((m->max_size / sizeof(uint32_t)) * sizeof(*path) + 1);
+	m->nodes = malloc(nwords * sizeof(*m->nodes) + 1);
+	m->patterns = malloc(nlong * sizeof(*m->patterns) + 1);
+	m->pattern_gadgets = malloc(nlong * sizeof(*m->pattern_gadgets) + 1);
+	m->gadget_pattern = malloc(count * sizeof(*m->gadget_pattern) + 1);
+	if (entries == NULL || path == NULL || m->nodes == NULL || m->patterns == NULL
+			|| m->pattern_gadgets == NULL || m->gadget_pattern == NULL) {
+		free(entries);
+		free(path);
+		return false;
+	}
+	size_t n = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (m->gadgets[i].size >= sizeof(uint32_t)) {
+			entries[n].gadgets = m->gadgets;
+			entries[n].gadget = i;
+			entries[n].bucket = m->gadget_bucket[i];
+			entries[n++].anchor = anchors[i];
+		}
+	}
+	qsort(entries, nlong, sizeof(*entries), compare_trie_entries);
+	uint32_t open = 0;
+	for (size_t e = 0; e < nlong; e++) {
+		const struct trie_entry *entry = &entries[e];
+		struct matcher_bucket *b = &m->buckets[entry->bucket];
+		size_t nw = m->gadgets[entry->gadget].size / sizeof(uint32_t);
+		bool first = (e == 0 || entries[e - 1].bucket != entry->bucket);
+		bool same = false;
+		if (first) {
+			b->start = m->nnodes;
+		} else {
+			close_nodes(m, path, &open, common_keys(&entries[e - 1], entry));
+			same = (compare_paths(&entries[e - 1], entry) == 0);
+		}
+		for (size_t j = open; j < nw; j++) {
+			struct matcher_node *node = &m->nodes[m->nnodes];
+			memset(node, 0, sizeof(*node));
+			node->word = entry_key(entry, j, &node->mask, &node->offset);
+			node->parent = (j == 0 ? NO_NODE : path[j - 1]);
+			path[open++] = m->nnodes++;
+		}
+		// Identical gadgets are adjacent, so a gadget either joins the last pattern or
+		// starts a new one.
+		if (!same) {
+			struct matcher_node *node = &m->nodes[path[nw - 1]];
+			struct matcher_pattern *p = &m->patterns[m->npatterns];
+			p->node = path[nw - 1];
+			p->start = e;
+			p->count = 0;
+			p->anchor = entry->anchor * sizeof(uint32_t);
+			if (node->npatterns++ == 0) {
+				node->pattern = m->npatterns;
+			}
+			for (size_t j = 0; j < nw; j++) {
+				m->nodes[path[j]].below++;
+			}
+			b->npatterns++;
+			m->npatterns++;
+		}
+		m->patterns[m->npatterns - 1].count++;
+		m->pattern_gadgets[e] = entry->gadget;
+		m->gadget_pattern[entry->gadget] = m->npatterns - 1;
+		if (e + 1 == nlong || entries[e + 1].bucket != entry->bucket) {
+			close_nodes(m, path, &open, 0);
+			b->count = m->nnodes - b->start;
+		}
+	}
+	free(entries);
+	free(path);
+	// Group the children of each node, and the roots of each bucket.
+	for (uint32_t i = 0; i < m->nnodes; i++) {
+		group_siblings(m, i + 1, m->nodes[i].next);
+	}
+	for (uint32_t i = 0; i <= m->bucket_mask; i++) {
+		group_siblings(m, m->buckets[i].start, m->buckets[i].start + m->buckets[i].count);
+	}
+	return true;
+}
+
+// The number of times a gadget word was seen in the sample.
+struct word_count {
+	uint32_t word;
+	uint32_t count;
+	bool used;
+};
+
+// Find the entry for the word in the open-addressed table, or the empty slot where it goes.
+static struct word_count *find_word_count(struct word_count *table, uint32_t mask,
+		uint32_t word) {
+	uint32_t i = (word * 0x9e3779b1) & mask;
+	while (table[i].used && table[i].word != word) {
+		i = (i + 1) & mask;
+	}
+	return &table[i];
+}
+
+// Choose the anchor word of each gadget: the unmasked word seen least often in the sample,
+// preferring later words, or the first word if there is no sample.
+static bool choose_anchors(const struct matcher *m, const uint32_t *sample, size_t nsample,
+		size_t nwords, uint32_t *anchors) {
+	memset(anchors, 0, m->count * sizeof(*anchors));
+	if (sample == NULL || m->align != sizeof(uint32_t)) {
+		return true;
+	}
+	uint32_t size = 16;
+	while (size < 2 * nwords) {
+		size *= 2;
+	}
+	struct word_count *table = calloc(size, sizeof(*table));
+	if (table == NULL) {
+		return false;
+	}
+	for (size_t i = 0; i < m->count; i++) {
+		const struct gadget *g = &m->gadgets[i];
+		for (size_t w = 0; w < g->size / sizeof(uint32_t); w++) {
+			uint32_t mask;
+			uint32_t word = gadget_word(g, w, &mask);
+			if (mask == 0xffffffff) {
+				struct word_count *c = find_word_count(table, size - 1, word);
+				c->word = word;
+				c->used = true;
+			}
+		}
+	}
+	for (size_t i = 0; i < nsample; i++) {
+		struct word_count *c = find_word_count(table, size - 1, sample[i]);
+		c->count += c->used;
+	}
+	for (size_t i = 0; i < m->count; i++) {
+		const struct gadget *g = &m->gadgets[i];
+		uint32_t best = UINT32_MAX;
+		for (size_t w = 0; w < g->size / sizeof(uint32_t); w++) {
+			uint32_t mask;
+			uint32_t word = gadget_word(g, w, &mask);
+			if (mask != 0xffffffff) {
+				continue;
+			}
+			uint32_t count = find_word_count(table, size - 1, word)->count;
+			if (count <= best) {
+				best = count;
+				anchors[i] = w;
+			}
+		}
+	}
+	free(table);
+	return true;
+}
+
+static int compare_words(const void *a, const void *b) {
+	uint64_t wa = *(const uint64_t *)a;
+	uint64_t wb = *(const uint64_t *)b;
+	return (wa > wb) - (wa < wb);
+}
+
+// Build the nibble tables used by the SIMD prefilter. The distinct first words are sorted so
+// that words sharing an opcode land in the same group, and the groups are split evenly across
+// the 8 bits of each table entry. Returns the expected fraction of random words that pass the
+// prefilter.
+static double build_prefilter(struct matcher *m) {
+	uint32_t nwords = 0;
+	uint64_t *words = malloc((m->bucket_mask + 1) * sizeof(*words));
+	if (words == NULL) {
+		return 1.0;
+	}
+	// Sort on the word, keeping its mask in the low half.
+	for (uint32_t i = 0; i <= m->bucket_mask; i++) {
+		if (m->buckets[i].count != 0) {
+			words[nwords++] = ((uint64_t)m->buckets[i].word << 32) | m->buckets[i].mask;
+		}
+	}
+	qsort(words, nwords, sizeof(*words), compare_words);
+	for (uint32_t i = 0; i < nwords; i++) {
+		uint8_t bit = 1 << (i * 8 / nwords);
+		uint32_t word = words[i] >> 32;
+		uint32_t mask = (uint32_t)words[i];
+		uint8_t bytes[sizeof(uint32_t)], masks[sizeof(uint32_t)];
+		memcpy(bytes, &word, sizeof(bytes));
+		memcpy(masks, &mask, sizeof(masks));
+		// A masked nibble accepts every value that agrees on its masked bits.
+		for (size_t j = 0; j < sizeof(bytes); j++) {
+			for (unsigned n = 0; n < 16; n++) {
+				if (((n ^ bytes[j]) & masks[j] & 0xf) == 0) {
+					m->nibble_lo[j][n] |= bit;
+				}
+				if (((n ^ (bytes[j] >> 4)) & (masks[j] >> 4)) == 0) {
+					m->nibble_hi[j][n] |= bit;
+				}
+			}
+		}
+	}
+	free(words);
+	double pass = 0.0;
+	for (unsigned bit = 0; bit < 8; bit++) {
+		double group_pass = 1.0;
+		for (size_t j = 0; j < sizeof(uint32_t); j++) {
+			unsigned lo = 0, hi = 0;
+			for (size_t n = 0; n < 16; n++) {
+				lo += (m->nibble_lo[j][n] >> bit) & 1;
+				hi += (m->nibble_hi[j][n] >> bit) & 1;
+			}
+			group_pass *= (lo / 16.0) * (hi / 16.0);
+		}
+		pass += group_pass;
+	}
+	return pass;
+}
+
+// Pick the fastest kernel supported by this CPU. The prefilter is only worth running if it
+// rejects most positions.
+static enum matcher_kernel choose_kernel(double prefilter_pass) {
+	if (prefilter_pass > 0.25) {
+		return MATCHER_KERNEL_SCALAR;
+	}
+#if MATCHER_HAVE_NEON
+	return MATCHER_KERNEL_NEON;
+#elif MATCHER_HAVE_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		return MATCHER_KERNEL_AVX2;
+	}
+#endif
+	return MATCHER_KERNEL_SCALAR;
+}
+
+const char *matcher_kernel_name(enum matcher_kernel kernel) {
+	switch (kernel) {
+		case MATCHER_KERNEL_SCALAR: return "scalar";
+		case MATCHER_KERNEL_NEON:   return "neon";
+		case MATCHER_KERNEL_AVX2:   return "avx2";
+	}
+	return "unknown";
+}
+
+bool matcher_init(struct matcher *m, const struct gadget *gadgets, size_t count,
+		unsigned align) {
+	return matcher_init_anchored(m, gadgets, count, align, NULL, 0);
+}
+
+bool matcher_init_anchored(struct matcher *m, const struct gadget *gadgets, size_t count,
+		unsigned align, const uint32_t *sample, size_t nsample) {
+	memset(m, 0, sizeof(*m));
+	m->gadgets = gadgets;
+	m->count = count;
+	m->align = align;
+	for (size_t i = 0; i < count; i++) {
+		if (gadgets[i].size > m->max_size) {
+			m->max_size = gadgets[i].size;
+		}
+		m->masked |= (gadgets[i].mask != NULL);
+	}
+	// Size the dispatch table to keep the load factor at or below 1/2.
+	uint32_t bits = 4;
+	while (((size_t)1 << bits) < 2 * count) {
+		bits++;
+	}
+	m->bucket_mask = (1u << bits) - 1;
+	m->bucket_shift = 32 - bits;
+	// A short gadget with a masked first byte is listed under every byte it matches.
+	size_t nshort = 0;
+	for (size_t i = 0; i < count; i++) {
+		const struct gadget *g = &gadgets[i];
+		for (unsigned b = 0; g->size < sizeof(uint32_t) && b < 256; b++) {
+			if (short_gadget_matches(g, b)) {
+				m->short_start[b + 1]++;
+				nshort++;
+			}
+		}
+	}
+	size_t nlong = 0;
+	size_t nwords = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (gadgets[i].size >= sizeof(uint32_t)) {
+			nlong++;
+			nwords += gadgets[i].size / sizeof(uint32_t);
+		}
+	}
+	m->buckets = calloc(m->bucket_mask + 1, sizeof(*m->buckets));
+	m->short_gadgets = malloc(nshort * sizeof(*m->short_gadgets) + 1);
+	m->gadget_bucket = malloc(count * sizeof(*m->gadget_bucket) + 1);
+	uint32_t *anchors = malloc(count * sizeof(*anchors) + 1);
+	if (m->buckets == NULL || m->short_gadgets == NULL || m->gadget_bucket == NULL
+			|| anchors == NULL || !choose_anchors(m, sample, nsample, nwords, anchors)) {
+		free(anchors);
+		matcher_deinit(m);
+		return false;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (anchors[i] * sizeof(uint32_t) > m->max_anchor) {
+			m->max_anchor = anchors[i] * sizeof(uint32_t);
+		}
+	}
+	// In aligned mode, pack the gadgets into one array of words.
+	if (align == sizeof(uint32_t)) {
+		size_t nwords = 0;
+		for (size_t i = 0; i < count; i++) {
+			nwords += gadgets[i].size / sizeof(uint32_t);
+		}
+		m->words = malloc(nwords * sizeof(*m->words) + 1);
+		m->word_start = malloc(count * sizeof(*m->word_start) + 1);
+		if (m->masked) {
+			m->word_masks = malloc(nwords * sizeof(*m->word_masks) + 1);
+		}
+		if (m->words == NULL || m->word_start == NULL
+				|| (m->masked && m->word_masks == NULL)) {
+			free(anchors);
+			matcher_deinit(m);
+			return false;
+		}
+		uint32_t start = 0;
+		for (size_t i = 0; i < count; i++) {
+			size_t size = gadgets[i].size;
+			m->word_start[i] = start;
+			memcpy(&m->words[start], gadgets[i].data, size);
+			if (gadgets[i].mask != NULL) {
+				memcpy(&m->word_masks[start], gadgets[i].mask, size);
+			} else if (m->masked) {
+				memset(&m->word_masks[start], 0xff, size);
+			}
+			start += size / sizeof(uint32_t);
+		}
+	}
+	// Gadgets with an unmasked anchor word always get their own dispatch mask, so that the
+	// anchor word is known to match once their bucket is found.
+	for (size_t i = 0; i < count; i++) {
+		uint32_t mask = 0;
+		if (gadgets[i].size >= sizeof(uint32_t)) {
+			gadget_word(&gadgets[i], anchors[i], &mask);
+		}
+		if (mask == 0xffffffff) {
+			m->dispatch_masks[m->ndispatch_masks++] = 0xffffffff;
+			break;
+		}
+	}
+	// Fill in the buckets, then find each gadget's bucket. The gadget's bucket index is used
+	// to remember its dispatch mask in the meantime.
+	for (size_t i = 0; i < count; i++) {
+		const struct gadget *g = &gadgets[i];
+		if (g->size >= sizeof(uint32_t)) {
+			uint32_t word_mask;
+			uint32_t word = gadget_word(g, anchors[i], &word_mask);
+			uint32_t mask = choose_dispatch_mask(m, word_mask);
+			struct matcher_bucket *b = find_bucket(m, word & mask, mask);
+			b->word = word & mask;
+			b->mask = mask;
+			b->count = 1;
+			m->gadget_bucket[i] = mask;
+		}
+	}
+	for (size_t i = 0; i < count; i++) {
+		const struct gadget *g = &gadgets[i];
+		if (g->size >= sizeof(uint32_t)) {
+			uint32_t word_mask;
+			uint32_t mask = m->gadget_bucket[i];
+			uint32_t word = gadget_word(g, anchors[i], &word_mask) & mask;
+			m->gadget_bucket[i] = gadget_bucket_index(m, word, mask);
+		}
+	}
+	bool success = build_tries(m, anchors, nlong, nwords);
+	free(anchors);
+	if (!success) {
+		matcher_deinit(m);
+		return false;
+	}
+	for (size_t i = 1; i < 257; i++) {
+		m->short_start[i] += m->short_start[i - 1];
+	}
+	uint32_t short_fill[256];
+	memcpy(short_fill, m->short_start, sizeof(short_fill));
+	for (size_t i = 0; i < count; i++) {
+		const struct gadget *g = &gadgets[i];
+		for (unsigned b = 0; g->size < sizeof(uint32_t) && b < 256; b++) {
+			if (short_gadget_matches(g, b)) {
+				m->short_gadgets[short_fill[b]++] = i;
+			}
+		}
+	}
+	m->kernel = MATCHER_KERNEL_SCALAR;
+	if (align == sizeof(uint32_t)) {
+		m->kernel = choose_kernel(build_prefilter(m));
+	}
+	return true;
+}
+
+void matcher_deinit(struct matcher *m) {
+	free(m->buckets);
+	free(m->short_gadgets);
+	free(m->words);
+	free(m->word_masks);
+	free(m->word_start);
+	free(m->gadget_bucket);
+	free(m->nodes);
+	free(m->patterns);
+	free(m->pattern_gadgets);
+	free(m->gadget_pattern);
+	m->buckets = NULL;
+	m->short_gadgets = NULL;
+	m->words = NULL;
+	m->word_masks = NULL;
+	m->word_start = NULL;
+	m->gadget_bucket = NULL;
+	m->nodes = NULL;
+	m->patterns = NULL;
+	m->pattern_gadgets = NULL;
+	m->gadget_pattern = NULL;
+}
+
+bool matcher_state_init(struct matcher_state *s, const struct matcher *m) {
+	memset(s, 0, sizeof(*s));
+	s->remaining = m->count;
+	s->addresses = calloc(m->count + 1, sizeof(*s->addresses));
+	s->resolved = calloc(m->count + 1, sizeof(*s->resolved));
+	s->live_count = malloc((m->bucket_mask + 1) * sizeof(*s->live_count));
+	s->node_live = malloc(m->nnodes * sizeof(*s->node_live) + 1);
+	s->pattern_live = malloc(m->npatterns * sizeof(*s->pattern_live) + 1);
+	s->short_live = malloc(m->short_start[256] * sizeof(*s->short_live) + 1);
+	s->hits = calloc(m->count + 1, sizeof(*s->hits));
+	if (s->addresses == NULL || s->resolved == NULL || s->live_count == NULL
+			|| s->node_live == NULL || s->pattern_live == NULL || s->short_live == NULL
+			|| s->hits == NULL) {
+		matcher_state_deinit(s);
+		return false;
+	}
+	// Initially every gadget is live.
+	memcpy(s->short_live, m->short_gadgets, m->short_start[256] * sizeof(*s->short_live));
+	for (uint32_t i = 0; i <= m->bucket_mask; i++) {
+		s->live_count[i] = m->buckets[i].npatterns;
+	}
+	for (uint32_t i = 0; i < m->nnodes; i++) {
+		s->node_live[i] = m->nodes[i].below;
+	}
+	for (uint32_t i = 0; i < m->npatterns; i++) {
+		s->pattern_live[i] = m->patterns[i].count;
+	}
+	for (size_t i = 0; i < 256; i++) {
+		s->short_live_count[i] = m->short_start[i + 1] - m->short_start[i];
+	}
+	return true;
+}
+
+void matcher_state_deinit(struct matcher_state *s) {
+	free(s->addresses);
+	free(s->resolved);
+	free(s->live_count);
+	free(s->node_live);
+	free(s->pattern_live);
+	free(s->short_live);
+	free(s->hits);
+	memset(s, 0, sizeof(*s));
+}
+
+// Remove gadget i from the live list that starts at live and has *count entries.
+static void remove_live(uint32_t *live, uint32_t *count, uint32_t i) {
+	for (uint32_t j = 0; j < *count; j++) {
+		if (live[j] == i) {
+			live[j] = live[--*count];
+			return;
+		}
+	}
+}
+
+void matcher_state_drop(const struct matcher *m, struct matcher_state *s, size_t i) {
+	if (s->resolved[i]) {
+		return;
+	}
+	s->resolved[i] = true;
+	s->remaining--;
+	const struct gadget *g = &m->gadgets[i];
+	if (g->size >= sizeof(uint32_t)) {
+		// The pattern stays live until all of its gadgets are resolved.
+		uint32_t p = m->gadget_pattern[i];
+		if (--s->pattern_live[p] != 0) {
+			return;
+		}
+		for (uint32_t n = m->patterns[p].node; n != NO_NODE; n = m->nodes[n].parent) {
+			s->node_live[n]--;
+		}
+		s->live_count[m->gadget_bucket[i]]--;
+	} else {
+		for (unsigned b = 0; b < 256; b++) {
+			if (short_gadget_matches(g, b)) {
+				remove_live(&s->short_live[m->short_start[b]],
+						&s->short_live_count[b], i);
+			}
+		}
+	}
+}
+
+void matcher_state_record(const struct matcher *m, struct matcher_state *s, size_t i,
+		uint64_t address) {
+	if (s->addresses[i] == 0 || address < s->addresses[i]) {
+		s->addresses[i] = address;
+	}
+	matcher_state_drop(m, s, i);
+}
+
+void matcher_stats_add(struct matcher_stats *into, const struct matcher_stats *from) {
+	into->bytes          += from->bytes;
+	into->prefiltered    += from->prefiltered;
+	into->prefilter_hits += from->prefilter_hits;
+	into->positions      += from->positions;
+	into->compares       += from->compares;
+	into->matches        += from->matches;
+}
+
+void matcher_state_collect_stats(struct matcher_state *s, struct matcher_stats *stats) {
+	s->stats = stats;
+}
+
+void matcher_state_report_all(struct matcher_state *s, matcher_hit_fn hit, void *context,
+		size_t max_hits) {
+	s->hit = hit;
+	s->hit_context = context;
+	s->max_hits = max_hits;
+}
+
+void matcher_state_report(const struct matcher *m, struct matcher_state *s, size_t i,
+		uint64_t address) {
+	if (s->hit == NULL) {
+		matcher_state_record(m, s, i, address);
+		return;
+	}
+	if (s->resolved[i]) {
+		return;
+	}
+	s->hit(s->hit_context, i, address);
+	if (s->addresses[i] == 0 || address < s->addresses[i]) {
+		s->addresses[i] = address;
+	}
+	s->hits[i]++;
+	if (s->hits[i] == s->max_hits) {
+		matcher_state_drop(m, s, i);
+	}
+}
+
+void matcher_state_merge(const struct matcher *m, struct matcher_state *into,
+		const struct matcher_state *from) {
+	for (size_t i = 0; i < m->count; i++) {
+		if (from->addresses[i] != 0) {
+			matcher_state_record(m, into, i, from->addresses[i]);
+		}
+	}
+}
+
+// Check whether short gadget i matches at ins, given that its first byte matches.
+MATCHER_SPECIALIZED void check_gadget(const struct matcher *m, struct matcher_state *s,
+		uint32_t i, const uint8_t *ins, size_t left, uint64_t address, bool stats) {
+	const struct gadget *g = &m->gadgets[i];
+	if (left < g->size) {
+		return;
+	}
+	MATCHER_COUNT(stats, s, compares, 1);
+	if (g->mask != NULL) {
+		const uint8_t *data = g->data;
+		const uint8_t *mask = g->mask;
+		for (size_t k = 1; k < g->size; k++) {
+			if (((ins[k] ^ data[k]) & mask[k]) != 0) {
+				return;
+			}
+		}
+	} else if (memcmp((const uint8_t *)g->data + 1, ins + 1, g->size - 1) != 0) {
+		return;
+	}
+	MATCHER_COUNT(stats, s, matches, 1);
+	matcher_state_report(m, s, i, address);
+}
+
+// Check the bytes of pattern p after its last whole word, which the trie doesn't cover, and
+// report each of its unresolved gadgets if they match. ins is the position of the anchor word,
+// and the match must start at least owned bytes before it to be in the scanned data.
+MATCHER_SPECIALIZED void check_pattern(const struct matcher *m, struct matcher_state *s,
+		uint32_t p, const uint8_t *ins, size_t left, size_t owned, uint64_t address,
+		bool stats) {
+	if (s->pattern_live[p] == 0) {
+		return;
+	}
+	const struct matcher_pattern *pattern = &m->patterns[p];
+	const struct gadget *g = &m->gadgets[m->pattern_gadgets[pattern->start]];
+	if (pattern->anchor < owned || left + pattern->anchor < g->size) {
+		return;
+	}
+	ins -= pattern->anchor;
+	address -= pattern->anchor;
+	const uint8_t *data = g->data;
+	const uint8_t *mask = g->mask;
+	for (size_t k = g->size & ~(sizeof(uint32_t) - 1); k < g->size; k++) {
+		if (((ins[k] ^ data[k]) & (mask != NULL ? mask[k] : 0xff)) != 0) {
+			return;
+		}
+	}
+	MATCHER_COUNT(stats, s, matches, 1);
+	for (uint32_t j = 0; j < pattern->count; j++) {
+		uint32_t i = m->pattern_gadgets[pattern->start + j];
+		if (!s->resolved[i]) {
+			matcher_state_report(m, s, i, address);
+		}
+	}
+}
+
+// Walk the trie of the bucket at ins, the position of the anchor word, which has before
+// readable bytes before it and left from it. A node that doesn't match, or has no live
+// patterns left below it, is skipped along with its subtree; otherwise the walk goes on to its
+// children, which follow it in preorder.
+MATCHER_SPECIALIZED void walk_bucket(const struct matcher *m, struct matcher_state *s,
+		const struct matcher_bucket *b, const uint8_t *ins, size_t before, size_t left,
+		size_t owned, uint64_t address, bool stats) {
+	uint32_t end = b->start + b->count;
+	for (uint32_t n = b->start; n < end;) {
+		const struct matcher_node *node = &m->nodes[n];
+		bool readable = (node->offset < 0 ? (size_t)-node->offset <= before
+				: (size_t)node->offset + sizeof(uint32_t) <= left);
+		if (s->node_live[n] == 0 || !readable) {
+			n = node->next;
+			continue;
+		}
+		MATCHER_COUNT(stats, s, compares, 1);
+		uint32_t word = load_word(ins + node->offset);
+		if (((word ^ node->word) & node->mask) != 0) {
+			// Without masks, siblings with the same offset are in increasing order of
+			// their words, so none of them after a larger word can match either.
+			n = (!m->masked && node->word > word ? node->group_end : node->next);
+			continue;
+		}
+		for (uint32_t p = 0; p < node->npatterns; p++) {
+			check_pattern(m, s, node->pattern + p, ins, left, owned, address, stats);
+		}
+		n++;
+	}
+}
+
+// Look up the word at offset off of the data under each dispatch mask and walk the tries of
+// the buckets found. Only matches starting in the first size bytes are reported.
+MATCHER_SPECIALIZED void probe_word(const struct matcher *m, struct matcher_state *s,
+		const uint8_t *data, size_t off, uint64_t address, size_t size, size_t readable,
+		bool stats) {
+	MATCHER_COUNT(stats, s, positions, 1);
+	const uint8_t *ins = data + off;
+	uint32_t word = load_word(ins);
+	size_t owned = (off < size ? 0 : off - size + 1);
+	for (unsigned k = 0; k < m->ndispatch_masks; k++) {
+		uint32_t mask = m->dispatch_masks[k];
+		const struct matcher_bucket *b = find_bucket(m, word & mask, mask);
+		if (s->live_count[b - m->buckets] != 0) {
+			walk_bucket(m, s, b, ins, off, readable - off, owned, address + off, stats);
+		}
+	}
+}
+
+#if MATCHER_HAVE_NEON
+
+// Run the nibble prefilter over 16-byte blocks up to end, probing the dispatch table only for
+// words that pass. Returns the offset of the first unscanned word.
+MATCHER_SPECIALIZED size_t prefilter_neon(const struct matcher *m, struct matcher_state *s,
+		const uint8_t *ins, size_t off, uint64_t address, size_t size, size_t end,
+		size_t readable, bool stats) {
+	uint8x16_t lo_table[4], hi_table[4], position[4];
+	for (size_t j = 0; j < 4; j++) {
+		lo_table[j] = vld1q_u8(m->nibble_lo[j]);
+		hi_table[j] = vld1q_u8(m->nibble_hi[j]);
+		position[j] = vreinterpretq_u8_u32(vdupq_n_u32(0xffu << (8 * j)));
+	}
+	const uint8x16_t low_nibbles = vdupq_n_u8(0x0f);
+	for (; off + 16 <= end && s->remaining != 0; off += 16) {
+		uint8x16_t v = vld1q_u8(ins + off);
+		uint8x16_t lo = vandq_u8(v, low_nibbles);
+		uint8x16_t hi = vshrq_n_u8(v, 4);
+		uint8x16_t groups = vdupq_n_u8(0);
+		for (size_t j = 0; j < 4; j++) {
+			uint8x16_t g = vandq_u8(vqtbl1q_u8(lo_table[j], lo),
+					vqtbl1q_u8(hi_table[j], hi));
+			groups = vorrq_u8(groups, vandq_u8(g, position[j]));
+		}
+		// A word passes if some group matches all 4 of its bytes.
+		uint32x4_t hits = vreinterpretq_u32_u8(groups);
+		hits = vandq_u32(hits, vshrq_n_u32(hits, 8));
+		hits = vandq_u32(hits, vshrq_n_u32(hits, 16));
+		hits = vandq_u32(hits, vdupq_n_u32(0xff));
+		MATCHER_COUNT(stats, s, prefiltered, 4);
+		if (vmaxvq_u32(hits) == 0) {
+			continue;
+		}
+		uint32_t lanes[4];
+		vst1q_u32(lanes, hits);
+		for (size_t w = 0; w < 4; w++) {
+			if (lanes[w] != 0) {
+				size_t word_off = off + w * sizeof(uint32_t);
+				MATCHER_COUNT(stats, s, prefilter_hits, 1);
+				probe_word(m, s, ins, word_off, address, size, readable,
+						stats);
+			}
+		}
+	}
+	return off;
+}
+
+#endif
+
+#if MATCHER_HAVE_AVX2
+
+// The AVX2 version of prefilter_neon, over 32-byte blocks.
+__attribute__((target("avx2")))
+MATCHER_SPECIALIZED size_t prefilter_avx2_impl(const struct matcher *m, struct matcher_state *s,
+		const uint8_t *ins, size_t off, uint64_t address, size_t size, size_t end,
+		size_t readable, bool stats) {
+	__m256i lo_table[4], hi_table[4], position[4];
+	for (size_t j = 0; j < 4; j++) {
+		lo_table[j] = _mm256_broadcastsi128_si256(
+				_mm_loadu_si128((const __m128i *)m->nibble_lo[j]));
+		hi_table[j] = _mm256_broadcastsi128_si256(
+				_mm_loadu_si128((const __m128i *)m->nibble_hi[j]));
+		position[j] = _mm256_set1_epi32(0xffu << (8 * j));
+	}
+	const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+	const __m256i low_byte = _mm256_set1_epi32(0xff);
+	const __m256i zero = _mm256_setzero_si256();
+	for (; off + 32 <= end && s->remaining != 0; off += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(ins + off));
+		__m256i lo = _mm256_and_si256(v, low_nibbles);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibbles);
+		__m256i groups = zero;
+		for (size_t j = 0; j < 4; j++) {
+			__m256i g = _mm256_and_si256(_mm256_shuffle_epi8(lo_table[j], lo),
+					_mm256_shuffle_epi8(hi_table[j], hi));
+			groups = _mm256_or_si256(groups, _mm256_and_si256(g, position[j]));
+		}
+		__m256i hits = groups;
+		hits = _mm256_and_si256(hits, _mm256_srli_epi32(hits, 8));
+		hits = _mm256_and_si256(hits, _mm256_srli_epi32(hits, 16));
+		hits = _mm256_and_si256(hits, low_byte);
+		__m256i misses = _mm256_cmpeq_epi32(hits, zero);
+		unsigned mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(misses)) & 0xff;
+		MATCHER_COUNT(stats, s, prefiltered, 8);
+		MATCHER_COUNT(stats, s, prefilter_hits, popcount(mask));
+		while (mask != 0) {
+			size_t word_off = off + __builtin_ctz(mask) * sizeof(uint32_t);
+			probe_word(m, s, ins, word_off, address, size, readable, stats);
+			mask &= mask - 1;
+		}
+	}
+	return off;
+}
+
+// The AVX2 code can't be inlined into code built for the baseline CPU, so the copies with and
+// without stats are made here instead.
+__attribute__((target("avx2")))
+static size_t prefilter_avx2(const struct matcher *m, struct matcher_state *s,
+		const uint8_t *ins, size_t off, uint64_t address, size_t size, size_t end,
+		size_t readable, bool stats) {
+	if (MATCHER_STATS && stats) {
+		return prefilter_avx2_impl(m, s, ins, off, address, size, end, readable, true);
+	}
+	return prefilter_avx2_impl(m, s, ins, off, address, size, end, readable, false);
+}
+
+#endif
+
+MATCHER_SPECIALIZED void scan_aligned(const struct matcher *m, struct matcher_state *s,
+		const uint8_t *ins, uint64_t address, size_t size, size_t readable, bool stats) {
+	// Start at the first aligned address. The anchor word of a match starting in the data can
+	// be up to max_anchor bytes further on.
+	size_t off = -address & (sizeof(uint32_t) - 1);
+	size_t end = (readable - size > m->max_anchor ? size + m->max_anchor : readable);
+	switch (m->kernel) {
+#if MATCHER_HAVE_NEON
+		case MATCHER_KERNEL_NEON:
+			off = prefilter_neon(m, s, ins, off, address, size, end, readable, stats);
+			break;
+#endif
+#if MATCHER_HAVE_AVX2
+		case MATCHER_KERNEL_AVX2:
+			off = prefilter_avx2(m, s, ins, off, address, size, end, readable, stats);
+			break;
+#endif
+		default:
+			break;
+	}
+	for (; off < end && off + sizeof(uint32_t) <= readable && s->remaining != 0;
+			off += sizeof(uint32_t)) {
+		probe_word(m, s, ins, off, address, size, readable, stats);
+	}
+	MATCHER_COUNT(stats, s, bytes, (off < size ? off : size));
+}
+
+MATCHER_SPECIALIZED void scan_unaligned(const struct matcher *m, struct matcher_state *s,
+		const uint8_t *ins, uint64_t address, size_t size, size_t readable, bool stats) {
+	size_t off = 0;
+	for (; off < size && s->remaining != 0; off++) {
+		const uint8_t *p = ins + off;
+		size_t left = readable - off;
+		// The short live lists are walked backwards so that removing the current entry,
+		// which moves the last entry into its place, doesn't skip anything.
+		uint32_t *live = &s->short_live[m->short_start[p[0]]];
+		for (uint32_t j = s->short_live_count[p[0]]; j > 0; j--) {
+			check_gadget(m, s, live[j - 1], p, left, address + off, stats);
+		}
+		if (left >= sizeof(uint32_t)) {
+			probe_word(m, s, ins, off, address, size, readable, stats);
+		}
+	}
+	MATCHER_COUNT(stats, s, bytes, off);
+}
+
+void matcher_scan(const struct matcher *m, struct matcher_state *s, const void *data,
+		uint64_t address, size_t size, size_t tail) {
+	const uint8_t *ins = data;
+	size_t readable = size + tail;
+	bool stats = (MATCHER_STATS && s->stats != NULL);
+	if (m->align == sizeof(uint32_t)) {
+		if (stats) {
+			scan_aligned(m, s, ins, address, size, readable, true);
+		} else {
+			scan_aligned(m, s, ins, address, size, readable, false);
+		}
+	} else if (stats) {
+		scan_unaligned(m, s, ins, address, size, readable, true);
+	} else {
+		scan_unaligned(m, s, ins, address, size, readable, false);
+	}
+}
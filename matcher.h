@@ -0,0 +1,411 @@
+#ifndef MACHO_GADGETS__MATCHER_H_
+#define MACHO_GADGETS__MATCHER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * struct gadget
+ *
+ * Description:
+ * 	A byte sequence to search for, along with the address of the lowest match.
+ *
+ * 	If mask is not NULL, it holds size bytes and only the bits set in it need to match; the
+ * 	other bits of data must be clear.
+ */
+struct gadget {
+	const char *name;
+	void *data;
+	const void *mask;
+	size_t size;
+	uint64_t address;
+};
+
+/*
+ * struct matcher_bucket
+ *
+ * Description:
+ * 	An entry in the matcher's dispatch table. All gadgets in a bucket share the same first
+ * 	word under the same dispatch mask. The bucket's trie nodes are the count nodes from start,
+ * 	and npatterns patterns end in them.
+ */
+struct matcher_bucket {
+	uint32_t word;
+	uint32_t mask;
+	uint32_t start;
+	uint32_t count;
+	uint32_t npatterns;
+};
+
+/*
+ * struct matcher_node
+ *
+ * Description:
+ * 	A node of a bucket's prefix trie, matching the word offset bytes from the anchor word under
+ * 	mask. Nodes are stored in preorder, so a node's children follow it and next is the index of
+ * 	the first node after its subtree. Siblings with the same offset are adjacent and sorted by
+ * 	word, and group_end is the index of the first node after the last of them. The patterns
+ * 	that end at the node are the npatterns patterns from pattern, and below is the number of
+ * 	patterns in its subtree.
+ */
+struct matcher_node {
+	uint32_t word;
+	uint32_t mask;
+	int32_t offset;
+	uint32_t next;
+	uint32_t group_end;
+	uint32_t parent;
+	uint32_t pattern;
+	uint32_t npatterns;
+	uint32_t below;
+};
+
+/*
+ * struct matcher_pattern
+ *
+ * Description:
+ * 	A distinct gadget of at least 4 bytes: identical gadgets share one pattern. The pattern's
+ * 	gadgets are the count entries of the matcher's pattern_gadgets array from start, node is
+ * 	the trie node of its last word, and anchor is the offset of its anchor word. Any bytes
+ * 	after its last whole word are compared separately.
+ */
+struct matcher_pattern {
+	uint32_t node;
+	uint32_t start;
+	uint32_t count;
+	uint32_t anchor;
+};
+
+// Build with MATCHER_STATS defined to 0 to compile the scan counters out of the scan loops.
+#ifndef MATCHER_STATS
+#define MATCHER_STATS 1
+#endif
+
+// The maximum number of distinct dispatch masks.
+#define MATCHER_MAX_MASKS 8
+
+/*
+ * enum matcher_kernel
+ *
+ * Description:
+ * 	The implementation of the aligned scan loop.
+ */
+enum matcher_kernel {
+	MATCHER_KERNEL_SCALAR,
+	MATCHER_KERNEL_NEON,
+	MATCHER_KERNEL_AVX2,
+};
+
+/*
+ * struct matcher
+ *
+ * Description:
+ * 	A multi-pattern matcher built from an array of gadgets.
+ *
+ * 	Gadgets of at least 4 bytes are dispatched through an open-addressed hash table keyed on
+ * 	their first 4 bytes, so each position in the scanned data costs a single table probe
+ * 	regardless of the number of gadgets. The few gadgets shorter than 4 bytes are dispatched
+ * 	on their first byte instead.
+ *
+ * 	Identical gadgets are merged into a single pattern, and the patterns of each bucket form a
+ * 	trie over their 32-bit words, so that a candidate position compares each word shared by
+ * 	several gadgets once and gives up on all of them at the first word that differs.
+ *
+ * 	A gadget is dispatched on its anchor word, which is its first word unless the matcher is
+ * 	built with matcher_init_anchored. That picks the rarest word of each aligned gadget in a
+ * 	sample of the data, usually the branch or return at its end, so that fewer positions lead
+ * 	to a trie walk. The trie then checks the words before the anchor, backwards, and then the
+ * 	words after it. max_anchor is the largest offset of an anchor word in a gadget.
+ *
+ * 	If align is 4, only positions whose address is a multiple of 4 are considered, and the
+ * 	gadgets are kept as packed arrays of 32-bit words that are compared a word at a time. This
+ * 	is suitable for fixed-width instruction sets like arm64.
+ *
+ * 	Masked gadgets are dispatched on their first word under a dispatch mask: each position is
+ * 	probed once for each distinct dispatch mask, with the word ANDed with the mask. Gadgets
+ * 	whose first word has the same mask share a dispatch mask, so one masked pattern costs one
+ * 	extra probe. Beyond MATCHER_MAX_MASKS distinct masks, a gadget is dispatched under the
+ * 	largest existing mask contained in its own, or under mask 0 (every position) if there is
+ * 	none. When any gadget is masked, the matcher keeps a mask for every packed word and compares
+ * 	words under their masks.
+ *
+ * 	Aligned scans can also use a SIMD prefilter that checks a block of words at once against
+ * 	nibble tables built from the gadgets' first words, only probing the dispatch table for words
+ * 	that pass. The kernel is chosen at runtime based on the CPU and on how selective the
+ * 	prefilter is for the gadget set. Set kernel to MATCHER_KERNEL_SCALAR after initialization to
+ * 	disable the prefilter.
+ */
+struct matcher {
+	const struct gadget *gadgets;
+	size_t count;
+	size_t max_size;
+	size_t max_anchor;
+	bool masked;
+	unsigned align;
+	uint32_t *words;
+	uint32_t *word_masks;
+	uint32_t *word_start;
+	uint32_t dispatch_masks[MATCHER_MAX_MASKS];
+	unsigned ndispatch_masks;
+	struct matcher_bucket *buckets;
+	uint32_t bucket_mask;
+	uint32_t bucket_shift;
+	uint32_t *gadget_bucket;
+	struct matcher_node *nodes;
+	uint32_t nnodes;
+	struct matcher_pattern *patterns;
+	uint32_t npatterns;
+	uint32_t *pattern_gadgets;
+	uint32_t *gadget_pattern;
+	uint32_t short_start[257];
+	uint32_t *short_gadgets;
+	enum matcher_kernel kernel;
+	uint8_t nibble_lo[4][16];
+	uint8_t nibble_hi[4][16];
+};
+
+/*
+ * matcher_init
+ *
+ * Description:
+ * 	Build a matcher for the given gadgets. The gadgets array must outlive the matcher. The
+ * 	matcher is not modified by scanning, so it may be shared between threads.
+ *
+ * Parameters:
+ * 	out	matcher			The matcher to initialize.
+ * 		gadgets			The gadgets to search for.
+ * 		count			The number of gadgets.
+ * 		align			The alignment of matches, either 1 or 4. If 4, the size
+ * 					of each gadget must be a multiple of 4.
+ *
+ * Returns:
+ * 	True on success, false if memory could not be allocated.
+ */
+bool matcher_init(struct matcher *matcher, const struct gadget *gadgets, size_t count,
+		unsigned align);
+
+/*
+ * matcher_init_anchored
+ *
+ * Description:
+ * 	Build a matcher like matcher_init, but in aligned mode dispatch each gadget on the word
+ * 	that is least common in the sample instead of on its first word. Words with a mask are
+ * 	only chosen if all of the gadget's words have one, and ties go to the later word.
+ *
+ * Parameters:
+ * 	out	matcher			The matcher to initialize.
+ * 		gadgets			The gadgets to search for.
+ * 		count			The number of gadgets.
+ * 		align			The alignment of matches, either 1 or 4.
+ * 		sample			Words sampled from the data that will be scanned, or
+ * 					NULL to dispatch on the first word.
+ * 		nsample			The number of sampled words.
+ *
+ * Returns:
+ * 	True on success, false if memory could not be allocated.
+ */
+bool matcher_init_anchored(struct matcher *matcher, const struct gadget *gadgets, size_t count,
+		unsigned align, const uint32_t *sample, size_t nsample);
+
+/*
+ * matcher_kernel_name
+ *
+ * Description:
+ * 	Returns a human-readable name for the given kernel.
+ */
+const char *matcher_kernel_name(enum matcher_kernel kernel);
+
+/*
+ * matcher_deinit
+ *
+ * Description:
+ * 	Free the resources associated with a matcher.
+ */
+void matcher_deinit(struct matcher *matcher);
+
+/*
+ * matcher_hit_fn
+ *
+ * Description:
+ * 	A callback invoked for each match in all-matches mode.
+ *
+ * Parameters:
+ * 		context			Client context.
+ * 		gadget			The index of the gadget that matched.
+ * 		address			The address of the match.
+ */
+typedef void (*matcher_hit_fn)(void *context, size_t gadget, uint64_t address);
+
+/*
+ * struct matcher_stats
+ *
+ * Description:
+ * 	Counters of the work done by scans, for diagnosing slow scans.
+ *
+ * 	bytes is the number of bytes scanned before the scan stopped. In aligned scans using a SIMD
+ * 	prefilter, prefiltered words were checked by the prefilter and prefilter_hits of them
+ * 	passed. positions is the number of positions looked up in the dispatch table, compares the
+ * 	number of trie words and short gadgets compared at those positions, and matches the number
+ * 	of patterns and short gadgets that matched.
+ */
+struct matcher_stats {
+	uint64_t bytes;
+	uint64_t prefiltered;
+	uint64_t prefilter_hits;
+	uint64_t positions;
+	uint64_t compares;
+	uint64_t matches;
+};
+
+/*
+ * matcher_stats_add
+ *
+ * Description:
+ * 	Add the counters in from to the counters in into.
+ */
+void matcher_stats_add(struct matcher_stats *into, const struct matcher_stats *from);
+
+/*
+ * struct matcher_state
+ *
+ * Description:
+ * 	The results of a scan. Each thread scanning with the same matcher needs its own state.
+ *
+ * 	A gadget is resolved once it is found, after which it is removed from the state's live
+ * 	counts so that later positions only check gadgets that are still unresolved: patterns and
+ * 	trie nodes are skipped once all the gadgets below them are resolved. Scanning stops
+ * 	as soon as no gadgets remain. Since a resolved gadget is never matched again, data should be
+ * 	scanned in order of increasing address so that the first match is the lowest.
+ *
+ * 	In all-matches mode, every match is passed to a callback as it is found rather than only
+ * 	the first being recorded, and a gadget is only resolved once it reaches the optional limit
+ * 	on the number of matches. The addresses array still holds the lowest match of each gadget
+ * 	and hits holds the number of matches.
+ *
+ * 	If stats is not NULL, scans count their work in it. See matcher_state_collect_stats.
+ */
+struct matcher_state {
+	uint64_t *addresses;
+	bool *resolved;
+	size_t remaining;
+	uint32_t *live_count;
+	uint32_t *node_live;
+	uint32_t *pattern_live;
+	uint32_t *short_live;
+	uint32_t short_live_count[256];
+	matcher_hit_fn hit;
+	void *hit_context;
+	size_t max_hits;
+	size_t *hits;
+	struct matcher_stats *stats;
+};
+
+/*
+ * matcher_state_init
+ *
+ * Description:
+ * 	Initialize a scan state for the given matcher with no gadgets found.
+ *
+ * Returns:
+ * 	True on success, false if memory could not be allocated.
+ */
+bool matcher_state_init(struct matcher_state *state, const struct matcher *matcher);
+
+/*
+ * matcher_state_deinit
+ *
+ * Description:
+ * 	Free the resources associated with a scan state.
+ */
+void matcher_state_deinit(struct matcher_state *state);
+
+/*
+ * matcher_state_report_all
+ *
+ * Description:
+ * 	Switch the state to all-matches mode.
+ *
+ * Parameters:
+ * 		state			The scan state.
+ * 		hit			The callback to invoke for each match.
+ * 		context			Client context for the callback.
+ * 		max_hits		The maximum number of matches to report for each gadget,
+ * 					or 0 for no limit.
+ */
+void matcher_state_report_all(struct matcher_state *state, matcher_hit_fn hit, void *context,
+		size_t max_hits);
+
+/*
+ * matcher_state_collect_stats
+ *
+ * Description:
+ * 	Count the work done by scans with this state in the given counters, which are not reset.
+ * 	Scans without counters run a copy of the scan loops with no counting code. If the matcher
+ * 	was built with MATCHER_STATS set to 0, the counters are left untouched.
+ */
+void matcher_state_collect_stats(struct matcher_state *state, struct matcher_stats *stats);
+
+/*
+ * matcher_state_report
+ *
+ * Description:
+ * 	Report a match of the given gadget. In all-matches mode, this invokes the callback unless
+ * 	the gadget has already reached its limit. Otherwise it is the same as
+ * 	matcher_state_record.
+ */
+void matcher_state_report(const struct matcher *matcher, struct matcher_state *state,
+		size_t gadget, uint64_t address);
+
+/*
+ * matcher_state_record
+ *
+ * Description:
+ * 	Record a match of the given gadget, keeping the lower address if the gadget was already
+ * 	found, and resolve the gadget.
+ */
+void matcher_state_record(const struct matcher *matcher, struct matcher_state *state,
+		size_t gadget, uint64_t address);
+
+/*
+ * matcher_state_drop
+ *
+ * Description:
+ * 	Resolve the given gadget without recording a match, so that it is no longer searched for.
+ * 	This is used when a lower match is already known elsewhere.
+ */
+void matcher_state_drop(const struct matcher *matcher, struct matcher_state *state,
+		size_t gadget);
+
+/*
+ * matcher_state_merge
+ *
+ * Description:
+ * 	Merge the results of one scan state into another, keeping the lowest address found for
+ * 	each gadget.
+ */
+void matcher_state_merge(const struct matcher *matcher, struct matcher_state *into,
+		const struct matcher_state *from);
+
+/*
+ * matcher_scan
+ *
+ * Description:
+ * 	Scan a block of data for the unresolved gadgets in the state, recording and resolving each
+ * 	gadget at its first match. In aligned mode, matches are only reported at addresses that are
+ * 	a multiple of the alignment.
+ *
+ * Parameters:
+ * 		matcher			The matcher.
+ * 		state			The scan state to update.
+ * 		data			The data to scan.
+ * 		address			The runtime address of the data.
+ * 		size			The size of the data. Only matches starting in the first
+ * 					size bytes are reported.
+ * 		tail			The number of readable bytes following the data that a
+ * 					match may extend into.
+ */
+void matcher_scan(const struct matcher *matcher, struct matcher_state *state,
+		const void *data, uint64_t address, size_t size, size_t tail);
+
+#endif
@@ -0,0 +1,86 @@
+#include "output.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+bool output_init(struct output *out, int fd, size_t capacity) {
+	out->fd = fd;
+	out->buffer = malloc(capacity);
+	out->capacity = capacity;
+	out->size = 0;
+	out->failed = false;
+	return (out->buffer != NULL);
+}
+
+bool output_deinit(struct output *out) {
+	bool success = output_flush(out);
+	free(out->buffer);
+	out->buffer = NULL;
+	return success;
+}
+
+static void write_all(struct output *out, const void *data, size_t size) {
+	const char *p = data;
+	while (!out->failed && size > 0) {
+		ssize_t written = write(out->fd, p, size);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			out->failed = true;
+			break;
+		}
+		p += written;
+		size -= written;
+	}
+}
+
+bool output_flush(struct output *out) {
+	write_all(out, out->buffer, out->size);
+	out->size = 0;
+	return !out->failed;
+}
+
+void output_write(struct output *out, const void *data, size_t size) {
+	if (out->size + size > out->capacity) {
+		output_flush(out);
+		// Data too large to buffer is written directly.
+		if (size > out->capacity) {
+			write_all(out, data, size);
+			return;
+		}
+	}
+	memcpy(out->buffer + out->size, data, size);
+	out->size += size;
+}
+
+void output_printf(struct output *out, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	size_t left = out->capacity - out->size;
+	int len = vsnprintf(out->buffer + out->size, left, fmt, ap);
+	va_end(ap);
+	if (len < 0) {
+		out->failed = true;
+		return;
+	}
+	if ((size_t)len < left) {
+		out->size += len;
+		return;
+	}
+	// The text didn't fit. Format it again into a buffer of the right size.
+	char *text = malloc(len + 1);
+	if (text == NULL) {
+		out->failed = true;
+		return;
+	}
+	va_start(ap, fmt);
+	vsnprintf(text, len + 1, fmt, ap);
+	va_end(ap);
+	output_write(out, text, len);
+	free(text);
+}
@@ -0,0 +1,77 @@
+#ifndef MACHO_GADGETS__OUTPUT_H_
+#define MACHO_GADGETS__OUTPUT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * struct output
+ *
+ * Description:
+ * 	A buffered writer to a file descriptor. Data is accumulated in memory and written out in
+ * 	large blocks, so that streaming many small records costs few system calls.
+ */
+struct output {
+	int fd;
+	char *buffer;
+	size_t capacity;
+	size_t size;
+	bool failed;
+};
+
+/*
+ * output_init
+ *
+ * Description:
+ * 	Initialize a buffered writer.
+ *
+ * Parameters:
+ * 	out	out			The writer to initialize.
+ * 		fd			The file descriptor to write to.
+ * 		capacity		The size of the buffer.
+ *
+ * Returns:
+ * 	True on success, false if memory could not be allocated.
+ */
+bool output_init(struct output *out, int fd, size_t capacity);
+
+/*
+ * output_deinit
+ *
+ * Description:
+ * 	Flush and free a buffered writer.
+ *
+ * Returns:
+ * 	True if all the data was written successfully.
+ */
+bool output_deinit(struct output *out);
+
+/*
+ * output_write
+ *
+ * Description:
+ * 	Append data to the writer.
+ */
+void output_write(struct output *out, const void *data, size_t size);
+
+/*
+ * output_printf
+ *
+ * Description:
+ * 	Append formatted text to the writer.
+ */
+void output_printf(struct output *out, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/*
+ * output_flush
+ *
+ * Description:
+ * 	Write out all buffered data.
+ *
+ * Returns:
+ * 	True if all the data so far was written successfully.
+ */
+bool output_flush(struct output *out);
+
+#endif
@@ -0,0 +1,257 @@
+#include "range_list.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void set_error(struct range_list *list, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void set_error(struct range_list *list, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(list->error, sizeof(list->error), fmt, ap);
+	va_end(ap);
+}
+
+// The Mach-O routines report errors through macho_error, which programs may define. This
+// default keeps the message so that it can be included in the list's error.
+static _Thread_local char macho_error_message[128];
+
+void range_list_record_macho_error(const char *fmt, va_list ap) {
+	vsnprintf(macho_error_message, sizeof(macho_error_message), fmt, ap);
+}
+
+const char *range_list_macho_error(void) {
+	return macho_error_message;
+}
+
+__attribute__((weak))
+void macho_error(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	range_list_record_macho_error(fmt, ap);
+	va_end(ap);
+}
+
+void range_list_init(struct range_list *list) {
+	memset(list, 0, sizeof(*list));
+}
+
+static bool add_range(struct range_list *list, const char *name, const void *data,
+		uint64_t address, size_t size) {
+	if (list->count == list->capacity) {
+		size_t capacity = (list->capacity == 0 ? 16 : 2 * list->capacity);
+		struct scan_range *ranges = realloc(list->ranges, capacity * sizeof(*ranges));
+		if (ranges != NULL) {
+			list->ranges = ranges;
+		}
+		const char **names = realloc(list->names, capacity * sizeof(*names));
+		if (names != NULL) {
+			list->names = names;
+		}
+		if (ranges == NULL || names == NULL) {
+			set_error(list, "Could not allocate scan ranges");
+			return false;
+		}
+		list->capacity = capacity;
+	}
+	list->names[list->count] = name;
+	struct scan_range *r = &list->ranges[list->count++];
+	r->data = data;
+	r->address = address;
+	r->size = size;
+	return true;
+}
+
+// Add the parts of the range that lie in the filter's address ranges.
+static bool add_filtered_range(struct range_list *list, const char *name, const void *data,
+		uint64_t address, size_t size) {
+	const struct range_filter *filter = list->filter;
+	if (filter == NULL || filter->naddresses == 0) {
+		return add_range(list, name, data, address, size);
+	}
+	uint64_t end = address + size;
+	for (size_t i = 0; i < filter->naddresses; i++) {
+		uint64_t start = filter->addresses[i].start;
+		uint64_t stop = filter->addresses[i].end;
+		start = (start > address ? start : address);
+		stop = (stop < end ? stop : end);
+		if (start >= stop) {
+			continue;
+		}
+		const void *part = (data == NULL ? NULL
+				: (const uint8_t *)data + (start - address));
+		if (!add_range(list, name, part, start, stop - start)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Check whether the section matches any of the names, which are "SEGMENT" or
+// "SEGMENT,SECTION". The segname and sectname fields may not be NUL-terminated.
+static bool section_named(const char *segname, const char *sectname, const char **names,
+		size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		const char *comma = strchr(names[i], ',');
+		size_t seglen = (comma == NULL ? strlen(names[i]) : (size_t)(comma - names[i]));
+		if (strnlen(segname, 16) != seglen || memcmp(segname, names[i], seglen) != 0) {
+			continue;
+		}
+		if (comma == NULL) {
+			return true;
+		}
+		size_t sectlen = strlen(comma + 1);
+		if (strnlen(sectname, 16) == sectlen && memcmp(sectname, comma + 1, sectlen) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Add the sections of the segment that the filter selects.
+static bool add_sections(struct range_list *list, const struct macho *macho,
+		const struct load_command *segment) {
+	const struct range_filter *filter = list->filter;
+	const uint32_t code = S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS;
+	// Nothing describes the contents of a segment without sections, so it is added whole
+	// unless it is left out by name.
+	if (macho_next_section(macho, segment, NULL) == NULL) {
+		const char *segname = ((const struct segment_command_64 *)segment)->segname;
+		if ((filter->ninclude > 0 && !section_named(segname, "", filter->include,
+					filter->ninclude))
+				|| section_named(segname, "", filter->exclude, filter->nexclude)) {
+			return true;
+		}
+		const void *data;
+		uint64_t address;
+		size_t size;
+		macho_segment_data(macho, segment, &data, &address, &size);
+		return add_filtered_range(list, segname, data, address, size);
+	}
+	// Sections that are named explicitly are added whatever their attributes. If none of the
+	// segment's sections is marked as holding instructions, the attributes were left out when
+	// it was built, so they are ignored.
+	bool check_code = !filter->any_section && filter->ninclude == 0;
+	const void *section = NULL;
+	if (check_code) {
+		check_code = false;
+		while ((section = macho_next_section(macho, segment, section)) != NULL) {
+			if ((macho_section_flags(macho, section) & code) != 0) {
+				check_code = true;
+				break;
+			}
+		}
+		section = NULL;
+	}
+	for (;;) {
+		section = macho_next_section(macho, segment, section);
+		if (section == NULL) {
+			break;
+		}
+		// The name fields are at the same offsets in struct section and struct section_64.
+		const struct section_64 *sect = section;
+		if (check_code && (macho_section_flags(macho, section) & code) == 0) {
+			continue;
+		}
+		if (filter->ninclude > 0 && !section_named(sect->segname, sect->sectname,
+					filter->include, filter->ninclude)) {
+			continue;
+		}
+		if (section_named(sect->segname, sect->sectname, filter->exclude,
+					filter->nexclude)) {
+			continue;
+		}
+		const void *data;
+		uint64_t address;
+		size_t size;
+		macho_section_data(macho, segment, section, &data, &address, &size);
+		if (size > 0 && !add_filtered_range(list, sect->segname, data, address, size)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool range_list_add_macho(struct range_list *list, const struct macho *macho) {
+	const struct load_command *lc = NULL;
+	for (;;) {
+		lc = macho_next_segment(macho, lc);
+		if (lc == NULL) {
+			break;
+		}
+		const int prot = VM_PROT_READ | VM_PROT_EXECUTE;
+		// The name is at the same offset in both widths, but the protections aren't.
+		const struct segment_command_64 *sc = (const struct segment_command_64 *)lc;
+		int initprot, maxprot;
+		if (macho_is_64(macho)) {
+			initprot = sc->initprot;
+			maxprot = sc->maxprot;
+		} else {
+			initprot = ((const struct segment_command *)lc)->initprot;
+			maxprot = ((const struct segment_command *)lc)->maxprot;
+		}
+		if ((initprot & prot) != prot || (maxprot & prot) != prot) {
+			continue;
+		}
+		if (list->filter != NULL && list->filter->sections) {
+			if (!add_sections(list, macho, lc)) {
+				return false;
+			}
+			continue;
+		}
+		const void *data;
+		uint64_t address;
+		size_t size;
+		macho_segment_data(macho, lc, &data, &address, &size);
+		if (!add_filtered_range(list, sc->segname, data, address, size)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool range_list_add_fileset(struct range_list *list, const struct macho *fileset,
+		const char **entry_ids, size_t count) {
+	struct macho entry;
+	for (size_t i = 0; i < count; i++) {
+		macho_result result = macho_find_fileset_entry(fileset, entry_ids[i], &entry);
+		if (result == MACHO_NOT_FOUND) {
+			set_error(list, "No fileset entry '%s'", entry_ids[i]);
+			return false;
+		} else if (result != MACHO_SUCCESS) {
+			set_error(list, "Malformed fileset entry '%s': %s", entry_ids[i],
+					macho_error_message);
+			return false;
+		}
+		if (!range_list_add_macho(list, &entry)) {
+			return false;
+		}
+	}
+	const struct load_command *lc = NULL;
+	while (count == 0) {
+		lc = macho_find_load_command(fileset, lc, LC_FILESET_ENTRY);
+		if (lc == NULL) {
+			break;
+		}
+		if (macho_fileset_entry(fileset, lc, &entry, NULL) != MACHO_SUCCESS) {
+			set_error(list, "Malformed fileset entry: %s", macho_error_message);
+			return false;
+		}
+		if (!range_list_add_macho(list, &entry)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void range_list_free(struct range_list *list) {
+	free(list->ranges);
+	free(list->names);
+	list->ranges = NULL;
+	list->names = NULL;
+	list->count = 0;
+	list->capacity = 0;
+}
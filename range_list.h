@@ -0,0 +1,135 @@
+#ifndef MACHO_GADGETS__RANGE_LIST_H_
+#define MACHO_GADGETS__RANGE_LIST_H_
+
+#include "macho.h"
+#include "scan.h"
+
+#include <stdarg.h>
+
+/*
+ * struct address_range
+ *
+ * Description:
+ * 	The addresses from start up to but not including end.
+ */
+struct address_range {
+	uint64_t start;
+	uint64_t end;
+};
+
+/*
+ * struct range_filter
+ *
+ * Description:
+ * 	Narrows the executable segments added to a range list down to the parts worth scanning.
+ *
+ * 	If sections is true, the sections of each executable segment are added instead of the
+ * 	whole segment, skipping the padding between them. A section is added if include names it,
+ * 	or, if include is empty, if it has S_ATTR_PURE_INSTRUCTIONS or S_ATTR_SOME_INSTRUCTIONS
+ * 	(or any_section is true), and if exclude doesn't name it. Names are either "SEGMENT",
+ * 	which names every section of the segment, or "SEGMENT,SECTION". The attributes are
+ * 	ignored in a segment where no section has them, and segments without sections are added
+ * 	whole.
+ *
+ * 	If there are address ranges, only the parts of the segments or sections that lie in one of
+ * 	them are added. The address ranges must be sorted and must not overlap.
+ */
+struct range_filter {
+	bool sections;
+	bool any_section;
+	const char **include;
+	size_t ninclude;
+	const char **exclude;
+	size_t nexclude;
+	const struct address_range *addresses;
+	size_t naddresses;
+};
+
+/*
+ * struct range_list
+ *
+ * Description:
+ * 	A growable array of the executable ranges of a Mach-O file to scan, along with the name of
+ * 	the segment of each range. The names are the segname fields of the load commands, so they
+ * 	may not be NUL-terminated.
+ *
+ * 	If filter is not NULL, only the parts of the segments it selects are added. It is NULL
+ * 	after range_list_init.
+ */
+struct range_list {
+	struct scan_range *ranges;
+	const char **names;
+	size_t count;
+	size_t capacity;
+	const struct range_filter *filter;
+	// A description of the last error.
+	char error[256];
+};
+
+/*
+ * range_list_init
+ *
+ * Description:
+ * 	Initialize an empty range list.
+ */
+void range_list_init(struct range_list *list);
+
+/*
+ * range_list_add_macho
+ *
+ * Description:
+ * 	Add the segments of the Mach-O file that are both readable and executable to the list, or
+ * 	the parts of them selected by the list's filter.
+ *
+ * Returns:
+ * 	True on success. On failure, the list's error describes the problem.
+ */
+bool range_list_add_macho(struct range_list *list, const struct macho *macho);
+
+/*
+ * range_list_add_fileset
+ *
+ * Description:
+ * 	Add the executable segments of the given entries of an MH_FILESET Mach-O file to the list,
+ * 	or of every entry if none are given. The load commands of all the entries must be
+ * 	readable.
+ *
+ * Parameters:
+ * 		list			The range list.
+ * 		fileset			The macho struct of the fileset.
+ * 		entry_ids		The identifiers of the entries to add.
+ * 		count			The number of identifiers.
+ *
+ * Returns:
+ * 	True on success. On failure, the list's error describes the problem.
+ */
+bool range_list_add_fileset(struct range_list *list, const struct macho *fileset,
+		const char **entry_ids, size_t count);
+
+/*
+ * range_list_record_macho_error
+ *
+ * Description:
+ * 	Record a message reported through macho_error on this thread, so that it can be included
+ * 	in the errors of range lists and other callers. The default macho_error does this; a
+ * 	program that defines its own macho_error but doesn't exit should call it too.
+ */
+void range_list_record_macho_error(const char *fmt, va_list ap);
+
+/*
+ * range_list_macho_error
+ *
+ * Description:
+ * 	The last message recorded by range_list_record_macho_error on this thread.
+ */
+const char *range_list_macho_error(void);
+
+/*
+ * range_list_free
+ *
+ * Description:
+ * 	Free the range list.
+ */
+void range_list_free(struct range_list *list);
+
+#endif
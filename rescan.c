@@ -0,0 +1,213 @@
+#include "rescan.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Compare each block of the segment with the same block of its base segment. A block is
+// unchanged only if both segments have all of it and its contents are the same.
+static void compare_blocks(struct rescan_segment *seg, const struct gadget_index *base) {
+	const uint8_t *base_data = NULL;
+	size_t base_size = 0;
+	if (seg->base != NULL) {
+		base_data = (const uint8_t *)&base->words[seg->base->first_position];
+		base_size = seg->base->npositions * sizeof(*base->words);
+	}
+	for (size_t b = 0; b < seg->nblocks; b++) {
+		size_t offset = b * RESCAN_BLOCK_SIZE;
+		size_t size = seg->size - offset;
+		if (size > RESCAN_BLOCK_SIZE) {
+			size = RESCAN_BLOCK_SIZE;
+		}
+		size_t base_block = (offset < base_size ? base_size - offset : 0);
+		if (base_block > RESCAN_BLOCK_SIZE) {
+			base_block = RESCAN_BLOCK_SIZE;
+		}
+		seg->changed[b] = (size != base_block
+				|| memcmp(seg->data + offset, base_data + offset, size) != 0);
+	}
+}
+
+static bool add_range(struct rescan *rescan, size_t *capacity, size_t segment, size_t start,
+		size_t end) {
+	const struct rescan_segment *seg = &rescan->segments[segment];
+	// Extend the last range if the two overlap.
+	if (rescan->nranges > 0 && rescan->range_segment[rescan->nranges - 1] == segment) {
+		struct scan_range *last = &rescan->ranges[rescan->nranges - 1];
+		if (seg->address + start <= last->address + last->size) {
+			last->size = seg->address + end - last->address;
+			return true;
+		}
+	}
+	if (rescan->nranges == *capacity) {
+		size_t new_capacity = (*capacity == 0 ? 16 : 2 * *capacity);
+		struct scan_range *ranges = realloc(rescan->ranges,
+				new_capacity * sizeof(*ranges));
+		if (ranges != NULL) {
+			rescan->ranges = ranges;
+		}
+		size_t *range_segment = realloc(rescan->range_segment,
+				new_capacity * sizeof(*range_segment));
+		if (range_segment != NULL) {
+			rescan->range_segment = range_segment;
+		}
+		if (ranges == NULL || range_segment == NULL) {
+			return false;
+		}
+		*capacity = new_capacity;
+	}
+	rescan->ranges[rescan->nranges].data = seg->data + start;
+	rescan->ranges[rescan->nranges].address = seg->address + start;
+	rescan->ranges[rescan->nranges].size = end - start;
+	rescan->range_segment[rescan->nranges++] = segment;
+	return true;
+}
+
+bool rescan_init(struct rescan *rescan, const struct gadget_index *base,
+		const struct matcher *matcher, const struct scan_range *ranges, size_t count) {
+	memset(rescan, 0, sizeof(*rescan));
+	rescan->base = base;
+	rescan->segments = calloc(count + 1, sizeof(*rescan->segments));
+	if (rescan->segments == NULL) {
+		return false;
+	}
+	rescan->nsegments = count;
+	// Sort the ranges by address with an insertion sort, since there are only a few.
+	for (size_t i = 0; i < count; i++) {
+		size_t j = i;
+		while (j > 0 && ranges[rescan->segments[j - 1].range].address > ranges[i].address) {
+			rescan->segments[j].range = rescan->segments[j - 1].range;
+			j--;
+		}
+		rescan->segments[j].range = i;
+	}
+	bool paired = (count == base->header->nsegments);
+	// Take the aligned words of each range, just as the index does.
+	for (size_t i = 0; i < count; i++) {
+		struct rescan_segment *seg = &rescan->segments[i];
+		const struct scan_range *range = &ranges[seg->range];
+		uint64_t skip = (4 - range->address % 4) % 4;
+		seg->base = (paired ? &base->segments[i] : NULL);
+		seg->data = (const uint8_t *)range->data + skip;
+		seg->address = range->address + skip;
+		seg->size = (range->size > skip ? (range->size - skip) / 4 * 4 : 0);
+		seg->nblocks = (seg->size + RESCAN_BLOCK_SIZE - 1) / RESCAN_BLOCK_SIZE;
+		seg->changed = malloc(seg->nblocks + 1);
+		if (seg->changed == NULL) {
+			rescan_free(rescan);
+			return false;
+		}
+		compare_blocks(seg, base);
+	}
+	// Scan each run of changed blocks, widened so that every match that touches the run is
+	// found: starting early catches matches that end in the run, and ending late lets
+	// matches that start in the run be compared in full.
+	size_t overlap = (matcher->max_size > 0 ? (matcher->max_size - 1 + 3) / 4 * 4 : 0);
+	size_t capacity = 0;
+	for (size_t i = 0; i < count; i++) {
+		const struct rescan_segment *seg = &rescan->segments[i];
+		for (size_t b = 0; b < seg->nblocks; b++) {
+			if (!seg->changed[b]) {
+				continue;
+			}
+			size_t end_block = b + 1;
+			while (end_block < seg->nblocks && seg->changed[end_block]) {
+				end_block++;
+			}
+			size_t start = b * RESCAN_BLOCK_SIZE;
+			size_t end = end_block * RESCAN_BLOCK_SIZE;
+			if (end > seg->size) {
+				end = seg->size;
+			}
+			rescan->changed_bytes += end - start;
+			start = (start > overlap ? start - overlap : 0);
+			end = (seg->size - end > overlap ? end + overlap : seg->size);
+			if (!add_range(rescan, &capacity, i, start, end)) {
+				rescan_free(rescan);
+				return false;
+			}
+			b = end_block;
+		}
+	}
+	return true;
+}
+
+struct reuse_context {
+	const struct rescan *rescan;
+	const struct matcher *matcher;
+	// The state used to walk the base's matches, and the caller's state.
+	struct matcher_state *base_state;
+	struct matcher_state *state;
+};
+
+// Find the segment of the base index containing the address.
+static size_t find_base_segment(const struct gadget_index *base, uint64_t address) {
+	size_t lo = 0;
+	size_t hi = base->header->nsegments;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (base->segments[mid].address <= address) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Called with the matches of a gadget in the base in address order. The first one in unchanged
+// blocks is the lowest whose rebased address is valid in the new image.
+static void reuse_hit(void *context, size_t gadget, uint64_t address) {
+	struct reuse_context *rc = context;
+	const struct rescan_segment *seg =
+		&rc->rescan->segments[find_base_segment(rc->rescan->base, address)];
+	uint64_t offset = address - seg->base->address;
+	uint64_t rebased = seg->address + offset;
+	// Segments stay in order, so no later match can beat one the scan already found.
+	uint64_t found = rc->state->addresses[gadget];
+	if (found != 0 && rebased >= found) {
+		matcher_state_drop(rc->matcher, rc->base_state, gadget);
+		return;
+	}
+	size_t size = rc->matcher->gadgets[gadget].size;
+	if (offset + size > seg->size) {
+		return;
+	}
+	for (size_t b = offset / RESCAN_BLOCK_SIZE; b <= (offset + size - 1) / RESCAN_BLOCK_SIZE;
+			b++) {
+		if (seg->changed[b]) {
+			return;
+		}
+	}
+	matcher_state_record(rc->matcher, rc->state, gadget, rebased);
+	matcher_state_drop(rc->matcher, rc->base_state, gadget);
+}
+
+bool rescan_reuse(const struct rescan *rescan, const struct matcher *matcher,
+		struct matcher_state *state) {
+	if (rescan->nsegments == 0 || rescan->segments[0].base == NULL) {
+		return true;
+	}
+	struct matcher_state base_state;
+	if (!matcher_state_init(&base_state, matcher)) {
+		return false;
+	}
+	struct reuse_context context = { rescan, matcher, &base_state, state };
+	matcher_state_report_all(&base_state, reuse_hit, &context, 0);
+	bool success = gadget_index_scan(rescan->base, matcher, &base_state, NULL, 0);
+	matcher_state_deinit(&base_state);
+	return success;
+}
+
+void rescan_free(struct rescan *rescan) {
+	for (size_t i = 0; rescan->segments != NULL && i < rescan->nsegments; i++) {
+		free(rescan->segments[i].changed);
+	}
+	free(rescan->segments);
+	free(rescan->ranges);
+	free(rescan->range_segment);
+	rescan->segments = NULL;
+	rescan->ranges = NULL;
+	rescan->range_segment = NULL;
+	rescan->nsegments = 0;
+	rescan->nranges = 0;
+}
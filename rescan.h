@@ -0,0 +1,97 @@
+#ifndef MACHO_GADGETS__RESCAN_H_
+#define MACHO_GADGETS__RESCAN_H_
+
+#include "gadget_index.h"
+
+// The size of the blocks that are compared between the base and the new image.
+#define RESCAN_BLOCK_SIZE 0x4000
+
+/*
+ * struct rescan_segment
+ *
+ * Description:
+ * 	An executable segment of the new image, paired with the segment of the base index at the
+ * 	same position in address order. range is the index of the segment's range in the caller's
+ * 	array, and changed has one entry per block of the segment's aligned words.
+ */
+struct rescan_segment {
+	size_t range;
+	const struct gadget_index_segment *base;
+	const uint8_t *data;
+	uint64_t address;
+	size_t size;
+	bool *changed;
+	size_t nblocks;
+};
+
+/*
+ * struct rescan
+ *
+ * Description:
+ * 	A plan for scanning a new build of an image incrementally against the gadget index of an
+ * 	earlier build, the base.
+ *
+ * 	Each executable segment of the new image is compared block by block with the words of the
+ * 	corresponding segment in the base. Only the changed blocks, widened by the length of the
+ * 	longest gadget minus one on either side, need to be scanned; the matches that lie entirely
+ * 	in unchanged blocks are taken from the base index and rebased by the difference between the
+ * 	segments' addresses. Segments are paired in address order, so if the number of segments
+ * 	differs, every block is treated as changed.
+ *
+ * 	ranges holds the parts of the new image to scan, in address order, and range_segment the
+ * 	index of the segment each belongs to.
+ */
+struct rescan {
+	const struct gadget_index *base;
+	struct rescan_segment *segments;
+	size_t nsegments;
+	struct scan_range *ranges;
+	size_t *range_segment;
+	size_t nranges;
+	uint64_t changed_bytes;
+};
+
+/*
+ * rescan_init
+ *
+ * Description:
+ * 	Compare the new image's executable ranges with the base index and find the parts that need
+ * 	to be scanned.
+ *
+ * Parameters:
+ * 	out	rescan			The rescan plan.
+ * 		base			The gadget index of the earlier build.
+ * 		matcher			The aligned matcher that will be used for the scan.
+ * 		ranges			The executable ranges of the new image.
+ * 		count			The number of ranges.
+ *
+ * Returns:
+ * 	True on success, false if memory could not be allocated.
+ */
+bool rescan_init(struct rescan *rescan, const struct gadget_index *base,
+		const struct matcher *matcher, const struct scan_range *ranges, size_t count);
+
+/*
+ * rescan_reuse
+ *
+ * Description:
+ * 	Find the lowest match of each gadget that lies entirely in unchanged blocks, according to
+ * 	the base index, and record it in the state at its address in the new image, keeping the
+ * 	lower address if the gadget was already found. Called after the plan's ranges have been
+ * 	scanned into the same state, this gives the lowest match of each gadget in the new image.
+ *
+ * Returns:
+ * 	True on success, false if memory could not be allocated.
+ */
+bool rescan_reuse(const struct rescan *rescan, const struct matcher *matcher,
+		struct matcher_state *state);
+
+/*
+ * rescan_free
+ *
+ * Description:
+ * 	Free the rescan plan.
+ */
+void rescan_free(struct rescan *rescan);
+
+#endif
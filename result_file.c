@@ -0,0 +1,54 @@
+#include "result_file.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+bool result_file_write(struct output *out, const char *image, const struct gadget *gadgets,
+		size_t count, const struct result_file_record *records, size_t nrecords) {
+	// The string pool starts with the image path, followed by each gadget's name.
+	uint32_t *name_offsets = malloc(count * sizeof(*name_offsets) + 1);
+	if (name_offsets == NULL) {
+		return false;
+	}
+	uint64_t strings_size = strlen(image) + 1;
+	for (size_t i = 0; i < count; i++) {
+		name_offsets[i] = strings_size;
+		strings_size += strlen(gadgets[i].name) + 1;
+	}
+	uint64_t records_offset = sizeof(struct result_file_header);
+	uint64_t strings_offset = records_offset + nrecords * sizeof(*records);
+	if (strings_size > UINT32_MAX || nrecords > UINT32_MAX) {
+		free(name_offsets);
+		return false;
+	}
+	uint8_t *file = malloc(strings_offset + strings_size);
+	if (file == NULL) {
+		free(name_offsets);
+		return false;
+	}
+	struct result_file_header header = {
+		.magic = RESULT_FILE_MAGIC,
+		.version = RESULT_FILE_VERSION,
+		.nrecords = nrecords,
+		.image_offset = 0,
+		.records_offset = records_offset,
+		.strings_offset = strings_offset,
+		.strings_size = strings_size,
+	};
+	memcpy(file, &header, sizeof(header));
+	struct result_file_record *file_records = (struct result_file_record *)
+		(file + records_offset);
+	for (size_t i = 0; i < nrecords; i++) {
+		file_records[i] = records[i];
+		file_records[i].name_offset = name_offsets[records[i].gadget];
+	}
+	char *strings = (char *)(file + strings_offset);
+	strcpy(strings, image);
+	for (size_t i = 0; i < count; i++) {
+		strcpy(strings + name_offsets[i], gadgets[i].name);
+	}
+	output_write(out, file, strings_offset + strings_size);
+	free(file);
+	free(name_offsets);
+	return true;
+}
@@ -0,0 +1,70 @@
+#ifndef MACHO_GADGETS__RESULT_FILE_H_
+#define MACHO_GADGETS__RESULT_FILE_H_
+
+#include "matcher.h"
+#include "output.h"
+
+/*
+ * struct result_file_header
+ *
+ * Description:
+ * 	The header of a binary result file, as written by --format=bin.
+ *
+ * 	The header is followed by nrecords records at records_offset and a pool of NUL-terminated
+ * 	strings at strings_offset. The pool holds the image path, at image_offset, and the name of
+ * 	each gadget once. Records are 8-byte aligned, so that the file can be mapped and read in
+ * 	place.
+ *
+ * 	The file is native-endian.
+ */
+struct result_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nrecords;
+	uint32_t image_offset;
+	uint64_t records_offset;
+	uint64_t strings_offset;
+	uint64_t strings_size;
+};
+
+#define RESULT_FILE_MAGIC	0x73657267	// 'gres'
+#define RESULT_FILE_VERSION	1
+
+/*
+ * struct result_file_record
+ *
+ * Description:
+ * 	A record in a binary result file. name_offset is the offset of the gadget's name in the
+ * 	string pool, gadget is its index in the order the gadgets were given, and matches is the
+ * 	number of matches of the gadget that were reported. A gadget that wasn't found has one
+ * 	record with address 0.
+ */
+struct result_file_record {
+	uint32_t name_offset;
+	uint32_t gadget;
+	uint64_t address;
+	uint64_t matches;
+};
+
+/*
+ * result_file_write
+ *
+ * Description:
+ * 	Write a binary result file. The whole file is laid out in memory and written at once.
+ *
+ * Parameters:
+ * 		out			The writer.
+ * 		image			The path of the image that was scanned.
+ * 		gadgets			The gadgets.
+ * 		count			The number of gadgets.
+ * 		records			The records to write. The name offsets are filled in.
+ * 		nrecords		The number of records.
+ *
+ * Returns:
+ * 	True on success, false if memory could not be allocated or the file is too large for
+ * 	32-bit offsets.
+ */
+bool result_file_write(struct output *out, const char *image, const struct gadget *gadgets,
+		size_t count, const struct result_file_record *records, size_t nrecords);
+
+#endif
@@ -0,0 +1,399 @@
+#include "scan.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The amount of new data in each chunk handed to a worker thread.
+#define SCAN_CHUNK_SIZE (1 << 20)
+
+// The largest number of consecutive words in each block taken by scan_sample.
+#define SCAN_SAMPLE_BLOCK 1024
+
+struct scan_chunk {
+	const uint8_t *data;
+	uint64_t address;
+	size_t size;
+	size_t tail;
+	// The index of the range the chunk belongs to in the caller's array.
+	size_t range;
+};
+
+// A range along with its index in the caller's array, so that the ranges can be sorted.
+struct sorted_range {
+	struct scan_range range;
+	size_t index;
+};
+
+// A match buffered by a worker in all-matches mode.
+struct scan_hit {
+	uint32_t gadget;
+	uint64_t address;
+};
+
+struct scan_hits {
+	struct scan_hit *hits;
+	size_t count;
+	size_t capacity;
+	bool done;
+};
+
+struct scan_pool {
+	const struct matcher *matcher;
+	const struct scan_chunk *chunks;
+	size_t count;
+	atomic_size_t next;
+	// The lowest address found for each gadget by any worker, and the number of gadgets
+	// that no worker has found yet.
+	_Atomic uint64_t *best;
+	atomic_size_t unresolved;
+	// In all-matches mode, the caller's state, the matches buffered for each chunk, and the
+	// next chunk whose matches should be passed to the caller's state.
+	struct matcher_state *state;
+	struct scan_hits *hits;
+	size_t next_report;
+	pthread_mutex_t lock;
+	atomic_bool failed;
+	scan_wait_fn wait;
+	void *wait_context;
+	// When collecting stats, the number of bytes scanned in each chunk.
+	uint64_t *chunk_bytes;
+};
+
+struct scan_worker {
+	struct scan_pool *pool;
+	struct matcher_state state;
+	struct matcher_stats stats;
+	struct scan_hits *chunk_hits;
+	pthread_t thread;
+	bool started;
+};
+
+static void buffer_hit(void *context, size_t gadget, uint64_t address) {
+	struct scan_worker *worker = context;
+	struct scan_hits *hits = worker->chunk_hits;
+	if (hits->count == hits->capacity) {
+		size_t capacity = (hits->capacity == 0 ? 256 : 2 * hits->capacity);
+		struct scan_hit *new_hits = realloc(hits->hits, capacity * sizeof(*new_hits));
+		if (new_hits == NULL) {
+			atomic_store(&worker->pool->failed, true);
+			return;
+		}
+		hits->hits = new_hits;
+		hits->capacity = capacity;
+	}
+	hits->hits[hits->count].gadget = gadget;
+	hits->hits[hits->count].address = address;
+	hits->count++;
+}
+
+static int compare_hits(const void *a, const void *b) {
+	const struct scan_hit *ha = a, *hb = b;
+	if (ha->address != hb->address) {
+		return (ha->address > hb->address) - (ha->address < hb->address);
+	}
+	return (ha->gadget > hb->gadget) - (ha->gadget < hb->gadget);
+}
+
+// Mark the chunk done and pass the matches of every completed chunk that isn't waiting on an
+// earlier one to the caller's state. This keeps the reported matches in address order, so
+// the caller's limit on matches per gadget applies to the lowest ones.
+static void report_hits(struct scan_worker *worker, size_t chunk) {
+	struct scan_pool *pool = worker->pool;
+	pthread_mutex_lock(&pool->lock);
+	pool->hits[chunk].done = true;
+	while (pool->next_report < pool->count && pool->hits[pool->next_report].done) {
+		struct scan_hits *hits = &pool->hits[pool->next_report];
+		for (size_t i = 0; i < hits->count; i++) {
+			matcher_state_report(pool->matcher, pool->state, hits->hits[i].gadget,
+					hits->hits[i].address);
+		}
+		free(hits->hits);
+		hits->hits = NULL;
+		pool->next_report++;
+	}
+	atomic_store(&pool->unresolved, pool->state->remaining);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Publish the worker's matches, keeping the lowest address for each gadget.
+static void publish_matches(struct scan_worker *worker) {
+	struct scan_pool *pool = worker->pool;
+	for (size_t i = 0; i < pool->matcher->count; i++) {
+		uint64_t address = worker->state.addresses[i];
+		if (address == 0) {
+			continue;
+		}
+		uint64_t best = atomic_load(&pool->best[i]);
+		while (best == 0 || address < best) {
+			if (atomic_compare_exchange_weak(&pool->best[i], &best, address)) {
+				if (best == 0) {
+					atomic_fetch_sub(&pool->unresolved, 1);
+				}
+				break;
+			}
+		}
+	}
+}
+
+// Drop the gadgets that other workers have already found below address.
+static void drop_found(struct scan_worker *worker, uint64_t address) {
+	struct scan_pool *pool = worker->pool;
+	for (size_t i = 0; i < pool->matcher->count; i++) {
+		if (worker->state.resolved[i]) {
+			continue;
+		}
+		uint64_t best = atomic_load(&pool->best[i]);
+		if (best != 0 && best < address) {
+			matcher_state_drop(pool->matcher, &worker->state, i);
+		}
+	}
+}
+
+// Chunks are handed out in increasing address order and each match is only reported by the
+// chunk it starts in, so every match published so far lies below the start of any chunk not
+// yet handed out. Once every gadget has been found, there is nothing left to do.
+//
+// In all-matches mode, each worker buffers the matches of its current chunk. A worker's own
+// limit on matches per gadget is still safe to apply, since the chunks it scans are in
+// increasing address order.
+static void *scan_worker_main(void *arg) {
+	struct scan_worker *worker = arg;
+	struct scan_pool *pool = worker->pool;
+	for (;;) {
+		if (atomic_load(&pool->unresolved) == 0) {
+			break;
+		}
+		size_t i = atomic_fetch_add(&pool->next, 1);
+		if (i >= pool->count) {
+			break;
+		}
+		const struct scan_chunk *chunk = &pool->chunks[i];
+		if (pool->wait != NULL) {
+			pool->wait(pool->wait_context, chunk->data, chunk->size + chunk->tail);
+		}
+		uint64_t bytes = worker->stats.bytes;
+		if (pool->hits != NULL) {
+			worker->chunk_hits = &pool->hits[i];
+			matcher_scan(pool->matcher, &worker->state, chunk->data, chunk->address,
+					chunk->size, chunk->tail);
+			// Gadgets dispatched on a later word are found after the matches that
+			// start just past them.
+			struct scan_hits *hits = worker->chunk_hits;
+			if (pool->matcher->max_anchor > 0 && hits->count > 1) {
+				qsort(hits->hits, hits->count, sizeof(*hits->hits), compare_hits);
+			}
+			report_hits(worker, i);
+		} else {
+			drop_found(worker, chunk->address);
+			matcher_scan(pool->matcher, &worker->state, chunk->data, chunk->address,
+					chunk->size, chunk->tail);
+			publish_matches(worker);
+		}
+		if (pool->chunk_bytes != NULL) {
+			pool->chunk_bytes[i] = worker->stats.bytes - bytes;
+		}
+	}
+	return NULL;
+}
+
+static int compare_ranges(const void *a, const void *b) {
+	uint64_t addr_a = ((const struct sorted_range *)a)->range.address;
+	uint64_t addr_b = ((const struct sorted_range *)b)->range.address;
+	return (addr_a > addr_b) - (addr_a < addr_b);
+}
+
+// Split the ranges into chunks. Each chunk can read up to overlap bytes into the next one so
+// that matches straddling the boundary are found. Returns the number of chunks.
+static size_t split_ranges(const struct sorted_range *ranges, size_t count, size_t overlap,
+		struct scan_chunk *chunks) {
+	size_t nchunks = 0;
+	for (size_t i = 0; i < count; i++) {
+		const struct scan_range *r = &ranges[i].range;
+		for (size_t off = 0; off < r->size; off += SCAN_CHUNK_SIZE) {
+			size_t size = r->size - off;
+			size_t tail = 0;
+			if (size > SCAN_CHUNK_SIZE) {
+				tail = size - SCAN_CHUNK_SIZE;
+				tail = (tail < overlap ? tail : overlap);
+				size = SCAN_CHUNK_SIZE;
+			}
+			if (chunks != NULL) {
+				chunks[nchunks].data = (const uint8_t *)r->data + off;
+				chunks[nchunks].address = r->address + off;
+				chunks[nchunks].size = size;
+				chunks[nchunks].tail = tail;
+				chunks[nchunks].range = ranges[i].index;
+			}
+			nchunks++;
+		}
+	}
+	return nchunks;
+}
+
+static bool scan_sorted_ranges(const struct matcher *matcher, struct matcher_state *state,
+		const struct sorted_range *ranges, size_t count, unsigned threads,
+		scan_wait_fn wait, void *context, uint64_t *scanned) {
+	if (state->stats == NULL) {
+		scanned = NULL;
+	}
+	// Matches are passed straight to the caller's state only if they come out in address order.
+	if (threads <= 1 && wait == NULL && (state->hit == NULL || matcher->max_anchor == 0)) {
+		for (size_t i = 0; i < count && state->remaining != 0; i++) {
+			const struct scan_range *r = &ranges[i].range;
+			uint64_t bytes = (scanned != NULL ? state->stats->bytes : 0);
+			matcher_scan(matcher, state, r->data, r->address, r->size, 0);
+			if (scanned != NULL) {
+				scanned[ranges[i].index] += state->stats->bytes - bytes;
+			}
+		}
+		return true;
+	}
+	threads = (threads < 1 ? 1 : threads);
+	size_t overlap = (matcher->max_size > 0 ? matcher->max_size - 1 : 0);
+	size_t nchunks = split_ranges(ranges, count, overlap, NULL);
+	struct scan_chunk *chunks = malloc(nchunks * sizeof(*chunks) + 1);
+	struct scan_worker *workers = calloc(threads, sizeof(*workers));
+	_Atomic uint64_t *best = calloc(matcher->count + 1, sizeof(*best));
+	struct scan_hits *hits = NULL;
+	if (state->hit != NULL) {
+		hits = calloc(nchunks + 1, sizeof(*hits));
+	}
+	uint64_t *chunk_bytes = NULL;
+	if (scanned != NULL) {
+		chunk_bytes = calloc(nchunks + 1, sizeof(*chunk_bytes));
+	}
+	bool success = (chunks != NULL && workers != NULL && best != NULL
+			&& (state->hit == NULL || hits != NULL)
+			&& (scanned == NULL || chunk_bytes != NULL));
+	if (!success) {
+		goto fail;
+	}
+	split_ranges(ranges, count, overlap, chunks);
+	struct scan_pool pool = { matcher, chunks, nchunks, 0, best, state->remaining,
+		state, hits, 0, PTHREAD_MUTEX_INITIALIZER, false, wait, context, chunk_bytes };
+	// Gadgets already resolved in the caller's state don't need to be found again.
+	unsigned nworkers = 0;
+	for (; nworkers < threads; nworkers++) {
+		struct scan_worker *worker = &workers[nworkers];
+		worker->pool = &pool;
+		if (!matcher_state_init(&worker->state, matcher)) {
+			success = false;
+			break;
+		}
+		if (hits != NULL) {
+			matcher_state_report_all(&worker->state, buffer_hit, worker,
+					state->max_hits);
+		}
+		// Each worker counts privately, and the counts are merged once the scan is done.
+		if (state->stats != NULL) {
+			matcher_state_collect_stats(&worker->state, &worker->stats);
+		}
+		for (size_t i = 0; i < matcher->count; i++) {
+			if (state->resolved[i]) {
+				matcher_state_drop(matcher, &worker->state, i);
+			}
+		}
+	}
+	if (success) {
+		// Worker 0 runs on the calling thread. If a thread can't be created, the
+		// remaining workers simply pick up its share of the chunks.
+		for (unsigned i = 1; i < nworkers; i++) {
+			int err = pthread_create(&workers[i].thread, NULL, scan_worker_main,
+					&workers[i]);
+			workers[i].started = (err == 0);
+		}
+		scan_worker_main(&workers[0]);
+		for (unsigned i = 1; i < nworkers; i++) {
+			if (workers[i].started) {
+				pthread_join(workers[i].thread, NULL);
+			}
+		}
+		for (size_t i = 0; hits == NULL && i < matcher->count; i++) {
+			if (best[i] != 0) {
+				matcher_state_record(matcher, state, i, best[i]);
+			}
+		}
+		success = !atomic_load(&pool.failed);
+	}
+	for (unsigned i = 0; i < nworkers; i++) {
+		if (state->stats != NULL) {
+			matcher_stats_add(state->stats, &workers[i].stats);
+		}
+		matcher_state_deinit(&workers[i].state);
+	}
+	for (size_t i = 0; success && chunk_bytes != NULL && i < nchunks; i++) {
+		scanned[chunks[i].range] += chunk_bytes[i];
+	}
+fail:
+	for (size_t i = 0; hits != NULL && i < nchunks; i++) {
+		free(hits[i].hits);
+	}
+	free(hits);
+	free(chunk_bytes);
+	free(best);
+	free(workers);
+	free(chunks);
+	return success;
+}
+
+bool scan_ranges(const struct matcher *matcher, struct matcher_state *state,
+		const struct scan_range *ranges, size_t count, unsigned threads,
+		scan_wait_fn wait, void *context, uint64_t *scanned) {
+	struct sorted_range *sorted = malloc(count * sizeof(*sorted) + 1);
+	if (sorted == NULL) {
+		return false;
+	}
+	for (size_t i = 0; i < count; i++) {
+		sorted[i].range = ranges[i];
+		sorted[i].index = i;
+	}
+	qsort(sorted, count, sizeof(*sorted), compare_ranges);
+	bool success = scan_sorted_ranges(matcher, state, sorted, count, threads, wait, context,
+			scanned);
+	free(sorted);
+	return success;
+}
+
+size_t scan_sample(const struct scan_range *ranges, size_t count, uint32_t *sample,
+		size_t max_words) {
+	if (max_words == 0) {
+		return 0;
+	}
+	size_t total = 0;
+	for (size_t i = 0; i < count; i++) {
+		total += ranges[i].size / sizeof(uint32_t);
+	}
+	// If all of the data fits, it is the sample. Otherwise take evenly spaced blocks of
+	// words, so that the sample covers every part of the data.
+	size_t block = SCAN_SAMPLE_BLOCK;
+	size_t stride = total;
+	if (total > max_words) {
+		size_t nblocks = (max_words + block - 1) / block;
+		block = max_words / nblocks;
+		stride = total / nblocks;
+	}
+	size_t nsample = 0;
+	size_t next = 0;
+	size_t base = 0;
+	for (size_t i = 0; i < count; i++) {
+		const uint8_t *data = ranges[i].data;
+		size_t words = ranges[i].size / sizeof(uint32_t);
+		if (total <= max_words) {
+			memcpy(&sample[nsample], data, words * sizeof(uint32_t));
+			nsample += words;
+			continue;
+		}
+		for (; next < base + words && nsample < max_words; next += stride) {
+			size_t w = next - base;
+			size_t n = words - w;
+			n = (n < block ? n : block);
+			n = (n < max_words - nsample ? n : max_words - nsample);
+			memcpy(&sample[nsample], data + w * sizeof(uint32_t), n * sizeof(uint32_t));
+			nsample += n;
+		}
+		base += words;
+	}
+	return nsample;
+}
@@ -0,0 +1,89 @@
+#ifndef MACHO_GADGETS__SCAN_H_
+#define MACHO_GADGETS__SCAN_H_
+
+#include "matcher.h"
+
+/*
+ * struct scan_range
+ *
+ * Description:
+ * 	A block of data to scan, along with its runtime address.
+ */
+struct scan_range {
+	const void *data;
+	uint64_t address;
+	size_t size;
+};
+
+/*
+ * scan_wait_fn
+ *
+ * Description:
+ * 	A callback that blocks until the given data is ready to be read. This lets ranges be
+ * 	scanned while they are still being produced, for example by a decompressor.
+ *
+ * Parameters:
+ * 		context			Client context.
+ * 		data			The start of the data about to be scanned.
+ * 		size			The number of bytes that will be read.
+ */
+typedef void (*scan_wait_fn)(void *context, const void *data, size_t size);
+
+/*
+ * scan_ranges
+ *
+ * Description:
+ * 	Scan the given ranges for the matcher's unresolved gadgets using a pool of worker threads.
+ * 	The ranges are scanned in order of increasing address, so the lowest match of each gadget
+ * 	is the one recorded, and scanning stops once every gadget has been found.
+ *
+ * 	When more than one thread is used, each range is split into chunks that overlap by the
+ * 	size of the longest gadget minus one, so that no match straddling a chunk boundary is
+ * 	missed. The threads scan into private states and share the lowest address found for each
+ * 	gadget, so that each thread stops looking for a gadget once it is known below the chunk
+ * 	being scanned. The results are the same regardless of the number of threads.
+ *
+ * Parameters:
+ * 		matcher			The matcher.
+ * 		state			The scan state to update.
+ * 		ranges			The ranges to scan.
+ * 		count			The number of ranges.
+ * 		threads			The maximum number of threads to use, including the
+ * 					calling thread.
+ * 		wait			If not NULL, called before each chunk is scanned. The
+ * 					ranges are then always scanned in chunks, so that
+ * 					scanning can start before a range is complete.
+ * 		context			Client context for wait.
+ * 		scanned			If not NULL and the state collects stats, the number
+ * 					of bytes of each range scanned before the scan stopped
+ * 					is added to the corresponding element. The stats of
+ * 					all the threads are added to the state's stats.
+ *
+ * Returns:
+ * 	True on success, false if memory could not be allocated.
+ */
+bool scan_ranges(const struct matcher *matcher, struct matcher_state *state,
+		const struct scan_range *ranges, size_t count, unsigned threads,
+		scan_wait_fn wait, void *context, uint64_t *scanned);
+
+/*
+ * scan_sample
+ *
+ * Description:
+ * 	Copy a sample of the aligned words in the given ranges, for choosing the words that
+ * 	gadgets are dispatched on with matcher_init_anchored. If the ranges hold more than
+ * 	max_words words, the sample is made of evenly spaced blocks of consecutive words.
+ *
+ * Parameters:
+ * 		ranges			The ranges to sample. Their data must be ready to read.
+ * 		count			The number of ranges.
+ * 	out	sample			An array of max_words words to fill in.
+ * 		max_words		The size of the sample array.
+ *
+ * Returns:
+ * 	The number of words in the sample.
+ */
+size_t scan_sample(const struct scan_range *ranges, size_t count, uint32_t *sample,
+		size_t max_words);
+
+#endif
@@ -0,0 +1,680 @@
+#include "server.h"
+
+#include "gadget_index.h"
+#include "gadget_set.h"
+#include "kernelcache.h"
+#include "macho.h"
+#include "output.h"
+#include "range_list.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// The number of accepted connections that can wait for a worker.
+#define SERVER_QUEUE_SIZE 64
+
+// Like the command line tool, scan only the sections marked as holding instructions.
+static const struct range_filter code_sections = { .sections = true };
+
+// The symbol table of an image or of one of its fileset entries, with its indexes.
+struct server_symtab {
+	struct macho macho;
+	const struct symtab_command *symtab;
+};
+
+// An image kept open by the server. While opening is true, the image is being opened by the
+// thread that added it, and its other fields may only be used by that thread.
+struct server_image {
+	struct server_image *next;
+	char *path;
+	bool opening;
+	void *file;
+	size_t file_size;
+	struct kernelcache *kc;
+	struct macho macho;
+	struct server_symtab *symtabs;
+	size_t nsymtabs;
+	// The code sections, which the index lookups are limited to.
+	struct range_list ranges;
+	bool indexed;
+	struct gadget_index index;
+};
+
+struct server {
+	const struct server_options *options;
+	// The open images. Images are never closed, so an image stays valid once it is found. An
+	// image is added to the list before it is opened, so that other batches naming it wait
+	// for it on images_opened rather than opening it again, and it is removed if it can't be
+	// opened. The lock is only held to search and update the list.
+	struct server_image *images;
+	pthread_mutex_t images_lock;
+	pthread_cond_t images_opened;
+	// The accepted connections waiting for a worker.
+	int queue[SERVER_QUEUE_SIZE];
+	size_t queue_head;
+	size_t queue_count;
+	pthread_mutex_t queue_lock;
+	pthread_cond_t queue_nonempty;
+	pthread_cond_t queue_nonfull;
+};
+
+// A batch of queries against one image. Each query is a "gadget" or "symbol" line.
+struct batch {
+	char *image;
+	unsigned align;
+	char **queries;
+	size_t count;
+	size_t capacity;
+	// A description of the first error in the batch.
+	char error[256];
+};
+
+static void format_error(char *error, size_t size, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void format_error(char *error, size_t size, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(error, size, fmt, ap);
+	va_end(ap);
+}
+
+static void free_image(struct server_image *image) {
+	for (size_t i = 0; i < image->nsymtabs; i++) {
+		macho_free_indexes(&image->symtabs[i].macho);
+	}
+	free(image->symtabs);
+	range_list_free(&image->ranges);
+	if (image->indexed) {
+		gadget_index_close(&image->index);
+	}
+	if (image->kc != NULL) {
+		kernelcache_close(image->kc);
+		free(image->kc);
+	}
+	if (image->file != NULL) {
+		munmap(image->file, image->file_size);
+	}
+	free(image->path);
+	free(image);
+}
+
+// Map the image's file, decompressing it if it is a compressed kernelcache.
+static bool map_image(struct server_image *image, char *error, size_t error_size) {
+	int fd = open(image->path, O_RDONLY);
+	if (fd < 0) {
+		format_error(error, error_size, "Could not open '%s'", image->path);
+		return false;
+	}
+	struct stat st;
+	void *file = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (file == MAP_FAILED) {
+		format_error(error, error_size, "Could not map '%s'", image->path);
+		return false;
+	}
+	image->file = file;
+	image->file_size = st.st_size;
+	image->macho.mh = file;
+	image->macho.size = st.st_size;
+	if (kernelcache_format(file, st.st_size) == KERNELCACHE_NONE) {
+		return true;
+	}
+	struct kernelcache *kc = malloc(sizeof(*kc));
+	if (kc == NULL) {
+		format_error(error, error_size, "Could not allocate kernelcache");
+		return false;
+	}
+	if (!kernelcache_open(kc, file, st.st_size)) {
+		format_error(error, error_size, "Could not decompress '%s': %s", image->path,
+				kc->error);
+		free(kc);
+		return false;
+	}
+	image->kc = kc;
+	if (!kernelcache_finish(kc)) {
+		format_error(error, error_size, "Could not decompress '%s': %s", image->path,
+				kc->error);
+		return false;
+	}
+	image->macho.mh = kc->data;
+	image->macho.size = kc->size;
+	return true;
+}
+
+// Add the symbol table of the Mach-O, if it has one, and index it.
+static bool add_symtab(struct server_image *image, const struct macho *macho, char *error,
+		size_t error_size) {
+	const struct symtab_command *symtab = (const struct symtab_command *)
+		macho_find_load_command(macho, NULL, LC_SYMTAB);
+	if (symtab == NULL) {
+		return true;
+	}
+	struct server_symtab *symtabs = realloc(image->symtabs,
+			(image->nsymtabs + 1) * sizeof(*symtabs));
+	if (symtabs == NULL) {
+		format_error(error, error_size, "Could not allocate symbol tables");
+		return false;
+	}
+	image->symtabs = symtabs;
+	struct server_symtab *st = &symtabs[image->nsymtabs++];
+	st->macho = *macho;
+	st->macho.symbol_index = NULL;
+	st->macho.name_index = NULL;
+	st->macho.layout = NULL;
+	st->symtab = symtab;
+	if (macho_index_symbols(&st->macho, symtab) != MACHO_SUCCESS
+			|| macho_index_symbol_names(&st->macho, symtab) != MACHO_SUCCESS
+			|| macho_index_layout(&st->macho) != MACHO_SUCCESS) {
+		format_error(error, error_size, "Could not index the symbols of '%s': %s",
+				image->path, range_list_macho_error());
+		return false;
+	}
+	return true;
+}
+
+// Find the symbol tables of the image and of each of its fileset entries.
+static bool add_symtabs(struct server_image *image, char *error, size_t error_size) {
+	if (!add_symtab(image, &image->macho, error, error_size)) {
+		return false;
+	}
+	const struct load_command *lc = NULL;
+	while (macho_is_fileset(&image->macho)) {
+		lc = macho_find_load_command(&image->macho, lc, LC_FILESET_ENTRY);
+		if (lc == NULL) {
+			break;
+		}
+		struct macho entry;
+		if (macho_fileset_entry(&image->macho, lc, &entry, NULL) != MACHO_SUCCESS) {
+			format_error(error, error_size, "Malformed fileset entry in '%s': %s",
+					image->path, range_list_macho_error());
+			return false;
+		}
+		if (!add_symtab(image, &entry, error, error_size)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Add the executable ranges of the image, or of every kext in a fileset, to the list.
+static bool add_image_ranges(struct range_list *list, const struct macho *macho, char *error,
+		size_t error_size) {
+	bool success = (macho_is_fileset(macho)
+			? range_list_add_fileset(list, macho, NULL, 0)
+			: range_list_add_macho(list, macho));
+	if (!success) {
+		format_error(error, error_size, "%s", list->error);
+	}
+	return success;
+}
+
+// Index the image's executable segments so that batches against it are answered with
+// lookups rather than scans. With an index directory, the index is kept there; it is opened if
+// it exists and built otherwise, and images without an LC_UUID are scanned instead. Without
+// one, the index is built in memory. Only arm64 images, which are searched aligned, are
+// indexed.
+//
+// The index covers whole segments, so the code sections that a scan would cover are also
+// found, to limit the lookups to them.
+static bool index_image(struct server *server, struct server_image *image, char *error,
+		size_t error_size) {
+	const struct macho *macho = &image->macho;
+	if (macho->mh32->cputype != CPU_TYPE_ARM64) {
+		return true;
+	}
+	const char *index_dir = server->options->index_dir;
+	const struct uuid_command *uc = (const struct uuid_command *)
+		macho_find_load_command(macho, NULL, LC_UUID);
+	if (index_dir != NULL && uc == NULL) {
+		return true;
+	}
+	static const uint8_t no_uuid[16];
+	const uint8_t *uuid = (uc != NULL ? uc->uuid : no_uuid);
+	char path[4096];
+	if (index_dir != NULL && !gadget_index_path(path, sizeof(path), index_dir, uuid)) {
+		format_error(error, error_size, "Index directory path is too long");
+		return false;
+	}
+	range_list_init(&image->ranges);
+	image->ranges.filter = &code_sections;
+	if (!add_image_ranges(&image->ranges, macho, error, error_size)) {
+		return false;
+	}
+	// Without code sections there is nothing to look up, and scanning them is free.
+	if (image->ranges.count == 0) {
+		return true;
+	}
+	if (index_dir == NULL || !gadget_index_open(&image->index, path, uuid)) {
+		struct range_list ranges;
+		range_list_init(&ranges);
+		bool success = add_image_ranges(&ranges, macho, error, error_size);
+		if (success && index_dir == NULL) {
+			if (!gadget_index_create(&image->index, ranges.ranges, ranges.count, uuid)) {
+				format_error(error, error_size, "Could not allocate gadget index");
+				success = false;
+			}
+		} else if (success && (!gadget_index_build(ranges.ranges, ranges.count, uuid, path)
+				|| !gadget_index_open(&image->index, path, uuid))) {
+			format_error(error, error_size, "Could not build gadget index '%s'", path);
+			success = false;
+		}
+		range_list_free(&ranges);
+		if (!success) {
+			return false;
+		}
+	}
+	image->indexed = true;
+	return true;
+}
+
+// Open the image: map it, validate it, and build its indexes.
+static bool open_image(struct server *server, struct server_image *image, char *error,
+		size_t error_size) {
+	if (!map_image(image, error, error_size)) {
+		return false;
+	}
+	if (macho_validate(image->macho.mh, image->macho.size) != MACHO_SUCCESS) {
+		format_error(error, error_size, "'%s' is not a valid Mach-O file: %s", image->path,
+				range_list_macho_error());
+		return false;
+	}
+	// Index the symbols with as many threads as there are workers.
+	image->macho.index_threads = server->options->workers;
+	return add_symtabs(image, error, error_size)
+		&& index_image(server, image, error, error_size);
+}
+
+// Find an open image by path, opening it if needed. Batches naming an image that another
+// batch is opening wait for it; batches naming other images don't.
+static struct server_image *find_image(struct server *server, const char *path, char *error,
+		size_t error_size) {
+	char *real_path = realpath(path, NULL);
+	if (real_path == NULL) {
+		format_error(error, error_size, "Could not open '%s'", path);
+		return NULL;
+	}
+	pthread_mutex_lock(&server->images_lock);
+	struct server_image *image;
+	for (;;) {
+		image = server->images;
+		while (image != NULL && strcmp(image->path, real_path) != 0) {
+			image = image->next;
+		}
+		if (image == NULL || !image->opening) {
+			break;
+		}
+		// The image may be removed if it can't be opened, so search again once it is.
+		pthread_cond_wait(&server->images_opened, &server->images_lock);
+	}
+	if (image != NULL) {
+		pthread_mutex_unlock(&server->images_lock);
+		free(real_path);
+		return image;
+	}
+	image = calloc(1, sizeof(*image));
+	if (image == NULL) {
+		pthread_mutex_unlock(&server->images_lock);
+		free(real_path);
+		format_error(error, error_size, "Could not allocate image");
+		return NULL;
+	}
+	image->path = real_path;
+	image->opening = true;
+	image->next = server->images;
+	server->images = image;
+	pthread_mutex_unlock(&server->images_lock);
+	bool success = open_image(server, image, error, error_size);
+	pthread_mutex_lock(&server->images_lock);
+	image->opening = false;
+	if (!success) {
+		struct server_image **link = &server->images;
+		while (*link != image) {
+			link = &(*link)->next;
+		}
+		*link = image->next;
+	}
+	pthread_cond_broadcast(&server->images_opened);
+	pthread_mutex_unlock(&server->images_lock);
+	if (!success) {
+		free_image(image);
+		return NULL;
+	}
+	return image;
+}
+
+// Find the gadgets of the batch in the image, storing the address of each in addresses.
+static bool find_batch_gadgets(struct server *server, struct server_image *image,
+		struct gadget_set *set, unsigned align, uint64_t *addresses, char *error,
+		size_t error_size) {
+	if (!gadget_set_compile(set, align)) {
+		format_error(error, error_size, "%s", set->error);
+		return false;
+	}
+	struct matcher *matcher = &set->matchers[align == 4];
+	if (!server->options->simd) {
+		matcher->kernel = MATCHER_KERNEL_SCALAR;
+	}
+	if (!image->indexed || align != 4) {
+		struct gadget_scan_options options = { .align = align, .filter = &code_sections };
+		struct gadget_results results = {};
+		bool success = gadget_set_scan(set, &image->macho, &options, &results);
+		if (success) {
+			memcpy(addresses, results.addresses, set->count * sizeof(*addresses));
+		} else {
+			format_error(error, error_size, "%s", results.error);
+		}
+		gadget_results_free(&results);
+		return success;
+	}
+	struct matcher_state state;
+	if (!matcher_state_init(&state, matcher)) {
+		format_error(error, error_size, "Could not allocate scan state");
+		return false;
+	}
+	bool success = gadget_index_scan(&image->index, matcher, &state, image->ranges.ranges,
+			image->ranges.count);
+	if (success) {
+		memcpy(addresses, state.addresses, set->count * sizeof(*addresses));
+	} else {
+		format_error(error, error_size, "Could not allocate index matches");
+	}
+	matcher_state_deinit(&state);
+	return success;
+}
+
+// Look up a symbol in each of the image's symbol tables in turn.
+static uint64_t find_symbol(const struct server_image *image, const char *symbol) {
+	for (size_t i = 0; i < image->nsymtabs; i++) {
+		const struct server_symtab *st = &image->symtabs[i];
+		uint64_t address;
+		size_t size;
+		if (macho_resolve_symbol(&st->macho, st->symtab, symbol, &address, &size)
+				== MACHO_SUCCESS) {
+			return address;
+		}
+	}
+	return 0;
+}
+
+// Answer the queries of a batch in order, one "name = address" line each, with address 0 for
+// gadgets and symbols that weren't found.
+static bool answer_batch(struct server *server, const struct batch *batch, struct output *out,
+		char *error, size_t error_size) {
+	if (batch->image == NULL) {
+		format_error(error, error_size, "No image given");
+		return false;
+	}
+	struct server_image *image = find_image(server, batch->image, error, error_size);
+	if (image == NULL) {
+		return false;
+	}
+	struct gadget_set set;
+	gadget_set_init(&set);
+	bool success = true;
+	for (size_t i = 0; success && i < batch->count; i++) {
+		if (strncmp(batch->queries[i], "gadget ", 7) == 0
+				&& !gadget_set_add(&set, batch->queries[i] + 7)) {
+			format_error(error, error_size, "%s", set.error);
+			success = false;
+		}
+	}
+	unsigned align = batch->align;
+	if (align == 0) {
+		align = (image->macho.mh32->cputype == CPU_TYPE_ARM64 ? 4 : 1);
+	}
+	uint64_t *addresses = NULL;
+	if (success) {
+		addresses = calloc(set.count + 1, sizeof(*addresses));
+		if (addresses == NULL) {
+			format_error(error, error_size, "Could not allocate results");
+			success = false;
+		}
+	}
+	if (success && set.count > 0) {
+		success = find_batch_gadgets(server, image, &set, align, addresses, error,
+				error_size);
+	}
+	size_t gadget = 0;
+	for (size_t i = 0; success && i < batch->count; i++) {
+		const char *query = batch->queries[i];
+		const char *name;
+		uint64_t address;
+		if (query[0] == 'g') {
+			name = set.gadgets[gadget].name;
+			address = addresses[gadget++];
+		} else {
+			name = query + 7;
+			address = find_symbol(image, name);
+		}
+		if (address == 0) {
+			output_printf(out, "%s = 0\n", name);
+		} else {
+			output_printf(out, "%s = 0x%llx\n", name, (unsigned long long)address);
+		}
+	}
+	free(addresses);
+	gadget_set_free(&set);
+	return success;
+}
+
+static void batch_reset(struct batch *batch) {
+	for (size_t i = 0; i < batch->count; i++) {
+		free(batch->queries[i]);
+	}
+	free(batch->image);
+	batch->image = NULL;
+	batch->align = 0;
+	batch->count = 0;
+	batch->error[0] = 0;
+}
+
+// Add a request line to the batch. Errors are kept in the batch and reported when it ends.
+static void batch_add_line(struct batch *batch, const char *line) {
+	if (batch->error[0] != 0) {
+		return;
+	}
+	if (strncmp(line, "image ", 6) == 0) {
+		free(batch->image);
+		batch->image = strdup(line + 6);
+		if (batch->image == NULL) {
+			format_error(batch->error, sizeof(batch->error),
+					"Could not allocate batch");
+		}
+		return;
+	}
+	if (strcmp(line, "align 1") == 0 || strcmp(line, "align 4") == 0) {
+		batch->align = line[6] - '0';
+		return;
+	}
+	if (strncmp(line, "gadget ", 7) != 0 && strncmp(line, "symbol ", 7) != 0) {
+		format_error(batch->error, sizeof(batch->error), "Invalid request line '%s'", line);
+		return;
+	}
+	if (batch->count == batch->capacity) {
+		size_t capacity = (batch->capacity == 0 ? 64 : 2 * batch->capacity);
+		char **queries = realloc(batch->queries, capacity * sizeof(*queries));
+		if (queries == NULL) {
+			format_error(batch->error, sizeof(batch->error),
+					"Could not allocate batch");
+			return;
+		}
+		batch->queries = queries;
+		batch->capacity = capacity;
+	}
+	batch->queries[batch->count] = strdup(line);
+	if (batch->queries[batch->count] == NULL) {
+		format_error(batch->error, sizeof(batch->error), "Could not allocate batch");
+		return;
+	}
+	batch->count++;
+}
+
+// Answer batches on a connection until the client closes it. Each batch ends with a blank
+// line, and so does each response.
+static void serve_connection(struct server *server, int fd) {
+	int in_fd = dup(fd);
+	FILE *in = (in_fd >= 0 ? fdopen(in_fd, "r") : NULL);
+	struct output out;
+	if (in == NULL || !output_init(&out, fd, 1 << 16)) {
+		if (in != NULL) {
+			fclose(in);
+		} else if (in_fd >= 0) {
+			close(in_fd);
+		}
+		return;
+	}
+	struct batch batch = {};
+	char *line = NULL;
+	size_t capacity = 0;
+	for (;;) {
+		ssize_t length = getline(&line, &capacity, in);
+		bool end = (length < 0);
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+			line[--length] = 0;
+		}
+		if (!end && length > 0) {
+			batch_add_line(&batch, line);
+			continue;
+		}
+		if (batch.image != NULL || batch.count > 0 || batch.error[0] != 0) {
+			char error[256];
+			if (batch.error[0] != 0) {
+				output_printf(&out, "error %s\n", batch.error);
+			} else if (!answer_batch(server, &batch, &out, error, sizeof(error))) {
+				output_printf(&out, "error %s\n", error);
+			}
+			output_printf(&out, "\n");
+			if (!output_flush(&out)) {
+				break;
+			}
+		}
+		batch_reset(&batch);
+		if (end) {
+			break;
+		}
+	}
+	batch_reset(&batch);
+	free(batch.queries);
+	free(line);
+	fclose(in);
+	output_deinit(&out);
+}
+
+static void *server_worker_main(void *arg) {
+	struct server *server = arg;
+	for (;;) {
+		pthread_mutex_lock(&server->queue_lock);
+		while (server->queue_count == 0) {
+			pthread_cond_wait(&server->queue_nonempty, &server->queue_lock);
+		}
+		int fd = server->queue[server->queue_head];
+		server->queue_head = (server->queue_head + 1) % SERVER_QUEUE_SIZE;
+		server->queue_count--;
+		pthread_cond_signal(&server->queue_nonfull);
+		pthread_mutex_unlock(&server->queue_lock);
+		serve_connection(server, fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+static void queue_connection(struct server *server, int fd) {
+	pthread_mutex_lock(&server->queue_lock);
+	while (server->queue_count == SERVER_QUEUE_SIZE) {
+		pthread_cond_wait(&server->queue_nonfull, &server->queue_lock);
+	}
+	size_t tail = (server->queue_head + server->queue_count) % SERVER_QUEUE_SIZE;
+	server->queue[tail] = fd;
+	server->queue_count++;
+	pthread_cond_signal(&server->queue_nonempty);
+	pthread_mutex_unlock(&server->queue_lock);
+}
+
+// Create the listening socket. A stale socket left by an earlier server is replaced.
+static int listen_socket(const char *path, char *error, size_t error_size) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		format_error(error, error_size, "Socket path '%s' is too long", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		format_error(error, error_size, "Could not create socket");
+		return -1;
+	}
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+	if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0
+			|| listen(fd, SOMAXCONN) != 0) {
+		format_error(error, error_size, "Could not listen on '%s': %s", path,
+				strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool server_run(const struct server_options *options, char *error, size_t error_size) {
+	struct server server = {
+		.options         = options,
+		.images_lock     = PTHREAD_MUTEX_INITIALIZER,
+		.images_opened   = PTHREAD_COND_INITIALIZER,
+		.queue_lock      = PTHREAD_MUTEX_INITIALIZER,
+		.queue_nonempty  = PTHREAD_COND_INITIALIZER,
+		.queue_nonfull   = PTHREAD_COND_INITIALIZER,
+	};
+	for (size_t i = 0; i < options->nimages; i++) {
+		if (find_image(&server, options->images[i], error, error_size) == NULL) {
+			return false;
+		}
+	}
+	// A client that hangs up early shouldn't kill the server.
+	signal(SIGPIPE, SIG_IGN);
+	int fd = listen_socket(options->socket_path, error, error_size);
+	if (fd < 0) {
+		return false;
+	}
+	unsigned nworkers = 0;
+	for (unsigned i = 0; i < (options->workers > 0 ? options->workers : 1); i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, server_worker_main, &server) == 0) {
+			pthread_detach(thread);
+			nworkers++;
+		}
+	}
+	if (nworkers == 0) {
+		format_error(error, error_size, "Could not start server threads");
+		close(fd);
+		return false;
+	}
+	for (;;) {
+		int client = accept(fd, NULL, NULL);
+		if (client >= 0) {
+			queue_connection(&server, client);
+		} else if (errno != EINTR && errno != ECONNABORTED) {
+			format_error(error, error_size, "Could not accept connections: %s",
+					strerror(errno));
+			close(fd);
+			return false;
+		}
+	}
+}
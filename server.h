@@ -0,0 +1,51 @@
+#ifndef MACHO_GADGETS__SERVER_H_
+#define MACHO_GADGETS__SERVER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * struct server_options
+ *
+ * Description:
+ * 	The configuration of a gadget server.
+ *
+ * 	The given images are opened when the server starts, before it accepts connections; others
+ * 	are opened when a batch first names them. Aligned queries against arm64 images are
+ * 	answered from a gadget index built when the image is opened. With an index directory, the
+ * 	index is kept in that directory and only built if there isn't one yet, and images without
+ * 	an LC_UUID are scanned instead; without one, it is kept in memory.
+ */
+struct server_options {
+	const char *socket_path;
+	const char *index_dir;
+	unsigned workers;
+	bool simd;
+	const char **images;
+	size_t nimages;
+};
+
+/*
+ * server_run
+ *
+ * Description:
+ * 	Listen on a UNIX socket and answer batches of gadget and symbol queries against a pool of
+ * 	Mach-O images kept open in memory. The protocol is described in the README.
+ *
+ * 	Connections are handed to a pool of worker threads, and any number of batches may be sent
+ * 	on one connection. An image is opened the first time it is named in a batch and stays
+ * 	open, along with the symbol and layout indexes of its symbol tables and its gadget index,
+ * 	so later queries against it only pay for the lookups themselves.
+ *
+ * Parameters:
+ * 		options			The server configuration.
+ * 	out	error			On failure, a description of the problem.
+ * 		error_size		The size of the error buffer.
+ *
+ * Returns:
+ * 	False if the server could not be started or could no longer accept connections. It
+ * 	doesn't return otherwise.
+ */
+bool server_run(const struct server_options *options, char *error, size_t error_size);
+
+#endif